@@ -0,0 +1,226 @@
+#include "counter-records.h"
+#include "line-index.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// This tool attributes counters to source lines. It maps the address of every instrumentation
+// point, given in the third column of the instrumentation variable table, to a source line
+// through the DWARF line table of the instrumented code object, then adds up the counter files
+// written by the preload library (DYNINST_AMDGPU_OUTPUT) or merge-counters per source line.
+//
+// Nothing in this repository writes the third column: the mutator that writes the variable table
+// is expected to append the address of the point each variable counts, in the instrumented code
+// object, as a decimal or 0x-prefixed number. Counts of variables without one are unattributed.
+//
+// usage:
+// attribute-lines [--cache <index-file>] [--by-kernel] [--top <n>] <code-object> <var-table>
+//                 <counter-file>...
+//
+// The line index is cached in <code-object>.lines unless --cache says otherwise, so later runs
+// against the same code object only map it.
+
+static void showHelp(const char *toolName) {
+  std::cerr << "usage : \n";
+  std::cerr << "  ";
+  std::cerr << toolName << " [--cache <index-file>] [--by-kernel] [--top <n>] <code-object> "
+            << "<var-table> <counter-file>...\n\n";
+  std::cerr << toolName << " adds up counters by the source line of their instrumentation point\n";
+  std::cerr << "  --cache <index-file> caches the line index there (default <code-object>.lines)\n";
+  std::cerr << "  --by-kernel keeps the counters of different kernels apart\n";
+  std::cerr << "  --top <n> lists the <n> lines with the largest counts (default 50, 0 for all)\n";
+}
+
+static constexpr uint32_t kNoLocation = UINT32_MAX;
+
+struct Location {
+  const std::string *file;
+  uint32_t line;
+  uint32_t numPoints = 0;
+};
+
+struct LineCount {
+  uint32_t location;
+  uint64_t kernelHash;
+  uint64_t sum = 0;
+};
+
+int main(int argc, char **argv) {
+  std::string cachePath;
+  bool byKernel = false;
+  size_t top = 50;
+  std::vector<std::string> positional;
+
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg == "--cache" && i + 1 < argc) {
+      cachePath = argv[++i];
+    } else if (arg == "--by-kernel") {
+      byKernel = true;
+    } else if (arg == "--top" && i + 1 < argc) {
+      top = std::stoul(argv[++i]);
+    } else if (arg[0] == '-') {
+      showHelp(argv[0]);
+      exit(1);
+    } else {
+      positional.push_back(arg);
+    }
+  }
+
+  if (positional.size() < 3) {
+    showHelp(argv[0]);
+    exit(1);
+  }
+  const std::string &codeObjectPath = positional[0];
+  const std::string &varTablePath = positional[1];
+  if (cachePath.empty())
+    cachePath = codeObjectPath + ".lines";
+
+  LineIndex index;
+  std::string error = index.open(codeObjectPath, cachePath);
+  if (!error.empty()) {
+    std::cerr << "error : " << error << std::endl;
+    exit(1);
+  }
+
+  // <offset> <name> <address>, the variable index is the line number. Variables without an
+  // address aren't tied to an instrumentation point.
+  std::ifstream varTable(varTablePath);
+  if (!varTable) {
+    std::cerr << "error : can't open " << varTablePath << std::endl;
+    exit(1);
+  }
+
+  std::vector<Location> locations;
+  std::unordered_map<uint64_t, uint32_t> locationIndices; // by (file index, line)
+  std::unordered_map<const std::string *, uint32_t> fileIndices;
+  std::vector<uint32_t> varLocations;
+  size_t numUnmapped = 0;
+
+  std::string line;
+  while (std::getline(varTable, line)) {
+    std::stringstream ss(line);
+    std::string offset, name, address;
+    ss >> offset >> name >> address;
+
+    SourceLocation source;
+    if (!address.empty())
+      source = index.lookup(std::stoull(address, nullptr, 0));
+    if (!source.isKnown()) {
+      varLocations.push_back(kNoLocation);
+      numUnmapped += !address.empty();
+      continue;
+    }
+
+    uint32_t fileIndex = fileIndices.emplace(source.file, fileIndices.size()).first->second;
+    uint64_t key = (uint64_t(fileIndex) << 32) | source.line;
+    auto it = locationIndices.emplace(key, locations.size());
+    if (it.second)
+      locations.push_back({source.file, source.line});
+    ++locations[it.first->second].numPoints;
+    varLocations.push_back(it.first->second);
+  }
+
+  // Counter records are sorted by kernel, so with --by-kernel all counts of a kernel are added up
+  // before moving on to the next one, and one array of per-location sums is enough.
+  std::vector<LineCount> counts;
+  std::vector<uint64_t> sums(locations.size(), 0);
+  std::vector<uint32_t> touched;
+  std::vector<bool> isTouched(locations.size(), false);
+  CounterFileNames names;
+  uint64_t unattributed = 0;
+
+  auto flushSums = [&](uint64_t kernelHash) {
+    for (uint32_t location : touched) {
+      counts.push_back({location, kernelHash, sums[location]});
+      sums[location] = 0;
+      isTouched[location] = false;
+    }
+    touched.clear();
+  };
+
+  for (size_t i = 2; i < positional.size(); ++i) {
+    CounterFile counterFile;
+    error = counterFile.open(positional[i]);
+    if (!error.empty()) {
+      std::cerr << "error : " << error << std::endl;
+      exit(1);
+    }
+    error = counterFile.readNames(names);
+    if (!error.empty()) {
+      std::cerr << "error : " << error << std::endl;
+      exit(1);
+    }
+
+    uint64_t kernelHash = 0;
+    for (const CounterFileRecord &record : counterFile) {
+      if (byKernel && record.kernelHash != kernelHash) {
+        flushSums(kernelHash);
+        kernelHash = record.kernelHash;
+      }
+      uint32_t location =
+          record.varIndex < varLocations.size() ? varLocations[record.varIndex] : kNoLocation;
+      if (location == kNoLocation) {
+        unattributed += record.sum;
+        continue;
+      }
+      if (!isTouched[location]) {
+        isTouched[location] = true;
+        touched.push_back(location);
+      }
+      sums[location] += record.sum;
+    }
+    if (byKernel)
+      flushSums(kernelHash);
+  }
+  flushSums(0);
+
+  // The same kernel can appear in several files, and every location in touched once per flush.
+  std::sort(counts.begin(), counts.end(), [](const LineCount &a, const LineCount &b) {
+    return a.location != b.location ? a.location < b.location : a.kernelHash < b.kernelHash;
+  });
+  std::vector<LineCount> merged;
+  for (const LineCount &count : counts) {
+    if (!merged.empty() && merged.back().location == count.location &&
+        merged.back().kernelHash == count.kernelHash)
+      merged.back().sum += count.sum;
+    else
+      merged.push_back(count);
+  }
+
+  std::sort(merged.begin(), merged.end(),
+            [](const LineCount &a, const LineCount &b) { return a.sum > b.sum; });
+  uint64_t total = unattributed;
+  for (const LineCount &count : merged)
+    total += count.sum;
+
+  printf("line index : %zu entries (%s)\n", index.getNumEntries(),
+         index.isFromCache() ? "cached" : "built");
+  printf("instrumentation points : %zu, %zu source lines, %zu addresses without a line\n",
+         varLocations.size(), locations.size(), numUnmapped);
+  printf("unattributed count : %llu of %llu\n\n", static_cast<unsigned long long>(unattributed),
+         static_cast<unsigned long long>(total));
+
+  if (top && merged.size() > top)
+    merged.resize(top);
+  printf("%16s %7s %7s  %s\n", "count", "percent", "points", "location");
+  for (const LineCount &count : merged) {
+    const Location &location = locations[count.location];
+    printf("%16llu %6.2f%% %7u  %s:%u", static_cast<unsigned long long>(count.sum),
+           total ? 100.0 * count.sum / total : 0.0, location.numPoints, location.file->c_str(),
+           location.line);
+    if (byKernel) {
+      auto name = names.kernels.find(count.kernelHash);
+      printf("  %s", name != names.kernels.end() ? name->second.c_str() : "<unknown>");
+    }
+    printf("\n");
+  }
+  return 0;
+}
@@ -0,0 +1,88 @@
+#include "offload-bundle.h"
+#include "target-id.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// usage:
+// bench-offload-bundle [<entries> [<iterations>]]
+//
+// Times OffloadBundle::parse and the construction of a TargetIndex on a bundle with <entries>
+// entries (10000 by default), built in memory, and prints the median and the fastest of
+// <iterations> runs (1000 by default) in microseconds. The entries cycle through a few target ids
+// and share one code object, so the bundle is mostly header.
+
+static const char *const targetIds[] = {"gfx900",        "gfx906:xnack-",
+                                        "gfx908",        "gfx90a:xnack+",
+                                        "gfx90a:xnack-", "gfx940:sramecc+:xnack-",
+                                        "gfx1030",       "gfx1100"};
+
+template <typename Run> static void measure(const char *name, unsigned iterations, Run run) {
+  std::vector<double> times;
+  times.reserve(iterations);
+  for (unsigned i = 0; i < iterations; ++i) {
+    auto start = std::chrono::steady_clock::now();
+    run();
+    auto end = std::chrono::steady_clock::now();
+    times.push_back(std::chrono::duration<double, std::micro>(end - start).count());
+  }
+  std::sort(times.begin(), times.end());
+  std::cout << name << " : median " << times[times.size() / 2] << " us, min " << times.front()
+            << " us" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+  unsigned numEntries = argc > 1 ? atoi(argv[1]) : 10000;
+  unsigned iterations = argc > 2 ? atoi(argv[2]) : 1000;
+  if (argc > 3 || numEntries == 0 || iterations == 0) {
+    std::cerr << "Usage : " << argv[0] << " [<entries> [<iterations>]]" << std::endl;
+    exit(1);
+  }
+
+  int codeObjectFd = memfd_create("bench-code-object", MFD_CLOEXEC);
+  static const char codeObject[kOffloadBundleAlignment] = {0x7f, 'E', 'L', 'F'};
+  if (codeObjectFd < 0 || !writeAt(codeObjectFd, codeObject, sizeof(codeObject), 0)) {
+    std::cerr << "error : can't create the code object" << std::endl;
+    exit(1);
+  }
+
+  std::vector<OffloadBundleWriterEntry> entries;
+  entries.push_back({"host-x86_64-unknown-linux-gnu-", {codeObjectFd, 0, 0}});
+  for (unsigned i = 1; i < numEntries; ++i) {
+    std::string id = std::string("hipv4-amdgcn-amd-amdhsa--") +
+                     targetIds[i % (sizeof(targetIds) / sizeof(targetIds[0]))];
+    entries.push_back({id, {codeObjectFd, 0, sizeof(codeObject)}});
+  }
+
+  int bundleFd = memfd_create("bench-bundle", MFD_CLOEXEC);
+  OffloadBundleFile fatbin;
+  std::string error = bundleFd >= 0 && writeOffloadBundle(bundleFd, entries)
+                          ? fatbin.open(bundleFd, "bench-bundle")
+                          : "can't create the bundle";
+  close(codeObjectFd);
+  if (!error.empty()) {
+    std::cerr << "error : " << error << std::endl;
+    exit(1);
+  }
+  std::cout << numEntries << " entries, " << fatbin.getBundle().getHeaderSize()
+            << " bytes of header" << std::endl;
+
+  measure("OffloadBundle::parse", iterations, [&]() {
+    OffloadBundle bundle;
+    error = bundle.parse(fatbin.getBundle().getBytes(), "bench-bundle");
+    if (!error.empty() || bundle.getEntries().size() != numEntries) {
+      std::cerr << "error : " << error << std::endl;
+      exit(1);
+    }
+  });
+  measure("TargetIndex", iterations, [&]() {
+    TargetIndex targetIndex(fatbin);
+    if (!targetIndex.getTarget(numEntries - 1)) {
+      std::cerr << "error : the last entry has no target" << std::endl;
+      exit(1);
+    }
+  });
+}
@@ -0,0 +1,187 @@
+#include "counter-ring.h"
+
+#include <csignal>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// This tool collects the instrumentation variable values published by every process on this node
+// into a shared memory ring (see counter-ring.h), and writes one consolidated output for the node
+// when it is stopped with SIGINT or SIGTERM.
+//
+// usage:
+// counter-collector <ring-name> [--slots <n>] [--var-table <path>] [--output <path>]
+//
+// Start the collector first, then run the application with
+// DYNINST_AMDGPU_COUNTER_RING=<ring-name> in its environment.
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void requestStop(int) { stopRequested = 1; }
+
+static void showHelp(const char *toolName) {
+  std::cerr << "usage : \n";
+  std::cerr << "  ";
+  std::cerr << toolName << " <ring-name> [--slots <n>] [--var-table <path>] [--output <path>]\n\n";
+  std::cerr << toolName << " aggregates counters from all processes on this node that have "
+            << "DYNINST_AMDGPU_COUNTER_RING=<ring-name> set\n";
+}
+
+struct KernelTotals {
+  std::string name;
+  uint64_t launches = 0;
+  std::set<uint32_t> pids;
+  std::vector<uint64_t> sums;
+};
+
+// Variable names from the instrumentation variable table, indexed like the table.
+static std::vector<std::string> readVarNames(const std::string &filePath) {
+  std::vector<std::string> names;
+  std::ifstream tableFile(filePath);
+  if (!tableFile) {
+    std::cerr << "error : can't open " << filePath << std::endl;
+    exit(1);
+  }
+
+  std::string line;
+  while (std::getline(tableFile, line)) {
+    std::stringstream ss(line);
+    std::string offset, name;
+    ss >> offset >> name;
+    names.push_back(name);
+  }
+  return names;
+}
+
+static void addRecord(std::unordered_map<uint64_t, KernelTotals> &totals,
+                      const CounterRecord &record) {
+  KernelTotals &kernel = totals[record.kernelHash];
+  if (kernel.name.empty())
+    kernel.name = record.kernelName;
+
+  // Every launch publishes exactly one record starting at the first variable.
+  if (record.firstVar == 0)
+    kernel.launches++;
+  kernel.pids.insert(record.pid);
+
+  size_t end = record.firstVar + record.numValues;
+  if (kernel.sums.size() < end)
+    kernel.sums.resize(end, 0);
+  for (uint32_t i = 0; i < record.numValues; ++i)
+    kernel.sums[record.firstVar + i] += record.values[i];
+}
+
+static void writeTotals(std::ostream &os, const std::unordered_map<uint64_t, KernelTotals> &totals,
+                        const std::vector<std::string> &varNames, uint64_t dropped) {
+  char hostName[256] = "unknown";
+  gethostname(hostName, sizeof(hostName) - 1);
+
+  std::set<uint32_t> allPids;
+  for (auto &it : totals)
+    allPids.insert(it.second.pids.begin(), it.second.pids.end());
+
+  os << "host : " << hostName << '\n';
+  os << "processes : " << allPids.size() << '\n';
+  os << "dropped records : " << dropped << "\n\n";
+
+  // Sorted by name so outputs of different nodes can be compared with diff.
+  std::map<std::string, const KernelTotals *> sorted;
+  for (auto &it : totals)
+    sorted[it.second.name] = &it.second;
+
+  for (auto &it : sorted) {
+    const KernelTotals &kernel = *it.second;
+    os << "Aggregated instrumentation variable values for " << kernel.name << " ("
+       << kernel.launches << " launches from " << kernel.pids.size() << " processes): \n";
+    for (size_t i = 0; i < kernel.sums.size(); ++i) {
+      if (i < varNames.size())
+        os << varNames[i];
+      else
+        os << "var" << i;
+      os << " = " << kernel.sums[i] << '\n';
+    }
+    os << '\n';
+  }
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    showHelp(argv[0]);
+    exit(1);
+  }
+
+  std::string ringName(argv[1]);
+  uint64_t numSlots = 1 << 16;
+  std::string varTablePath;
+  std::string outputPath;
+
+  for (int i = 2; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (i + 1 == argc) {
+      showHelp(argv[0]);
+      exit(1);
+    }
+    if (arg == "--slots") {
+      numSlots = std::stoull(argv[++i]);
+    } else if (arg == "--var-table") {
+      varTablePath = argv[++i];
+    } else if (arg == "--output") {
+      outputPath = argv[++i];
+    } else {
+      showHelp(argv[0]);
+      exit(1);
+    }
+  }
+
+  std::vector<std::string> varNames;
+  if (!varTablePath.empty())
+    varNames = readVarNames(varTablePath);
+
+  CounterRing ring;
+  if (!ring.create(ringName, numSlots)) {
+    perror(("error : can't create shared memory ring " + ringName).c_str());
+    exit(1);
+  }
+
+  signal(SIGINT, requestStop);
+  signal(SIGTERM, requestStop);
+
+  std::cerr << "collecting from " << ringName << ", stop with SIGINT or SIGTERM\n";
+
+  std::unordered_map<uint64_t, KernelTotals> totals;
+  CounterRecord record;
+  while (!stopRequested) {
+    if (ring.pop(record)) {
+      addRecord(totals, record);
+      continue;
+    }
+
+    timespec delay = {0, 1000000};
+    nanosleep(&delay, nullptr);
+  }
+
+  // Producers may still be running, but whatever is already in the ring is taken.
+  while (ring.pop(record))
+    addRecord(totals, record);
+
+  shm_unlink(ringName.c_str());
+
+  if (outputPath.empty()) {
+    writeTotals(std::cout, totals, varNames, ring.getDropped());
+  } else {
+    std::ofstream outFile(outputPath);
+    if (!outFile) {
+      std::cerr << "error : can't create " << outputPath << std::endl;
+      exit(1);
+    }
+    writeTotals(outFile, totals, varNames, ring.getDropped());
+  }
+
+  return 0;
+}
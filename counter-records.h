@@ -0,0 +1,293 @@
+#pragma once
+
+// Counter records exchanged between the preload library and the counter tools.
+
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+// 64-bit FNV-1a. Records identify kernels by this hash of the kernel name.
+inline uint64_t hashKernelName(const char *data, size_t size) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= static_cast<unsigned char>(data[i]);
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+inline uint64_t hashKernelName(const std::string &name) {
+  return hashKernelName(name.data(), name.size());
+}
+
+// Launch geometry as passed to hipLaunchKernel. All zero when values are aggregated per kernel
+// only.
+struct LaunchShape {
+  uint32_t grid[3];
+  uint32_t block[3];
+  uint64_t sharedMemBytes;
+
+  bool operator==(const LaunchShape &other) const {
+    return memcmp(this, &other, sizeof(LaunchShape)) == 0;
+  }
+
+  bool operator<(const LaunchShape &other) const {
+    for (int i = 0; i < 3; ++i) {
+      if (grid[i] != other.grid[i])
+        return grid[i] < other.grid[i];
+    }
+    for (int i = 0; i < 3; ++i) {
+      if (block[i] != other.block[i])
+        return block[i] < other.block[i];
+    }
+    return sharedMemBytes < other.sharedMemBytes;
+  }
+
+  bool isEmpty() const { return *this == LaunchShape(); }
+
+  // For display, e.g. " grid (64, 1, 1) block (256, 1, 1) shared 0"
+  std::string format() const {
+    if (isEmpty())
+      return "";
+    return " grid (" + std::to_string(grid[0]) + ", " + std::to_string(grid[1]) + ", " +
+           std::to_string(grid[2]) + ") block (" + std::to_string(block[0]) + ", " +
+           std::to_string(block[1]) + ", " + std::to_string(block[2]) + ") shared " +
+           std::to_string(sharedMemBytes);
+  }
+};
+
+static_assert(sizeof(LaunchShape) == 32, "LaunchShape is compared and hashed as raw bytes");
+
+// The instrumentation variable values of one launch. A launch with more variables than fit in
+// one record is split into several records, firstVar is the index of values[0] in the
+// instrumentation variable table.
+struct CounterRecord {
+  static constexpr uint32_t kMaxNameLength = 127;
+  static constexpr uint32_t kMaxValues = 24;
+
+  uint64_t kernelHash;
+  uint32_t pid;
+  uint32_t firstVar;
+  uint32_t numValues;
+  uint32_t values[kMaxValues];
+
+  // Null-terminated, truncated to kMaxNameLength. Only used for display, kernelHash is computed
+  // on the full name.
+  char kernelName[kMaxNameLength + 1];
+
+  void setKernelName(const std::string &name) {
+    kernelHash = hashKernelName(name);
+    size_t length = name.copy(kernelName, kMaxNameLength);
+    kernelName[length] = 0;
+  }
+};
+
+// Aggregated counters are written to files with this layout:
+//
+//   CounterFileHeader
+//   CounterFileRecord[numRecords], sorted by (kernelHash, shape, varIndex)
+//   numKernelNames times: uint64_t kernelHash, uint32_t length, char name[length]
+//   numVarNames times:    uint32_t length, char name[length]
+//
+// Sorting lets merge-counters combine any number of files with a streaming k-way merge.
+static constexpr char counterFileMagic[8] = {'D', 'Y', 'N', 'C', 'N', 'T', '0', '2'};
+
+struct CounterFileHeader {
+  char magic[8];
+  uint32_t version;
+  int32_t rank; // -1 if unknown or merged
+  uint32_t pid;
+  uint32_t numVarNames;
+  uint64_t numRecords;
+  uint64_t numKernelNames;
+  uint64_t namesOffset;
+  char host[64];
+};
+
+struct CounterFileRecord {
+  uint64_t kernelHash;
+  LaunchShape shape;
+  uint32_t varIndex;
+  uint32_t reserved;
+  uint64_t launches;
+  uint64_t sum;
+
+  bool operator<(const CounterFileRecord &other) const {
+    if (kernelHash != other.kernelHash)
+      return kernelHash < other.kernelHash;
+    if (!(shape == other.shape))
+      return shape < other.shape;
+    return varIndex < other.varIndex;
+  }
+
+  bool sameKey(const CounterFileRecord &other) const {
+    return kernelHash == other.kernelHash && shape == other.shape && varIndex == other.varIndex;
+  }
+};
+
+struct CounterFileNames {
+  std::unordered_map<uint64_t, std::string> kernels;
+  std::vector<std::string> vars;
+};
+
+inline CounterFileHeader makeCounterFileHeader(int32_t rank, uint32_t pid, const std::string &host) {
+  CounterFileHeader header = {};
+  memcpy(header.magic, counterFileMagic, sizeof(header.magic));
+  header.version = 2;
+  header.rank = rank;
+  header.pid = pid;
+  host.copy(header.host, sizeof(header.host) - 1);
+  return header;
+}
+
+// Appends the name tables at the current position of file, and fills in the name related
+// fields of header. The header itself has to be (re)written by the caller.
+inline void writeCounterFileNames(std::ofstream &file, CounterFileHeader &header,
+                                  const CounterFileNames &names) {
+  header.namesOffset = static_cast<uint64_t>(file.tellp());
+  header.numKernelNames = names.kernels.size();
+  header.numVarNames = names.vars.size();
+
+  for (auto &it : names.kernels) {
+    uint32_t length = it.second.size();
+    file.write(reinterpret_cast<const char *>(&it.first), sizeof(it.first));
+    file.write(reinterpret_cast<const char *>(&length), sizeof(length));
+    file.write(it.second.data(), length);
+  }
+
+  for (auto &name : names.vars) {
+    uint32_t length = name.size();
+    file.write(reinterpret_cast<const char *>(&length), sizeof(length));
+    file.write(name.data(), length);
+  }
+}
+
+// Writes a complete counter file. records must be sorted.
+inline bool writeCounterFile(const std::string &filePath, CounterFileHeader header,
+                             const std::vector<CounterFileRecord> &records,
+                             const CounterFileNames &names) {
+  std::ofstream file(filePath, std::ios::binary);
+  if (!file)
+    return false;
+
+  header.numRecords = records.size();
+  file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  file.write(reinterpret_cast<const char *>(records.data()),
+             records.size() * sizeof(CounterFileRecord));
+  writeCounterFileNames(file, header, names);
+
+  file.seekp(0);
+  file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  return static_cast<bool>(file);
+}
+
+// A read-only mapping of a counter file.
+class CounterFile {
+public:
+  CounterFile() = default;
+  CounterFile(const CounterFile &) = delete;
+  CounterFile &operator=(const CounterFile &) = delete;
+
+  ~CounterFile() {
+    if (data)
+      munmap(data, size);
+  }
+
+  // Returns an error message, or an empty string on success.
+  std::string open(const std::string &filePath) {
+    int fd = ::open(filePath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      return "can't open " + filePath;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(CounterFileHeader)) {
+      close(fd);
+      return filePath + " is too small to be a counter file";
+    }
+
+    size = st.st_size;
+    void *addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+      return "can't map " + filePath;
+    data = static_cast<char *>(addr);
+
+    // Records are only ever read front to back.
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    const CounterFileHeader &header = getHeader();
+    if (memcmp(header.magic, counterFileMagic, sizeof(counterFileMagic)) != 0)
+      return filePath + " is not a counter file";
+    path = filePath;
+
+    uint64_t recordsEnd = sizeof(CounterFileHeader) + header.numRecords * sizeof(CounterFileRecord);
+    if (header.numRecords > size / sizeof(CounterFileRecord) || recordsEnd > header.namesOffset ||
+        header.namesOffset > size)
+      return filePath + " is truncated";
+
+    return "";
+  }
+
+  const CounterFileHeader &getHeader() const {
+    return *reinterpret_cast<const CounterFileHeader *>(data);
+  }
+
+  const CounterFileRecord *begin() const {
+    return reinterpret_cast<const CounterFileRecord *>(data + sizeof(CounterFileHeader));
+  }
+
+  const CounterFileRecord *end() const { return begin() + getHeader().numRecords; }
+
+  // Adds this file's names to names. Records refer to variables by index, so files can only be
+  // combined if their variable names are the same: they are taken from the first file, and
+  // every later one has to match. Returns an error message, or an empty string on success.
+  std::string readNames(CounterFileNames &names) const {
+    const CounterFileHeader &header = getHeader();
+    size_t pos = header.namesOffset;
+
+    for (uint64_t i = 0; i < header.numKernelNames; ++i) {
+      uint64_t hash;
+      uint32_t length;
+      if (!readValue(pos, hash) || !readValue(pos, length) || length > size - pos)
+        return path + " has a truncated name table";
+      names.kernels.emplace(hash, std::string(data + pos, length));
+      pos += length;
+    }
+
+    std::vector<std::string> vars;
+    for (uint32_t i = 0; i < header.numVarNames; ++i) {
+      uint32_t length;
+      if (!readValue(pos, length) || length > size - pos)
+        return path + " has a truncated name table";
+      vars.emplace_back(data + pos, length);
+      pos += length;
+    }
+
+    if (names.vars.empty())
+      names.vars = std::move(vars);
+    else if (vars != names.vars)
+      return path + " was written with a different instrumentation variable table than the " +
+             "files before it";
+    return "";
+  }
+
+private:
+  template <typename T> bool readValue(size_t &pos, T &value) const {
+    if (sizeof(T) > size - pos)
+      return false;
+    memcpy(&value, data + pos, sizeof(T));
+    pos += sizeof(T);
+    return true;
+  }
+
+  std::string path;
+  char *data = nullptr;
+  size_t size = 0;
+};
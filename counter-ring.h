@@ -0,0 +1,189 @@
+#pragma once
+
+// A bounded multi-producer ring of CounterRecords in POSIX shared memory.
+//
+// counter-collector creates the ring and is its only consumer. Every process running with the
+// preload library and DYNINST_AMDGPU_COUNTER_RING set attaches to it as a producer.
+//
+// Each slot carries a sequence number (the bounded MPMC queue by Dmitry Vyukov): a producer
+// claims a slot with a CAS on enqueuePos and publishes it by storing pos + 1 into the slot
+// sequence. The consumer releases a slot by storing pos + numSlots. Producers never wait, a
+// record that doesn't fit is counted as dropped.
+
+#include "counter-records.h"
+
+#include <atomic>
+#include <cstdint>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Environment variable for the name of the shared memory ring (e.g. /dyninst-counters):
+const char *counterRingEnv = "DYNINST_AMDGPU_COUNTER_RING";
+
+static constexpr char counterRingMagic[8] = {'D', 'Y', 'N', 'R', 'I', 'N', 'G', '1'};
+
+struct CounterRingHeader {
+  // Written last by the creator, so producers never see a half initialized ring.
+  std::atomic<uint64_t> magic;
+  uint32_t recordSize;
+  uint32_t reserved;
+  uint64_t numSlots; // power of 2
+
+  alignas(64) std::atomic<uint64_t> enqueuePos;
+  alignas(64) std::atomic<uint64_t> dequeuePos;
+  alignas(64) std::atomic<uint64_t> dropped;
+  std::atomic<uint64_t> attached;
+};
+
+struct CounterRingSlot {
+  std::atomic<uint64_t> sequence;
+  CounterRecord record;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "the ring is shared between processes, its atomics must be lock free");
+
+inline uint64_t getCounterRingMagic() {
+  uint64_t magic;
+  memcpy(&magic, counterRingMagic, sizeof(magic));
+  return magic;
+}
+
+inline size_t getCounterRingSize(uint64_t numSlots) {
+  return sizeof(CounterRingHeader) + numSlots * sizeof(CounterRingSlot);
+}
+
+class CounterRing {
+public:
+  // Creates and initializes the ring. numSlots is rounded up to a power of 2.
+  bool create(const std::string &name, uint64_t numSlots) {
+    uint64_t slots = 1;
+    while (slots < numSlots)
+      slots <<= 1;
+
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0)
+      return false;
+
+    size = getCounterRingSize(slots);
+    if (ftruncate(fd, size) != 0 || !map(fd)) {
+      close(fd);
+      shm_unlink(name.c_str());
+      return false;
+    }
+    close(fd);
+
+    header->recordSize = sizeof(CounterRecord);
+    header->numSlots = slots;
+    header->enqueuePos.store(0, std::memory_order_relaxed);
+    header->dequeuePos.store(0, std::memory_order_relaxed);
+    header->dropped.store(0, std::memory_order_relaxed);
+    header->attached.store(0, std::memory_order_relaxed);
+    for (uint64_t i = 0; i < slots; ++i)
+      slotAt(i).sequence.store(i, std::memory_order_relaxed);
+
+    header->magic.store(getCounterRingMagic(), std::memory_order_release);
+    return true;
+  }
+
+  // Attaches to a ring created by someone else. Fails if the ring isn't initialized yet, e.g.
+  // when the collector has created the object but not sized it, where mapping it would fault.
+  bool attach(const std::string &name) {
+    int fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0)
+      return false;
+
+    struct stat st;
+    size = sizeof(CounterRingHeader);
+    if (fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) < size || !map(fd)) {
+      close(fd);
+      return false;
+    }
+
+    bool valid = header->magic.load(std::memory_order_acquire) == getCounterRingMagic() &&
+                 header->recordSize == sizeof(CounterRecord);
+    uint64_t slots = header->numSlots;
+    munmap(header, size);
+    header = nullptr;
+
+    // The object is sized before the magic is written, so a valid ring fits it.
+    uint64_t maxSlots = (st.st_size - sizeof(CounterRingHeader)) / sizeof(CounterRingSlot);
+    valid = valid && slots != 0 && (slots & (slots - 1)) == 0 && slots <= maxSlots;
+    size = getCounterRingSize(slots);
+    if (!valid || !map(fd)) {
+      close(fd);
+      return false;
+    }
+    close(fd);
+
+    header->attached.fetch_add(1, std::memory_order_relaxed);
+    return true;
+  }
+
+  ~CounterRing() {
+    if (header)
+      munmap(header, size);
+  }
+
+  bool isOpen() const { return header != nullptr; }
+
+  // Multiple producers, never blocks. Returns false if the ring is full.
+  bool push(const CounterRecord &record) {
+    uint64_t pos = header->enqueuePos.load(std::memory_order_relaxed);
+    CounterRingSlot *slot;
+    while (true) {
+      slot = &slotAt(pos);
+      uint64_t sequence = slot->sequence.load(std::memory_order_acquire);
+      int64_t diff = static_cast<int64_t>(sequence - pos);
+      if (diff == 0) {
+        if (header->enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          break;
+      } else if (diff < 0) {
+        header->dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      } else {
+        pos = header->enqueuePos.load(std::memory_order_relaxed);
+      }
+    }
+
+    slot->record = record;
+    slot->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Single consumer. Returns false if the ring is empty.
+  bool pop(CounterRecord &record) {
+    uint64_t pos = header->dequeuePos.load(std::memory_order_relaxed);
+    CounterRingSlot &slot = slotAt(pos);
+    if (slot.sequence.load(std::memory_order_acquire) != pos + 1)
+      return false;
+
+    record = slot.record;
+    slot.sequence.store(pos + header->numSlots, std::memory_order_release);
+    header->dequeuePos.store(pos + 1, std::memory_order_relaxed);
+    return true;
+  }
+
+  uint64_t getDropped() const { return header->dropped.load(std::memory_order_relaxed); }
+  uint64_t getAttached() const { return header->attached.load(std::memory_order_relaxed); }
+
+private:
+  bool map(int fd) {
+    void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED)
+      return false;
+    header = static_cast<CounterRingHeader *>(addr);
+    return true;
+  }
+
+  CounterRingSlot &slotAt(uint64_t pos) {
+    auto *slots = reinterpret_cast<CounterRingSlot *>(header + 1);
+    return slots[pos & (header->numSlots - 1)];
+  }
+
+  CounterRingHeader *header = nullptr;
+  size_t size = 0;
+};
@@ -1,8 +1,21 @@
+#include <atomic>
 #include <cassert>
 #include <fstream>
 #include <iostream>
+#include <thread>
+#include <vector>
 
 #include "elfio/elfio.hpp"
+#include "offload-bundle.h"
+
+// usage:
+// extract-fatbin <executable>
+//
+// Writes the .hip_fatbin section of the executable to <executable>.fatbin. Executables built from
+// several translation units, or with -fgpu-rdc, have several bundles in the section. Then every
+// bundle is also written to <executable>.fatbin.<index>, concurrently, in section order. The other
+// tools refuse <executable>.fatbin then, and take the bundles one at a time. A section that can't
+// be split into bundles only gets a warning.
 
 static ELFIO::section *getSection(const std::string &sectionName, const ELFIO::elfio &file) {
   for (int i = 0; i < file.sections.size(); ++i) {
@@ -40,5 +53,50 @@ int main(int argc, char **argv) {
   fatbinFile.write(fatbinSection->get_data(), fatbinSection->get_size());
   fatbinFile.close();
 
+  std::vector<BundleExtent> bundles;
+  std::string error = findOffloadBundles({fatbinSection->get_data(), fatbinSection->get_size()},
+                                         std::string(argv[1]) + " .hip_fatbin", bundles);
+  // <executable>.fatbin is written either way, only the per-bundle files need the bundles.
+  if (!error.empty()) {
+    std::cerr << "warning : " << error << ", not splitting it into bundles" << std::endl;
+    return 0;
+  }
+  std::cout << bundles.size() << " bundles in .hip_fatbin\n";
+  if (bundles.size() == 1)
+    return 0;
+
+  // Copied straight from the executable rather than from the loaded section.
+  MappedFile exec;
+  error = exec.open(argv[1]);
+  if (!error.empty()) {
+    std::cerr << "error : " << error << std::endl;
+    exit(1);
+  }
+
+  std::vector<std::string> errors(bundles.size());
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    for (size_t i = next++; i < bundles.size(); i = next++) {
+      FileRange range = {exec.getFd(), fatbinSection->get_offset() + bundles[i].offset,
+                         bundles[i].size};
+      errors[i] = writeFile(std::string(argv[1]) + ".fatbin." + std::to_string(i), range);
+    }
+  };
+  std::vector<std::thread> threads;
+  unsigned numThreads = std::max(1u, std::thread::hardware_concurrency());
+  for (unsigned t = 1; t < std::min<size_t>(numThreads, bundles.size()); ++t)
+    threads.emplace_back(worker);
+  worker();
+  for (std::thread &thread : threads)
+    thread.join();
+
+  for (size_t i = 0; i < bundles.size(); ++i) {
+    std::cout << "bundle " << i << " : offset " << bundles[i].offset << ", size "
+              << bundles[i].size << '\n';
+    if (!errors[i].empty()) {
+      std::cerr << "error : " << errors[i] << std::endl;
+      exit(1);
+    }
+  }
   return 0;
 }
@@ -1,88 +1,176 @@
-#include <cassert>
+#include "offload-bundle.h"
+#include "target-id.h"
+
+#include <algorithm>
+#include <atomic>
 #include <fstream>
 #include <iostream>
 #include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+// usage:
+// extract-gpubin [-j <threads>] [--index <json-file>] (--all | <arch-name>...) <path-to-fatbin>
+//
+// Writes the code object that best matches every requested arch (see target-id.h) to
+// <path-to-fatbin>.<arch-name>, or with --all every code object to <path-to-fatbin>.<target-id>.
+// The bundle header is parsed once, and the code objects are copied concurrently from the fatbin,
+// in the kernel where possible (see copyRange). Compressed fatbins are decompressed first. A JSON
+// index of what was written goes to <path-to-fatbin>.index.json, or to the --index path.
 
 void showHelp(const std::string &toolName) {
-  std::cerr << "Usage : " << toolName << " <arch-name> "
-            << "<path-to-fatbin>" << std::endl;
+  std::cerr << "Usage : " << toolName << " [-j <threads>] [--index <json-file>] "
+            << "(--all | <arch-name>...) <path-to-fatbin>" << std::endl;
   std::cerr << "supported architectures : gfx900, gfx906, gfx908, gfx90a, gfx940" << std::endl;
+  std::cerr << "  --all extracts every code object in the fatbin" << std::endl;
 }
 
-int main(int argc, char *argv[]) {
-  if (argc != 3) {
-    showHelp(argv[0]);
-    exit(1);
+struct Extraction {
+  const OffloadBundleEntry *entry;
+  std::string target;
+  std::string path;
+  std::string error;
+};
+
+static std::string escapeJson(std::string_view str) {
+  std::string escaped;
+  for (char c : str) {
+    if (c == '"' || c == '\\') {
+      escaped += '\\';
+      escaped += c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char buffer[8];
+      snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+      escaped += buffer;
+    } else {
+      escaped += c;
+    }
   }
+  return escaped;
+}
 
-  std::string arch(argv[1]);
-  std::string fatbinPath(argv[2]);
-
-  std::ifstream fatbin(fatbinPath, std::ios::binary);
-  if (!fatbin) {
-    std::cerr << "error : can't open " << fatbinPath << std::endl;
-    exit(1);
+static bool writeIndex(const std::string &indexPath, const std::string &fatbinPath,
+                       bool compressed, const std::vector<Extraction> &extractions) {
+  std::ofstream index(indexPath);
+  index << "{\n";
+  index << "  \"fatbin\": \"" << escapeJson(fatbinPath) << "\",\n";
+  index << "  \"compressed\": " << (compressed ? "true" : "false") << ",\n";
+  index << "  \"entries\": [";
+  for (size_t i = 0; i < extractions.size(); ++i) {
+    const OffloadBundleEntry &entry = *extractions[i].entry;
+    index << (i ? ",\n" : "\n");
+    index << "    {\"id\": \"" << escapeJson(entry.id) << "\", \"target\": \""
+          << escapeJson(extractions[i].target) << "\", \"offset\": " << entry.offset
+          << ", \"size\": " << entry.contents.size << ", \"path\": \""
+          << escapeJson(extractions[i].path) << "\"}";
   }
+  index << "\n  ]\n}\n";
+  return static_cast<bool>(index);
+}
 
-  char buffer[24 + 1];
-  fatbin.read(buffer, 24);
-  buffer[24] = 0;
-
-  assert(std::string(buffer) == "__CLANG_OFFLOAD_BUNDLE__");
-
-  uint64_t numBundleEntries = 0;
-  fatbin.read(reinterpret_cast<char *>(&numBundleEntries), sizeof(numBundleEntries));
-
-  uint64_t elfStart = 0;
-  uint64_t elfSize = 0;
-  bool found = false;
-
-  // Read metadata for each elf object in this bundle
-  while (numBundleEntries) {
-    uint64_t bundleEntryCodeObjectOffset; // offset from begining of the fatbin
-    fatbin.read(reinterpret_cast<char *>(&bundleEntryCodeObjectOffset),
-                sizeof(bundleEntryCodeObjectOffset));
-
-    uint64_t size;
-    fatbin.read(reinterpret_cast<char *>(&size), sizeof(size));
-
-    uint64_t idLength;
-    fatbin.read(reinterpret_cast<char *>(&idLength), sizeof(idLength));
-
-    char id[idLength];
-    fatbin.read(id, idLength);
-
-    std::string idString(id);
-    // If idString ends with arch
-    if (idString.substr(idLength - arch.length()) == arch) {
-      elfStart = bundleEntryCodeObjectOffset;
-      elfSize = size;
-      found = true;
+int main(int argc, char *argv[]) {
+  unsigned numThreads = std::max(1u, std::thread::hardware_concurrency());
+  bool all = false;
+  std::string indexPath;
+  std::vector<std::string> positional;
+
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg == "-j" && i + 1 < argc) {
+      numThreads = std::max(1, atoi(argv[++i]));
+    } else if (arg == "--index" && i + 1 < argc) {
+      indexPath = argv[++i];
+    } else if (arg == "--all") {
+      all = true;
+    } else if (arg[0] == '-') {
+      showHelp(argv[0]);
+      exit(1);
+    } else {
+      positional.push_back(arg);
     }
-    numBundleEntries--;
   }
 
-  if (!found) {
-    std::cerr << fatbinPath << " doesn't contain a " << arch << " binary\n";
-    exit(0);
+  if (positional.empty() || (all && positional.size() != 1) ||
+      (!all && positional.size() < 2)) {
+    showHelp(argv[0]);
+    exit(1);
   }
 
-  // std::cout << arch << ' ' << "ELF at " << elfStart << " of size " << elfSize << '\n';
-
-  fatbin.seekg(elfStart, std::ios::beg);
-  char data[elfSize];
-  fatbin.read(data, elfSize);
-
-  std::string elfBinPath(fatbinPath + "." + arch);
-  std::ofstream elfBin(elfBinPath, std::ios::binary);
+  std::string fatbinPath(positional.back());
+  positional.pop_back();
+  if (indexPath.empty())
+    indexPath = fatbinPath + ".index.json";
 
-  if (!elfBin) {
-    std::cerr << "error : can't create " << elfBinPath << std::endl;
+  OffloadBundleFile fatbin;
+  std::string error = fatbin.open(fatbinPath);
+  if (!error.empty()) {
+    std::cerr << "error : " << error << std::endl;
     exit(1);
   }
 
-  elfBin.write(data, elfSize);
-  elfBin.close();
+  const std::vector<OffloadBundleEntry> &entries = fatbin.getEntries();
+  TargetIndex targetIndex(fatbin);
+  std::vector<Extraction> extractions;
+  if (all) {
+    // Entries with the same target id get their index appended.
+    std::unordered_set<std::string> paths;
+    for (size_t i = 0; i < entries.size(); ++i) {
+      const TargetId *target = targetIndex.getTarget(i);
+      if (!target)
+        continue;
+      std::string path = fatbinPath + "." + target->format();
+      if (!paths.insert(path).second)
+        path += "." + std::to_string(i);
+      extractions.push_back({&entries[i], target->format(), path, ""});
+    }
+  } else {
+    for (const std::string &arch : positional) {
+      TargetId query;
+      if (!parseRequestedTarget(arch, query)) {
+        std::cerr << "error : " << arch << " is not a target id" << std::endl;
+        exit(1);
+      }
+
+      int index;
+      error = targetIndex.findBest(query, index);
+      if (!error.empty()) {
+        std::cerr << "error : " << error << std::endl;
+        exit(1);
+      }
+      if (index == -1) {
+        std::cerr << fatbinPath << " doesn't contain a " << arch << " binary\n";
+        continue;
+      }
+      extractions.push_back(
+          {&entries[index], targetIndex.getTarget(index)->format(), fatbinPath + "." + arch, ""});
+    }
+  }
 
-  fatbin.close();
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    for (size_t i = next++; i < extractions.size(); i = next++)
+      extractions[i].error =
+          writeFile(extractions[i].path, fatbin.getRange(*extractions[i].entry));
+  };
+  std::vector<std::thread> threads;
+  for (unsigned t = 1; t < std::min<size_t>(numThreads, extractions.size()); ++t)
+    threads.emplace_back(worker);
+  worker();
+  for (std::thread &thread : threads)
+    thread.join();
+
+  bool failed = false;
+  for (const Extraction &extraction : extractions) {
+    if (!extraction.error.empty()) {
+      std::cerr << "error : " << extraction.error << std::endl;
+      failed = true;
+    }
+  }
+  if (!writeIndex(indexPath, fatbinPath, fatbin.isCompressed(), extractions)) {
+    std::cerr << "error : can't write " << indexPath << std::endl;
+    failed = true;
+  }
+  if (failed)
+    exit(1);
 }
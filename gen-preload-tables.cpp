@@ -0,0 +1,264 @@
+#include "preload-tables.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <numeric>
+#include <sstream>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+// This tool generates the compile-time kernel tables of an application-specific preload library
+// (see preload-tables.h) from the preload info file written by update-note and the
+// instrumentation variable table written by the mutator.
+//
+// usage:
+// gen-preload-tables <preload-info> <var-table> <output-file>
+//
+// The output file is passed to the preload library build with -DPRELOAD_TABLES=<output-file>.
+
+static void showHelp(const char *toolName) {
+  std::cerr << "usage : \n";
+  std::cerr << "  ";
+  std::cerr << toolName << " <preload-info> <var-table> <output-file>\n\n";
+  std::cerr << toolName << " generates the kernel tables compiled into an application-specific "
+            << "preload library\n";
+}
+
+struct KernelInfo {
+  std::string name;
+  int kernargSize;
+  int firstHiddenArgIndex;
+};
+
+struct VarInfo {
+  int offset;
+  std::string name;
+};
+
+static void readPreloadInfo(const std::string &filePath, std::vector<KernelInfo> &kernels) {
+  std::ifstream file(filePath);
+  if (!file) {
+    std::cerr << "error : can't open " << filePath << std::endl;
+    exit(1);
+  }
+
+  std::unordered_set<std::string> names;
+  std::string line;
+  size_t lineNumber = 0;
+  while (std::getline(file, line)) {
+    ++lineNumber;
+    // <kernel name> <kernarg size> <first hidden arg index>
+    std::stringstream ss(line);
+    KernelInfo kernel;
+    if (!(ss >> kernel.name >> kernel.kernargSize >> kernel.firstHiddenArgIndex)) {
+      std::cerr << "error : " << filePath << ":" << lineNumber << " is not a preload info line"
+                << std::endl;
+      exit(1);
+    }
+    // Like the preload library, the first line of a kernel wins.
+    if (names.insert(kernel.name).second)
+      kernels.push_back(kernel);
+  }
+}
+
+static void readVarTable(const std::string &filePath, std::vector<VarInfo> &vars) {
+  std::ifstream file(filePath);
+  if (!file) {
+    std::cerr << "error : can't open " << filePath << std::endl;
+    exit(1);
+  }
+
+  std::string line;
+  size_t lineNumber = 0;
+  while (std::getline(file, line)) {
+    ++lineNumber;
+    // <offset> <name>
+    std::stringstream ss(line);
+    VarInfo var;
+    if (!(ss >> var.offset >> var.name)) {
+      std::cerr << "error : " << filePath << ":" << lineNumber << " is not a variable table line"
+                << std::endl;
+      exit(1);
+    }
+    vars.push_back(var);
+  }
+
+  if (vars.empty()) {
+    std::cerr << "error : " << filePath << " has no instrumentation variables" << std::endl;
+    exit(1);
+  }
+}
+
+struct PerfectHash {
+  std::vector<uint32_t> displacements;
+  std::vector<uint32_t> slots;
+};
+
+// Places the buckets with the most names first, while most slots are still free. Returns false if
+// some bucket has no seed below maxSeed that fits, so the caller retries with more slots.
+static bool buildPerfectHash(const std::vector<KernelInfo> &kernels, uint32_t numBuckets,
+                             uint32_t numSlots, PerfectHash &hash) {
+  static constexpr uint32_t maxSeed = 1 << 20;
+  uint32_t numKernels = kernels.size();
+
+  std::vector<std::vector<uint32_t>> buckets(numBuckets);
+  for (uint32_t i = 0; i < numKernels; ++i)
+    buckets[hashTableKey(kernels[i].name, 0) % numBuckets].push_back(i);
+
+  std::vector<uint32_t> order(numBuckets);
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&buckets](uint32_t a, uint32_t b) {
+    return buckets[a].size() > buckets[b].size();
+  });
+
+  hash.displacements.assign(numBuckets, 0);
+  hash.slots.assign(numSlots, numKernels);
+  std::vector<uint32_t> bucketSlots;
+  for (uint32_t bucket : order) {
+    if (buckets[bucket].empty())
+      break;
+
+    bool placed = false;
+    for (uint32_t seed = 1; seed < maxSeed && !placed; ++seed) {
+      bucketSlots.clear();
+      placed = true;
+      for (uint32_t index : buckets[bucket]) {
+        uint32_t slot = hashTableKey(kernels[index].name, seed) % numSlots;
+        if (hash.slots[slot] != numKernels ||
+            std::find(bucketSlots.begin(), bucketSlots.end(), slot) != bucketSlots.end()) {
+          placed = false;
+          break;
+        }
+        bucketSlots.push_back(slot);
+      }
+      if (placed) {
+        hash.displacements[bucket] = seed;
+        for (size_t i = 0; i < bucketSlots.size(); ++i)
+          hash.slots[bucketSlots[i]] = buckets[bucket][i];
+      }
+    }
+    if (!placed)
+      return false;
+  }
+  return true;
+}
+
+// Writes a string literal. Kernel names are mangled identifiers, but escape anything unusual.
+static void writeStringLiteral(std::ostream &os, const std::string &str) {
+  os << '"';
+  for (unsigned char c : str) {
+    if (c == '"' || c == '\\') {
+      os << '\\' << c;
+    } else if (c < 0x20 || c >= 0x7f) {
+      // An octal escape, which unlike \x stops after three digits.
+      os << '\\' << char('0' + (c >> 6)) << char('0' + ((c >> 3) & 7)) << char('0' + (c & 7));
+    } else if (c == '?') {
+      os << "\\?"; // no trigraphs
+    } else {
+      os << c;
+    }
+  }
+  os << '"';
+}
+
+template <typename T> static void writeArray(std::ostream &os, const std::vector<T> &values) {
+  for (size_t i = 0; i < values.size(); ++i)
+    os << (i % 12 == 0 ? "\n    " : " ") << values[i] << ',';
+  // Arrays can't be empty, tables with no kernels get a placeholder.
+  if (values.empty())
+    os << "\n    0,";
+  os << '\n';
+}
+
+int main(int argc, char **argv) {
+  if (argc != 4) {
+    showHelp(argv[0]);
+    exit(1);
+  }
+
+  std::string preloadInfoPath(argv[1]);
+  std::string varTablePath(argv[2]);
+  std::string outputPath(argv[3]);
+
+  std::vector<KernelInfo> kernels;
+  std::vector<VarInfo> vars;
+  readPreloadInfo(preloadInfoPath, kernels);
+  readVarTable(varTablePath, vars);
+
+  // About 4 names per bucket and 10% free slots keep seed searches short.
+  uint32_t numKernels = kernels.size();
+  uint32_t numBuckets = std::max<uint32_t>(1, (numKernels + 3) / 4);
+  uint32_t numSlots = std::max<uint32_t>(1, numKernels + numKernels / 10);
+  PerfectHash hash;
+  while (!buildPerfectHash(kernels, numBuckets, numSlots, hash))
+    numSlots += numSlots / 8 + 1;
+
+  // The lookup of preload.cpp, checked here rather than by a static_assert in the generated file:
+  // hashing every name at compile time exceeds the compilers' constexpr limits for real tables.
+  std::vector<GeneratedKernel> tableKernels;
+  for (const KernelInfo &kernel : kernels)
+    tableKernels.push_back({kernel.name, kernel.kernargSize, kernel.firstHiddenArgIndex});
+  GeneratedTables tables = {tableKernels.data(), numKernels, hash.displacements.data(),
+                            numBuckets, hash.slots.data(), numSlots, nullptr, 0};
+  if (!tables.isConsistent()) {
+    std::cerr << "error : the perfect hash doesn't find every kernel" << std::endl;
+    exit(1);
+  }
+
+  std::ofstream output(outputPath);
+  if (!output) {
+    std::cerr << "error : can't open " << outputPath << std::endl;
+    exit(1);
+  }
+
+  output << "// Generated by gen-preload-tables from " << preloadInfoPath << " and " << varTablePath
+         << ", do not edit.\n\n";
+  output << "#include \"preload-tables.h\"\n\n";
+  output << "namespace {\n\n";
+
+  output << "constexpr GeneratedKernel generatedKernels[] = {\n";
+  for (const KernelInfo &kernel : kernels) {
+    output << "    {";
+    writeStringLiteral(output, kernel.name);
+    output << ", " << kernel.kernargSize << ", " << kernel.firstHiddenArgIndex << "},\n";
+  }
+  if (kernels.empty())
+    output << "    {\"\", 0, 0},\n";
+  output << "};\n\n";
+
+  output << "constexpr uint32_t generatedDisplacements[] = {";
+  writeArray(output, hash.displacements);
+  output << "};\n\n";
+
+  output << "constexpr uint32_t generatedSlots[] = {";
+  writeArray(output, hash.slots);
+  output << "};\n\n";
+
+  output << "constexpr GeneratedVar generatedVars[] = {\n";
+  for (const VarInfo &var : vars) {
+    output << "    {" << var.offset << ", ";
+    writeStringLiteral(output, var.name);
+    output << "},\n";
+  }
+  output << "};\n\n";
+
+  output << "} // namespace\n\n";
+  output << "constexpr GeneratedTables generatedTables = {\n";
+  output << "    generatedKernels,       " << numKernels << ",\n";
+  output << "    generatedDisplacements, " << numBuckets << ",\n";
+  output << "    generatedSlots,         " << numSlots << ",\n";
+  output << "    generatedVars,          " << vars.size() << ",\n";
+  output << "};\n";
+
+  if (!output) {
+    std::cerr << "error : can't write " << outputPath << std::endl;
+    exit(1);
+  }
+
+  std::cerr << "gen-preload-tables : " << numKernels << " kernels in " << numSlots << " slots, "
+            << vars.size() << " variables\n";
+  return 0;
+}
@@ -0,0 +1,194 @@
+#pragma once
+
+// GPU time histograms exchanged between the preload library and overhead-report.
+//
+// Both census runs (see preload-census.h) and instrumented runs can write the GPU time histogram
+// of every (kernel, launch shape) to a file with this layout:
+//
+//   HistogramFileHeader
+//   HistogramFileRecord[numRecords], sorted by (kernelHash, shape)
+//   numKernelNames times: uint64_t kernelHash, uint32_t length, char name[length]
+//
+// The buckets are those of LatencyHistogram, stored densely so files of different runs can be
+// combined bucket by bucket.
+
+#include "counter-records.h"
+#include "latency-histogram.h"
+
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+static constexpr char histogramFileMagic[8] = {'D', 'Y', 'N', 'H', 'S', 'T', '0', '1'};
+
+enum class HistogramSource : uint32_t { Census = 0, Instrumented = 1 };
+
+struct HistogramFileHeader {
+  char magic[8];
+  uint32_t version;
+  int32_t rank; // -1 if unknown
+  uint32_t pid;
+  HistogramSource source;
+  uint32_t subBucketBits;
+  uint32_t numBuckets;
+  uint64_t numRecords;
+  uint64_t numKernelNames;
+  uint64_t namesOffset;
+  char host[64];
+};
+
+struct HistogramFileRecord {
+  uint64_t kernelHash;
+  LaunchShape shape;
+  uint64_t launches;
+  uint64_t totalNs;
+  uint64_t counts[LatencyHistogram::kNumBuckets];
+
+  bool operator<(const HistogramFileRecord &other) const {
+    if (kernelHash != other.kernelHash)
+      return kernelHash < other.kernelHash;
+    return shape < other.shape;
+  }
+
+  bool sameKey(const HistogramFileRecord &other) const {
+    return kernelHash == other.kernelHash && shape == other.shape;
+  }
+
+  void add(const HistogramFileRecord &other) {
+    launches += other.launches;
+    totalNs += other.totalNs;
+    for (unsigned i = 0; i < LatencyHistogram::kNumBuckets; ++i)
+      counts[i] += other.counts[i];
+  }
+};
+
+inline HistogramFileHeader makeHistogramFileHeader(HistogramSource source, int32_t rank,
+                                                   uint32_t pid, const std::string &host) {
+  HistogramFileHeader header = {};
+  memcpy(header.magic, histogramFileMagic, sizeof(header.magic));
+  header.version = 1;
+  header.rank = rank;
+  header.pid = pid;
+  header.source = source;
+  header.subBucketBits = LatencyHistogram::kSubBucketBits;
+  header.numBuckets = LatencyHistogram::kNumBuckets;
+  host.copy(header.host, sizeof(header.host) - 1);
+  return header;
+}
+
+// Writes a complete histogram file. records must be sorted, with no two records of the same key.
+inline bool writeHistogramFile(const std::string &filePath, HistogramFileHeader header,
+                               const std::vector<HistogramFileRecord> &records,
+                               const std::unordered_map<uint64_t, std::string> &kernelNames) {
+  std::ofstream file(filePath, std::ios::binary);
+  if (!file)
+    return false;
+
+  header.numRecords = records.size();
+  file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  file.write(reinterpret_cast<const char *>(records.data()),
+             records.size() * sizeof(HistogramFileRecord));
+
+  header.namesOffset = static_cast<uint64_t>(file.tellp());
+  header.numKernelNames = kernelNames.size();
+  for (auto &it : kernelNames) {
+    uint32_t length = it.second.size();
+    file.write(reinterpret_cast<const char *>(&it.first), sizeof(it.first));
+    file.write(reinterpret_cast<const char *>(&length), sizeof(length));
+    file.write(it.second.data(), length);
+  }
+
+  file.seekp(0);
+  file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  return static_cast<bool>(file);
+}
+
+// A read-only mapping of a histogram file.
+class HistogramFile {
+public:
+  HistogramFile() = default;
+  HistogramFile(const HistogramFile &) = delete;
+  HistogramFile &operator=(const HistogramFile &) = delete;
+
+  ~HistogramFile() {
+    if (data)
+      munmap(data, size);
+  }
+
+  // Returns an error message, or an empty string on success.
+  std::string open(const std::string &filePath) {
+    int fd = ::open(filePath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      return "can't open " + filePath;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(HistogramFileHeader)) {
+      close(fd);
+      return filePath + " is too small to be a histogram file";
+    }
+
+    size = st.st_size;
+    void *addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+      return "can't map " + filePath;
+    data = static_cast<char *>(addr);
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    const HistogramFileHeader &header = getHeader();
+    if (memcmp(header.magic, histogramFileMagic, sizeof(histogramFileMagic)) != 0)
+      return filePath + " is not a histogram file";
+    if (header.subBucketBits != LatencyHistogram::kSubBucketBits ||
+        header.numBuckets != LatencyHistogram::kNumBuckets)
+      return filePath + " uses a different bucket layout";
+
+    uint64_t recordsEnd =
+        sizeof(HistogramFileHeader) + header.numRecords * sizeof(HistogramFileRecord);
+    if (header.numRecords > size / sizeof(HistogramFileRecord) || recordsEnd > header.namesOffset ||
+        header.namesOffset > size)
+      return filePath + " is truncated";
+
+    return "";
+  }
+
+  const HistogramFileHeader &getHeader() const {
+    return *reinterpret_cast<const HistogramFileHeader *>(data);
+  }
+
+  const HistogramFileRecord *begin() const {
+    return reinterpret_cast<const HistogramFileRecord *>(data + sizeof(HistogramFileHeader));
+  }
+
+  const HistogramFileRecord *end() const { return begin() + getHeader().numRecords; }
+
+  // Adds this file's kernel names to kernelNames.
+  bool readNames(std::unordered_map<uint64_t, std::string> &kernelNames) const {
+    const HistogramFileHeader &header = getHeader();
+    size_t pos = header.namesOffset;
+    for (uint64_t i = 0; i < header.numKernelNames; ++i) {
+      uint64_t hash;
+      uint32_t length;
+      if (sizeof(hash) + sizeof(length) > size - pos)
+        return false;
+      memcpy(&hash, data + pos, sizeof(hash));
+      memcpy(&length, data + pos + sizeof(hash), sizeof(length));
+      pos += sizeof(hash) + sizeof(length);
+      if (length > size - pos)
+        return false;
+      kernelNames.emplace(hash, std::string(data + pos, length));
+      pos += length;
+    }
+    return true;
+  }
+
+private:
+  char *data = nullptr;
+  size_t size = 0;
+};
@@ -0,0 +1,103 @@
+#pragma once
+
+// A log-linear (HDR style) histogram of durations in nanoseconds.
+//
+// Durations below kSubBuckets ns are counted exactly. Above that, every power of two range is
+// split into kSubBuckets equally sized buckets, so any recorded value is known to within
+// 1 / kSubBuckets of itself. The bucket array has a fixed size, and recording is a single relaxed
+// atomic increment.
+
+#include <atomic>
+#include <cstdint>
+
+class LatencyHistogram {
+public:
+  static constexpr unsigned kSubBucketBits = 4;
+  static constexpr unsigned kSubBuckets = 1u << kSubBucketBits;
+
+  // Durations of 2^kMaxExponent ns (~18 minutes) and more go into the last bucket.
+  static constexpr unsigned kMaxExponent = 40;
+  static constexpr unsigned kNumBuckets = (kMaxExponent - kSubBucketBits + 1) * kSubBuckets;
+
+  static unsigned getBucketIndex(uint64_t ns) {
+    if (ns < kSubBuckets)
+      return ns;
+
+    unsigned exponent = 63 - __builtin_clzll(ns);
+    if (exponent >= kMaxExponent)
+      return kNumBuckets - 1;
+
+    unsigned shift = exponent - kSubBucketBits;
+    unsigned subBucket = (ns >> shift) - kSubBuckets;
+    return (shift + 1) * kSubBuckets + subBucket;
+  }
+
+  static uint64_t getBucketLowerBound(unsigned index) {
+    if (index < kSubBuckets)
+      return index;
+
+    unsigned shift = index / kSubBuckets - 1;
+    uint64_t subBucket = index % kSubBuckets;
+    return (kSubBuckets + subBucket) << shift;
+  }
+
+  static uint64_t getBucketWidth(unsigned index) {
+    return index < kSubBuckets ? 1 : uint64_t(1) << (index / kSubBuckets - 1);
+  }
+
+  LatencyHistogram() { reset(); }
+
+  void record(uint64_t ns) { counts[getBucketIndex(ns)].fetch_add(1, std::memory_order_relaxed); }
+
+  void reset() {
+    for (auto &count : counts)
+      count.store(0, std::memory_order_relaxed);
+  }
+
+  uint64_t getCount(unsigned index) const { return counts[index].load(std::memory_order_relaxed); }
+
+  uint64_t getTotalCount() const {
+    uint64_t total = 0;
+    for (auto &count : counts)
+      total += count.load(std::memory_order_relaxed);
+    return total;
+  }
+
+  // Copies the kNumBuckets bucket counts to copy.
+  void copyCounts(uint64_t *copy) const {
+    for (unsigned i = 0; i < kNumBuckets; ++i)
+      copy[i] = counts[i].load(std::memory_order_relaxed);
+  }
+
+  // Returns the middle of the bucket holding the given percentile (0 - 100), or 0 if nothing was
+  // recorded.
+  uint64_t getPercentile(double percentile) const {
+    uint64_t copy[kNumBuckets];
+    copyCounts(copy);
+    return getPercentile(copy, percentile);
+  }
+
+  // The same, over bucket counts copied with copyCounts.
+  static uint64_t getPercentile(const uint64_t *bucketCounts, double percentile) {
+    uint64_t total = 0;
+    for (unsigned i = 0; i < kNumBuckets; ++i)
+      total += bucketCounts[i];
+    if (total == 0)
+      return 0;
+
+    uint64_t target = static_cast<uint64_t>(percentile / 100.0 * total + 0.5);
+    if (target == 0)
+      target = 1;
+
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < kNumBuckets; ++i) {
+      seen += bucketCounts[i];
+      if (seen >= target)
+        return getBucketLowerBound(i) + getBucketWidth(i) / 2;
+    }
+    return getBucketLowerBound(kNumBuckets - 1);
+  }
+
+private:
+  std::atomic<uint64_t> counts[kNumBuckets];
+};
@@ -0,0 +1,670 @@
+#pragma once
+
+// Address to source line index of a GPU code object, built from its DWARF .debug_line section.
+//
+// The line number programs of all units are run once and their rows flattened into one array of
+// LineIndexEntry sorted by address, so a lookup is a binary search. An entry covers the addresses
+// up to the next entry; entries with line 0 close a sequence and cover nothing.
+//
+// The index is cached next to the code object, and is valid as long as the code object's size
+// and modification time match the ones it was built from:
+//
+//   LineIndexFileHeader
+//   LineIndexEntry entries[numEntries]
+//   numFiles times: uint32_t length, char path[length]
+
+#include "elfio/elfio.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+static constexpr char lineIndexFileMagic[8] = {'D', 'Y', 'N', 'L', 'I', 'N', '0', '1'};
+
+struct LineIndexFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t numFiles;
+  uint64_t numEntries;
+  uint64_t sourceSize;    // of the code object the index was built from
+  uint64_t sourceMtimeNs; // of the code object the index was built from
+};
+
+struct LineIndexEntry {
+  uint64_t address;
+  uint32_t fileIndex;
+  uint32_t line; // 0 past the end of a sequence
+};
+
+static_assert(sizeof(LineIndexEntry) == 16, "LineIndexEntry is stored as raw bytes");
+
+struct SourceLocation {
+  const std::string *file = nullptr;
+  uint32_t line = 0;
+
+  bool isKnown() const { return line != 0; }
+};
+
+// Reads the DWARF structures of a section, with bounds checks. Reads past the end yield zeros and
+// set failed.
+class DwarfReader {
+public:
+  DwarfReader(const char *data, size_t size) : data(data), size(size) {}
+
+  size_t getPosition() const { return pos; }
+  void seek(size_t position) { pos = std::min(position, size); }
+  bool isAtEnd() const { return pos >= size; }
+  bool hasFailed() const { return failed; }
+
+  template <typename T> T read() {
+    T value = 0;
+    if (sizeof(T) > size - pos) {
+      failed = true;
+      pos = size;
+      return value;
+    }
+    memcpy(&value, data + pos, sizeof(T));
+    pos += sizeof(T);
+    return value;
+  }
+
+  uint64_t readSized(unsigned bytes) {
+    switch (bytes) {
+    case 1:
+      return read<uint8_t>();
+    case 2:
+      return read<uint16_t>();
+    case 4:
+      return read<uint32_t>();
+    case 8:
+      return read<uint64_t>();
+    default:
+      skip(bytes);
+      return 0;
+    }
+  }
+
+  uint64_t readUleb() {
+    uint64_t value = 0;
+    for (unsigned shift = 0;; shift += 7) {
+      uint8_t byte = read<uint8_t>();
+      if (shift < 64)
+        value |= uint64_t(byte & 0x7f) << shift;
+      if (!(byte & 0x80) || failed)
+        return value;
+    }
+  }
+
+  int64_t readSleb() {
+    uint64_t value = 0;
+    unsigned shift = 0;
+    uint8_t byte;
+    do {
+      byte = read<uint8_t>();
+      if (shift < 64)
+        value |= uint64_t(byte & 0x7f) << shift;
+      shift += 7;
+    } while ((byte & 0x80) && !failed);
+    if (shift < 64 && (byte & 0x40))
+      value |= ~uint64_t(0) << shift;
+    return static_cast<int64_t>(value);
+  }
+
+  std::string readString() {
+    const char *start = data + pos;
+    const void *end = memchr(start, 0, size - pos);
+    if (!end) {
+      failed = true;
+      pos = size;
+      return "";
+    }
+    size_t length = static_cast<const char *>(end) - start;
+    pos += length + 1;
+    return std::string(start, length);
+  }
+
+  void skip(size_t bytes) {
+    if (bytes > size - pos) {
+      failed = true;
+      bytes = size - pos;
+    }
+    pos += bytes;
+  }
+
+private:
+  const char *data;
+  size_t size;
+  size_t pos = 0;
+  bool failed = false;
+};
+
+// Builds the index of a code object from its .debug_line section.
+class LineIndexBuilder {
+public:
+  // Returns an error message, or an empty string on success.
+  std::string build(const std::string &codeObjectPath) {
+    ELFIO::elfio file;
+    if (!file.load(codeObjectPath, true))
+      return "can't load " + codeObjectPath;
+
+    const ELFIO::section *debugLine = nullptr;
+    for (const auto &section : file.sections) {
+      if (section->get_name() == ".debug_line")
+        debugLine = section.get();
+      else if (section->get_name() == ".debug_line_str")
+        lineStrings = section.get();
+      else if (section->get_name() == ".debug_str")
+        strings = section.get();
+      else if (section->get_name() == ".debug_str_offsets")
+        stringOffsets = section.get();
+    }
+    if (!debugLine || !debugLine->get_data())
+      return codeObjectPath + " has no .debug_line section, was it compiled with -g?";
+
+    DwarfReader reader(debugLine->get_data(), debugLine->get_size());
+    while (!reader.isAtEnd()) {
+      if (!readUnit(reader))
+        return codeObjectPath + (unsupported.empty() ? " has a malformed .debug_line section"
+                                                     : " " + unsupported);
+    }
+
+    // Sequences can be in any order. At an address where one sequence ends and another starts,
+    // the start has to win, so end rows sort first. Of several rows at the same address the last
+    // one is kept, which is the one a lookup of that address finds anyway.
+    std::stable_sort(rows.begin(), rows.end(), [](const Row &a, const Row &b) {
+      if (a.entry.address != b.entry.address)
+        return a.entry.address < b.entry.address;
+      return a.endSequence > b.endSequence;
+    });
+    entries.clear();
+    entries.reserve(rows.size());
+    for (const Row &row : rows) {
+      if (!entries.empty() && entries.back().address == row.entry.address)
+        entries.back() = row.entry;
+      else
+        entries.push_back(row.entry);
+    }
+    rows.clear();
+    rows.shrink_to_fit();
+    return "";
+  }
+
+  std::vector<LineIndexEntry> entries;
+  std::vector<std::string> files;
+
+private:
+  struct Row {
+    LineIndexEntry entry;
+    bool endSequence;
+  };
+
+  // DW_LNCT_* and DW_FORM_* values used by DWARF 5 file tables.
+  enum : uint64_t {
+    kLnctPath = 1,
+    kLnctDirectoryIndex = 2,
+    kFormBlock2 = 0x03,
+    kFormBlock4 = 0x04,
+    kFormData2 = 0x05,
+    kFormData4 = 0x06,
+    kFormData8 = 0x07,
+    kFormString = 0x08,
+    kFormBlock = 0x09,
+    kFormBlock1 = 0x0a,
+    kFormData1 = 0x0b,
+    kFormSdata = 0x0d,
+    kFormStrp = 0x0e,
+    kFormUdata = 0x0f,
+    kFormLineStrp = 0x1f,
+    kFormData16 = 0x1e,
+    kFormStrx = 0x1a,
+    kFormStrx1 = 0x25,
+    kFormStrx2 = 0x26,
+    kFormStrx3 = 0x27,
+    kFormStrx4 = 0x28,
+  };
+
+  // Reads an attribute of a DWARF 5 directory or file entry. Strings are returned in str, numbers
+  // in value. Returns false for forms that can't appear there, or strings that can't be resolved.
+  bool readForm(DwarfReader &reader, uint64_t form, bool is64, std::string &str, uint64_t &value) {
+    str.clear();
+    value = 0;
+    switch (form) {
+    case kFormString:
+      str = reader.readString();
+      return true;
+    case kFormLineStrp:
+    case kFormStrp: {
+      uint64_t offset = reader.readSized(is64 ? 8 : 4);
+      str = getString(form == kFormLineStrp ? lineStrings : strings, offset);
+      return true;
+    }
+    case kFormStrx:
+      return getIndexedString(reader.readUleb(), str);
+    case kFormStrx1:
+      return getIndexedString(reader.read<uint8_t>(), str);
+    case kFormStrx2:
+      return getIndexedString(reader.read<uint16_t>(), str);
+    case kFormStrx3: {
+      uint64_t index = reader.read<uint16_t>();
+      return getIndexedString(index | uint64_t(reader.read<uint8_t>()) << 16, str);
+    }
+    case kFormStrx4:
+      return getIndexedString(reader.read<uint32_t>(), str);
+    case kFormUdata:
+      value = reader.readUleb();
+      return true;
+    case kFormSdata:
+      value = reader.readSleb();
+      return true;
+    case kFormData1:
+      value = reader.read<uint8_t>();
+      return true;
+    case kFormData2:
+      value = reader.read<uint16_t>();
+      return true;
+    case kFormData4:
+      value = reader.read<uint32_t>();
+      return true;
+    case kFormData8:
+      value = reader.read<uint64_t>();
+      return true;
+    case kFormData16:
+      reader.skip(16);
+      return true;
+    case kFormBlock1:
+      reader.skip(reader.read<uint8_t>());
+      return true;
+    case kFormBlock2:
+      reader.skip(reader.read<uint16_t>());
+      return true;
+    case kFormBlock4:
+      reader.skip(reader.read<uint32_t>());
+      return true;
+    case kFormBlock:
+      reader.skip(reader.readUleb());
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  static std::string getString(const ELFIO::section *section, uint64_t offset) {
+    if (!section || !section->get_data() || offset >= section->get_size())
+      return "";
+    const char *start = section->get_data() + offset;
+    return std::string(start, strnlen(start, section->get_size() - offset));
+  }
+
+  // Resolves a DW_FORM_strx* index through .debug_str_offsets. A unit's table starts at its
+  // DW_AT_str_offsets_base, which is in .debug_info. That isn't read here, so only a section with
+  // a single table, i.e. a code object from a single unit, can be resolved.
+  bool getIndexedString(uint64_t index, std::string &str) {
+    if (!stringOffsets || !stringOffsets->get_data()) {
+      unsupported = "uses DW_FORM_strx in .debug_line but has no .debug_str_offsets section";
+      return false;
+    }
+
+    DwarfReader reader(stringOffsets->get_data(), stringOffsets->get_size());
+    uint64_t unitLength = reader.read<uint32_t>();
+    bool is64 = unitLength == 0xffffffff;
+    if (is64)
+      unitLength = reader.read<uint64_t>();
+    size_t tableEnd = reader.getPosition() + unitLength;
+    reader.skip(4); // version, padding
+    if (reader.hasFailed() || tableEnd != stringOffsets->get_size()) {
+      unsupported = "has several .debug_str_offsets tables, DW_FORM_strx in .debug_line is only "
+                    "supported with one";
+      return false;
+    }
+
+    unsigned offsetSize = is64 ? 8 : 4;
+    if (index >= (tableEnd - reader.getPosition()) / offsetSize)
+      return false;
+    reader.skip(index * offsetSize);
+    str = getString(strings, reader.readSized(offsetSize));
+    return true;
+  }
+
+  // Reads a DWARF 5 directory or file table, returning the path and directory index of entries.
+  bool readEntryTable(DwarfReader &reader, bool is64,
+                      std::vector<std::pair<std::string, uint64_t>> &table) {
+    uint8_t formatCount = reader.read<uint8_t>();
+    std::vector<std::pair<uint64_t, uint64_t>> format(formatCount); // content type, form
+    for (auto &item : format) {
+      item.first = reader.readUleb();
+      item.second = reader.readUleb();
+    }
+
+    uint64_t count = reader.readUleb();
+    std::string str;
+    uint64_t value;
+    for (uint64_t i = 0; i < count && !reader.hasFailed(); ++i) {
+      std::pair<std::string, uint64_t> &entry = table.emplace_back();
+      for (auto &item : format) {
+        if (!readForm(reader, item.second, is64, str, value))
+          return false;
+        if (item.first == kLnctPath)
+          entry.first = str;
+        else if (item.first == kLnctDirectoryIndex)
+          entry.second = value;
+      }
+    }
+    return !reader.hasFailed();
+  }
+
+  uint32_t addFile(const std::string &directory, const std::string &name) {
+    std::string path = name;
+    if (!name.empty() && name[0] != '/' && !directory.empty())
+      path = directory + "/" + name;
+    auto it = fileIndices.emplace(path, files.size());
+    if (it.second)
+      files.push_back(path);
+    return it.first->second;
+  }
+
+  bool readUnit(DwarfReader &reader) {
+    uint64_t unitLength = reader.read<uint32_t>();
+    bool is64 = unitLength == 0xffffffff;
+    if (is64)
+      unitLength = reader.read<uint64_t>();
+    size_t unitEnd = reader.getPosition() + unitLength;
+
+    uint16_t version = reader.read<uint16_t>();
+    if (version < 2 || version > 5)
+      return false;
+    if (version >= 5) {
+      reader.read<uint8_t>(); // address_size
+      reader.read<uint8_t>(); // segment_selector_size
+    }
+    uint64_t headerLength = reader.readSized(is64 ? 8 : 4);
+    size_t programStart = reader.getPosition() + headerLength;
+
+    uint8_t minInstLength = reader.read<uint8_t>();
+    if (version >= 4)
+      reader.read<uint8_t>(); // maximum_operations_per_instruction, 1 for non-VLIW targets
+    reader.read<uint8_t>(); // default_is_stmt, the index keeps all rows
+    int8_t lineBase = reader.read<int8_t>();
+    uint8_t lineRange = reader.read<uint8_t>();
+    uint8_t opcodeBase = reader.read<uint8_t>();
+    if (lineRange == 0 || opcodeBase == 0)
+      return false;
+    std::vector<uint8_t> standardOpcodeLengths(opcodeBase);
+    for (uint8_t i = 1; i < opcodeBase; ++i)
+      standardOpcodeLengths[i] = reader.read<uint8_t>();
+
+    // Unit file numbers to index file numbers. DWARF 5 numbers files from 0, earlier versions
+    // from 1, with file 0 unused.
+    std::vector<uint32_t> unitFiles;
+    std::vector<std::string> directories;
+    if (version >= 5) {
+      std::vector<std::pair<std::string, uint64_t>> directoryTable, fileTable;
+      if (!readEntryTable(reader, is64, directoryTable) ||
+          !readEntryTable(reader, is64, fileTable))
+        return false;
+      for (auto &directory : directoryTable)
+        directories.push_back(directory.first);
+      for (auto &file : fileTable) {
+        unitFiles.push_back(addFile(
+            file.second < directories.size() ? directories[file.second] : "", file.first));
+      }
+    } else {
+      directories.emplace_back(); // the compilation directory, not known here
+      for (std::string directory = reader.readString(); !directory.empty();
+           directory = reader.readString())
+        directories.push_back(directory);
+      unitFiles.push_back(addFile("", "<unknown>"));
+      for (std::string name = reader.readString(); !name.empty(); name = reader.readString()) {
+        uint64_t directoryIndex = reader.readUleb();
+        reader.readUleb(); // modification time
+        reader.readUleb(); // length
+        unitFiles.push_back(
+            addFile(directoryIndex < directories.size() ? directories[directoryIndex] : "", name));
+      }
+    }
+    if (reader.hasFailed())
+      return false;
+
+    reader.seek(programStart);
+    runProgram(reader, unitEnd, version, minInstLength, lineBase, lineRange, opcodeBase,
+               standardOpcodeLengths, directories, unitFiles);
+    reader.seek(unitEnd);
+    return !reader.hasFailed();
+  }
+
+  void runProgram(DwarfReader &reader, size_t unitEnd, uint16_t version, uint8_t minInstLength,
+                  int8_t lineBase, uint8_t lineRange, uint8_t opcodeBase,
+                  const std::vector<uint8_t> &standardOpcodeLengths,
+                  const std::vector<std::string> &directories, std::vector<uint32_t> &unitFiles) {
+    uint64_t address = 0;
+    uint64_t file = 1;
+    int64_t line = 1;
+
+    auto emit = [&](bool endSequence) {
+      Row row;
+      row.entry.address = address;
+      row.entry.fileIndex = file < unitFiles.size() ? unitFiles[file] : 0;
+      row.entry.line = endSequence ? 0 : static_cast<uint32_t>(std::max<int64_t>(line, 1));
+      row.endSequence = endSequence;
+      rows.push_back(row);
+    };
+    auto reset = [&]() {
+      address = 0;
+      file = 1;
+      line = 1;
+    };
+
+    while (reader.getPosition() < unitEnd && !reader.hasFailed()) {
+      uint8_t opcode = reader.read<uint8_t>();
+      if (opcode >= opcodeBase) {
+        uint8_t adjusted = opcode - opcodeBase;
+        address += (adjusted / lineRange) * minInstLength;
+        line += lineBase + adjusted % lineRange;
+        emit(false);
+        continue;
+      }
+
+      switch (opcode) {
+      case 0: { // extended opcode
+        uint64_t length = reader.readUleb();
+        size_t end = reader.getPosition() + length;
+        uint8_t extended = length ? reader.read<uint8_t>() : 0;
+        if (extended == 1) { // DW_LNE_end_sequence
+          emit(true);
+          reset();
+        } else if (extended == 2) { // DW_LNE_set_address
+          address = reader.readSized(length - 1);
+        } else if (extended == 3 && version < 5) { // DW_LNE_define_file
+          std::string name = reader.readString();
+          uint64_t directoryIndex = reader.readUleb();
+          unitFiles.push_back(addFile(
+              directoryIndex < directories.size() ? directories[directoryIndex] : "", name));
+        }
+        reader.seek(end);
+        break;
+      }
+      case 1: // DW_LNS_copy
+        emit(false);
+        break;
+      case 2: // DW_LNS_advance_pc
+        address += reader.readUleb() * minInstLength;
+        break;
+      case 3: // DW_LNS_advance_line
+        line += reader.readSleb();
+        break;
+      case 4: // DW_LNS_set_file
+        file = reader.readUleb();
+        break;
+      case 8: // DW_LNS_const_add_pc
+        address += ((255 - opcodeBase) / lineRange) * minInstLength;
+        break;
+      case 9: // DW_LNS_fixed_advance_pc
+        address += reader.read<uint16_t>();
+        break;
+      default:
+        // Column, statement and block flags, ISA: not needed for the index.
+        for (uint8_t i = 0; i < standardOpcodeLengths[opcode]; ++i)
+          reader.readUleb();
+        break;
+      }
+    }
+  }
+
+  const ELFIO::section *lineStrings = nullptr;
+  const ELFIO::section *strings = nullptr;
+  const ELFIO::section *stringOffsets = nullptr;
+  std::string unsupported; // why the last unit couldn't be read, if it is valid DWARF
+  std::vector<Row> rows;
+  std::unordered_map<std::string, uint32_t> fileIndices;
+};
+
+// A line index, either mapped from its cache file or just built.
+class LineIndex {
+public:
+  LineIndex() = default;
+  LineIndex(const LineIndex &) = delete;
+  LineIndex &operator=(const LineIndex &) = delete;
+
+  ~LineIndex() {
+    if (mapped)
+      munmap(mapped, mappedSize);
+  }
+
+  // Maps the cache at cachePath if it was built from the current codeObjectPath, otherwise builds
+  // the index and rewrites the cache. Returns an error message, or an empty string on success.
+  std::string open(const std::string &codeObjectPath, const std::string &cachePath) {
+    struct stat st;
+    if (stat(codeObjectPath.c_str(), &st) != 0)
+      return "can't open " + codeObjectPath;
+    uint64_t sourceSize = st.st_size;
+    uint64_t sourceMtimeNs = uint64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+
+    if (mapCache(cachePath, sourceSize, sourceMtimeNs)) {
+      fromCache = true;
+      return "";
+    }
+
+    LineIndexBuilder builder;
+    std::string error = builder.build(codeObjectPath);
+    if (!error.empty())
+      return error;
+    builtEntries = std::move(builder.entries);
+    files = std::move(builder.files);
+    entries = builtEntries.data();
+    numEntries = builtEntries.size();
+
+    // A cache that can't be written only costs the next run a rebuild.
+    writeCache(cachePath, sourceSize, sourceMtimeNs);
+    return "";
+  }
+
+  SourceLocation lookup(uint64_t address) const {
+    const LineIndexEntry *end = entries + numEntries;
+    const LineIndexEntry *it =
+        std::upper_bound(entries, end, address, [](uint64_t value, const LineIndexEntry &entry) {
+          return value < entry.address;
+        });
+    SourceLocation location;
+    if (it == entries || it[-1].line == 0 || it[-1].fileIndex >= files.size())
+      return location;
+    location.file = &files[it[-1].fileIndex];
+    location.line = it[-1].line;
+    return location;
+  }
+
+  size_t getNumEntries() const { return numEntries; }
+  bool isFromCache() const { return fromCache; }
+
+private:
+  bool mapCache(const std::string &cachePath, uint64_t sourceSize, uint64_t sourceMtimeNs) {
+    int fd = ::open(cachePath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(LineIndexFileHeader)) {
+      close(fd);
+      return false;
+    }
+    mappedSize = st.st_size;
+    void *addr = mmap(nullptr, mappedSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+      return false;
+    mapped = static_cast<char *>(addr);
+
+    const auto *header = reinterpret_cast<const LineIndexFileHeader *>(mapped);
+    size_t entriesEnd = sizeof(LineIndexFileHeader) + header->numEntries * sizeof(LineIndexEntry);
+    if (memcmp(header->magic, lineIndexFileMagic, sizeof(lineIndexFileMagic)) != 0 ||
+        header->version != 1 || header->sourceSize != sourceSize ||
+        header->sourceMtimeNs != sourceMtimeNs ||
+        header->numEntries > mappedSize / sizeof(LineIndexEntry) || entriesEnd > mappedSize)
+      return unmapCache();
+
+    size_t pos = entriesEnd;
+    for (uint32_t i = 0; i < header->numFiles; ++i) {
+      uint32_t length;
+      if (sizeof(length) > mappedSize - pos)
+        return unmapCache();
+      memcpy(&length, mapped + pos, sizeof(length));
+      pos += sizeof(length);
+      if (length > mappedSize - pos)
+        return unmapCache();
+      files.emplace_back(mapped + pos, length);
+      pos += length;
+    }
+
+    entries = reinterpret_cast<const LineIndexEntry *>(mapped + sizeof(LineIndexFileHeader));
+    numEntries = header->numEntries;
+    return true;
+  }
+
+  bool unmapCache() {
+    munmap(mapped, mappedSize);
+    mapped = nullptr;
+    files.clear();
+    return false;
+  }
+
+  // Written to a temporary file first, so concurrent runs never see a partial cache.
+  void writeCache(const std::string &cachePath, uint64_t sourceSize, uint64_t sourceMtimeNs) {
+    std::string tempPath = cachePath + ".tmp." + std::to_string(getpid());
+    std::ofstream file(tempPath, std::ios::binary);
+    if (!file)
+      return;
+
+    LineIndexFileHeader header = {};
+    memcpy(header.magic, lineIndexFileMagic, sizeof(header.magic));
+    header.version = 1;
+    header.numFiles = files.size();
+    header.numEntries = numEntries;
+    header.sourceSize = sourceSize;
+    header.sourceMtimeNs = sourceMtimeNs;
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char *>(entries), numEntries * sizeof(LineIndexEntry));
+    for (const std::string &path : files) {
+      uint32_t length = path.size();
+      file.write(reinterpret_cast<const char *>(&length), sizeof(length));
+      file.write(path.data(), length);
+    }
+    file.close();
+
+    if (!file || rename(tempPath.c_str(), cachePath.c_str()) != 0)
+      unlink(tempPath.c_str());
+  }
+
+  char *mapped = nullptr;
+  size_t mappedSize = 0;
+  std::vector<LineIndexEntry> builtEntries;
+  const LineIndexEntry *entries = nullptr;
+  size_t numEntries = 0;
+  std::vector<std::string> files;
+  bool fromCache = false;
+};
@@ -0,0 +1,285 @@
+#include "counter-records.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <queue>
+#include <string>
+#include <sys/sendfile.h>
+#include <thread>
+#include <vector>
+
+// This tool merges counter files written by the preload library (DYNINST_AMDGPU_OUTPUT) into a
+// single counter file, adding up the values of the same kernel, launch shape and variable.
+//
+// Input files are mapped, not read. The key space is split into one range per thread and every
+// thread does a k-way merge of its range over all inputs into a part file, so memory use only
+// depends on the number of inputs, not on their size. The parts are concatenated at the end.
+//
+// usage:
+// merge-counters [-j <threads>] [--text] -o <output> <counter-file | @file-with-paths>...
+
+static void showHelp(const char *toolName) {
+  std::cerr << "usage : \n";
+  std::cerr << "  ";
+  std::cerr << toolName << " [-j <threads>] [--text] -o <output> <counter-file>...\n\n";
+  std::cerr << toolName << " merges counter files into <output>\n";
+  std::cerr << "  @<file> reads input paths from <file>, one per line\n";
+  std::cerr << "  --text also prints the merged counters\n";
+}
+
+static void addInputs(const std::string &arg, std::vector<std::string> &inputPaths) {
+  if (arg.empty() || arg[0] != '@') {
+    inputPaths.push_back(arg);
+    return;
+  }
+
+  std::ifstream listFile(arg.substr(1));
+  if (!listFile) {
+    std::cerr << "error : can't open " << arg.substr(1) << std::endl;
+    exit(1);
+  }
+
+  std::string line;
+  while (std::getline(listFile, line)) {
+    if (!line.empty())
+      inputPaths.push_back(line);
+  }
+}
+
+struct Cursor {
+  const CounterFileRecord *current;
+  const CounterFileRecord *end;
+};
+
+struct CursorGreater {
+  bool operator()(const Cursor &a, const Cursor &b) const { return *b.current < *a.current; }
+};
+
+// Buffers records and writes them out in large blocks.
+class RecordWriter {
+public:
+  explicit RecordWriter(const std::string &filePath) : file(filePath, std::ios::binary) {
+    buffer.reserve(kBufferRecords);
+  }
+
+  bool isOpen() const { return static_cast<bool>(file); }
+
+  void add(const CounterFileRecord &record) {
+    buffer.push_back(record);
+    if (buffer.size() == kBufferRecords)
+      flush();
+  }
+
+  void flush() {
+    file.write(reinterpret_cast<const char *>(buffer.data()),
+               buffer.size() * sizeof(CounterFileRecord));
+    count += buffer.size();
+    buffer.clear();
+  }
+
+  uint64_t getCount() const { return count; }
+
+private:
+  static constexpr size_t kBufferRecords = 1 << 15;
+
+  std::ofstream file;
+  std::vector<CounterFileRecord> buffer;
+  uint64_t count = 0;
+};
+
+// Merges the records with kernelHash in [begin, end) of all inputs. end == 0 means no upper bound.
+static uint64_t mergeRange(const std::vector<std::unique_ptr<CounterFile>> &inputs, uint64_t begin,
+                           uint64_t end, const std::string &partPath) {
+  std::priority_queue<Cursor, std::vector<Cursor>, CursorGreater> heap;
+
+  auto lowerBound = [](const CounterFile &input, uint64_t hash) {
+    return std::partition_point(input.begin(), input.end(), [hash](const CounterFileRecord &r) {
+      return r.kernelHash < hash;
+    });
+  };
+
+  for (auto &input : inputs) {
+    Cursor cursor = {lowerBound(*input, begin), end ? lowerBound(*input, end) : input->end()};
+    if (cursor.current != cursor.end)
+      heap.push(cursor);
+  }
+
+  RecordWriter writer(partPath);
+  if (!writer.isOpen()) {
+    std::cerr << "error : can't create " << partPath << std::endl;
+    exit(1);
+  }
+
+  bool havePending = false;
+  CounterFileRecord pending = {};
+  while (!heap.empty()) {
+    Cursor cursor = heap.top();
+    heap.pop();
+
+    const CounterFileRecord &record = *cursor.current;
+    if (havePending && pending.sameKey(record)) {
+      pending.launches += record.launches;
+      pending.sum += record.sum;
+    } else {
+      if (havePending)
+        writer.add(pending);
+      pending = record;
+      havePending = true;
+    }
+
+    if (++cursor.current != cursor.end)
+      heap.push(cursor);
+  }
+
+  if (havePending)
+    writer.add(pending);
+  writer.flush();
+  return writer.getCount();
+}
+
+static void appendFile(const std::string &partPath, int outFd) {
+  int inFd = open(partPath.c_str(), O_RDONLY | O_CLOEXEC);
+  assert(inFd >= 0);
+
+  struct stat st;
+  fstat(inFd, &st);
+  off_t remaining = st.st_size;
+  while (remaining > 0) {
+    ssize_t copied = sendfile(outFd, inFd, nullptr, remaining);
+    if (copied <= 0) {
+      perror("error : can't append part file");
+      exit(1);
+    }
+    remaining -= copied;
+  }
+  close(inFd);
+}
+
+static void printCounters(const CounterFile &file, const CounterFileNames &names) {
+  const CounterFileRecord *previous = nullptr;
+  for (const CounterFileRecord *record = file.begin(); record != file.end(); ++record) {
+    if (!previous || record->kernelHash != previous->kernelHash ||
+        !(record->shape == previous->shape)) {
+      if (previous)
+        std::cout << '\n';
+      auto it = names.kernels.find(record->kernelHash);
+      std::cout << "Aggregated instrumentation variable values for "
+                << (it != names.kernels.end() ? it->second : std::to_string(record->kernelHash))
+                << record->shape.format() << " (" << record->launches << " launches): \n";
+    }
+    previous = record;
+
+    if (record->varIndex < names.vars.size())
+      std::cout << names.vars[record->varIndex];
+    else
+      std::cout << "var" << record->varIndex;
+    std::cout << " = " << record->sum << '\n';
+  }
+}
+
+int main(int argc, char **argv) {
+  unsigned numThreads = std::max(1u, std::thread::hardware_concurrency());
+  bool printText = false;
+  std::string outputPath;
+  std::vector<std::string> inputPaths;
+
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg == "-j" && i + 1 < argc) {
+      numThreads = std::max(1, atoi(argv[++i]));
+    } else if (arg.size() > 2 && arg.compare(0, 2, "-j") == 0) {
+      numThreads = std::max(1, atoi(arg.c_str() + 2));
+    } else if (arg == "-o" && i + 1 < argc) {
+      outputPath = argv[++i];
+    } else if (arg == "--text") {
+      printText = true;
+    } else if (arg[0] == '-') {
+      showHelp(argv[0]);
+      exit(1);
+    } else {
+      addInputs(arg, inputPaths);
+    }
+  }
+
+  if (outputPath.empty() || inputPaths.empty()) {
+    showHelp(argv[0]);
+    exit(1);
+  }
+
+  std::vector<std::unique_ptr<CounterFile>> inputs;
+  CounterFileNames names;
+  for (auto &inputPath : inputPaths) {
+    auto input = std::make_unique<CounterFile>();
+    std::string error = input->open(inputPath);
+    if (!error.empty()) {
+      std::cerr << "error : " << error << std::endl;
+      exit(1);
+    }
+    error = input->readNames(names);
+    if (!error.empty()) {
+      std::cerr << "error : " << error << std::endl;
+      exit(1);
+    }
+    inputs.push_back(std::move(input));
+  }
+
+  // Split the hash space into equally sized ranges, kernel hashes are uniformly distributed.
+  std::vector<std::string> partPaths(numThreads);
+  std::vector<uint64_t> partCounts(numThreads);
+  std::vector<std::thread> threads;
+  uint64_t rangeSize = numThreads == 1 ? 0 : UINT64_MAX / numThreads + 1;
+  for (unsigned t = 0; t < numThreads; ++t) {
+    partPaths[t] = outputPath + ".part" + std::to_string(t);
+    uint64_t begin = t * rangeSize;
+    uint64_t end = t + 1 == numThreads ? 0 : (t + 1) * rangeSize;
+    threads.emplace_back([&, t, begin, end]() {
+      partCounts[t] = mergeRange(inputs, begin, end, partPaths[t]);
+    });
+  }
+  for (auto &thread : threads)
+    thread.join();
+
+  CounterFileHeader header = makeCounterFileHeader(-1, 0, "");
+  for (uint64_t count : partCounts)
+    header.numRecords += count;
+
+  {
+    std::ofstream outFile(outputPath, std::ios::binary);
+    if (!outFile) {
+      std::cerr << "error : can't create " << outputPath << std::endl;
+      exit(1);
+    }
+    outFile.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  }
+
+  int outFd = open(outputPath.c_str(), O_WRONLY | O_CLOEXEC);
+  assert(outFd >= 0);
+  lseek(outFd, 0, SEEK_END);
+  for (auto &partPath : partPaths) {
+    appendFile(partPath, outFd);
+    unlink(partPath.c_str());
+  }
+  close(outFd);
+
+  std::ofstream outFile(outputPath, std::ios::binary | std::ios::in | std::ios::out);
+  outFile.seekp(0, std::ios::end);
+  writeCounterFileNames(outFile, header, names);
+  outFile.seekp(0);
+  outFile.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  outFile.close();
+
+  std::cerr << "merged " << inputs.size() << " files into " << header.numRecords << " records\n";
+
+  if (printText) {
+    CounterFile merged;
+    std::string error = merged.open(outputPath);
+    assert(error.empty());
+    printCounters(merged, names);
+  }
+
+  return 0;
+}
@@ -0,0 +1,983 @@
+#pragma once
+
+// Reading and writing Clang offload bundles, the format of .hip_fatbin:
+//
+//   char magic[24]              "__CLANG_OFFLOAD_BUNDLE__"
+//   uint64_t numEntries
+//   numEntries times:
+//     uint64_t offset           of the code object, from the start of the bundle
+//     uint64_t size
+//     uint64_t idLength
+//     char id[idLength]         e.g. "hipv4-amdgcn-amd-amdhsa--gfx908", not null-terminated
+//   code objects, each aligned to kOffloadBundleAlignment
+//
+// Newer toolchains may compress the whole bundle into a CCOB container:
+//
+//   char magic[4]               "CCOB"
+//   uint16_t version            1, 2 or 3
+//   uint16_t method             0 for zlib, 1 for zstd
+//   totalSize                   uint32_t in version 2, uint64_t in version 3, missing in version 1;
+//                               the size of the container, header included
+//   uncompressedSize            uint32_t up to version 2, uint64_t in version 3
+//   uint64_t hash               the first 8 bytes of the MD5 of the uncompressed bundle
+//   compressed bundle           a zlib stream
+//
+// The reader maps the input and validates every length and offset against the mapping, so that
+// entries are views into it and nothing is copied. Code objects are copied from file to file by
+// the kernel where possible, otherwise through a fixed size buffer, so memory use doesn't depend
+// on their size. Padding in written bundles is left as holes. A code object that fits the space
+// of the one it replaces can be patched into a copy of the bundle, without moving anything else.
+// Entries with identical code objects share a single copy in written bundles.
+// Compressed bundles are inflated as a stream into an anonymous file, which is then read like an
+// uncompressed one. Compression splits the bundle into chunks that are deflated in parallel and
+// joined into one zlib stream.
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+#include <zlib.h>
+
+static constexpr char offloadBundleMagic[24] = {'_', '_', 'C', 'L', 'A', 'N', 'G', '_',
+                                                'O', 'F', 'F', 'L', 'O', 'A', 'D', '_',
+                                                'B', 'U', 'N', 'D', 'L', 'E', '_', '_'};
+
+// Code objects in bundles built for HIP are page aligned.
+static constexpr uint64_t kOffloadBundleAlignment = 0x1000;
+
+inline uint64_t alignUp(uint64_t value, uint64_t alignment) {
+  if (alignment <= 1)
+    return value;
+
+  uint64_t diff = value % alignment;
+  return diff == 0 ? value : value + (alignment - diff);
+}
+
+struct ByteSpan {
+  const char *data = nullptr;
+  uint64_t size = 0;
+};
+
+// A byte range of an open file.
+struct FileRange {
+  int fd = -1;
+  uint64_t offset = 0;
+  uint64_t size = 0;
+};
+
+struct OffloadBundleEntry {
+  std::string_view id;
+  uint64_t offset; // from the start of the bundle
+  ByteSpan contents;
+  uint64_t headerOffset; // of the offset, size and id length fields of the entry
+};
+
+// A read-only mapping of a whole file. The file stays open, for copies that don't go through
+// the mapping.
+class MappedFile {
+public:
+  MappedFile() = default;
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  ~MappedFile() {
+    if (data)
+      munmap(data, size);
+    if (fd >= 0)
+      close(fd);
+  }
+
+  // Returns an error message, or an empty string on success.
+  std::string open(const std::string &filePath) {
+    int fileFd = ::open(filePath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fileFd < 0)
+      return "can't open " + filePath;
+    return open(fileFd, filePath);
+  }
+
+  // Maps an open file, which is closed with the mapping. name is only used in messages.
+  std::string open(int fileFd, const std::string &name) {
+    fd = fileFd;
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+      return "can't stat " + name;
+    if (st.st_size == 0)
+      return name + " is empty";
+
+    size = st.st_size;
+    void *addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+      size = 0;
+      return "can't map " + name;
+    }
+    data = static_cast<char *>(addr);
+    return "";
+  }
+
+  ByteSpan getBytes() const { return {data, size}; }
+  FileRange getRange() const { return {fd, 0, size}; }
+  int getFd() const { return fd; }
+
+private:
+  int fd = -1;
+  char *data = nullptr;
+  size_t size = 0;
+};
+
+// Writes all of data at offset, retrying short writes.
+inline bool writeAt(int fd, const char *data, uint64_t size, uint64_t offset) {
+  while (size) {
+    ssize_t written = pwrite(fd, data, size, offset);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    data += written;
+    size -= written;
+    offset += written;
+  }
+  return true;
+}
+
+static constexpr char compressedBundleMagic[4] = {'C', 'C', 'O', 'B'};
+
+enum class CompressionMethod : uint16_t { Zlib = 0, Zstd = 1 };
+
+struct CompressedBundleHeader {
+  uint16_t version = 0;
+  uint16_t method = 0;
+  uint64_t size = 0; // of the header
+  uint64_t totalSize = 0;
+  uint64_t uncompressedSize = 0;
+  uint64_t hash = 0;
+};
+
+inline bool isCompressedOffloadBundle(ByteSpan bytes) {
+  return bytes.size >= sizeof(compressedBundleMagic) &&
+         memcmp(bytes.data, compressedBundleMagic, sizeof(compressedBundleMagic)) == 0;
+}
+
+// Returns an error message, or an empty string on success. name is only used in messages.
+inline std::string parseCompressedBundleHeader(ByteSpan bytes, const std::string &name,
+                                               CompressedBundleHeader &header) {
+  uint64_t pos = sizeof(compressedBundleMagic);
+  auto read = [&](auto &value) {
+    if (sizeof(value) > bytes.size - pos)
+      return false;
+    memcpy(&value, bytes.data + pos, sizeof(value));
+    pos += sizeof(value);
+    return true;
+  };
+  auto readSize = [&](bool is64Bit, uint64_t &value) {
+    if (is64Bit)
+      return read(value);
+    uint32_t value32;
+    if (!read(value32))
+      return false;
+    value = value32;
+    return true;
+  };
+
+  header = CompressedBundleHeader();
+  if (!isCompressedOffloadBundle(bytes) || !read(header.version) || !read(header.method))
+    return name + " has a truncated compressed bundle header";
+  if (header.version < 1 || header.version > 3)
+    return name + " is a compressed bundle of unknown version " + std::to_string(header.version);
+
+  header.totalSize = bytes.size;
+  if ((header.version >= 2 && !readSize(header.version == 3, header.totalSize)) ||
+      !readSize(header.version == 3, header.uncompressedSize) || !read(header.hash))
+    return name + " has a truncated compressed bundle header";
+  header.size = pos;
+  if (header.totalSize < header.size || header.totalSize > bytes.size)
+    return name + " has an invalid compressed bundle size";
+  return "";
+}
+
+// Inflates the compressed bundle at the start of bytes into fd, streaming through a fixed size
+// buffer. Returns an error message, or an empty string on success.
+inline std::string decompressOffloadBundle(ByteSpan bytes, const std::string &name, int fd) {
+  CompressedBundleHeader header;
+  std::string error = parseCompressedBundleHeader(bytes, name, header);
+  if (!error.empty())
+    return error;
+  if (header.method == static_cast<uint16_t>(CompressionMethod::Zstd))
+    return name + " is compressed with zstd, which isn't supported";
+  if (header.method != static_cast<uint16_t>(CompressionMethod::Zlib))
+    return name + " is compressed with unknown method " + std::to_string(header.method);
+
+  z_stream stream = {};
+  if (inflateInit(&stream) != Z_OK)
+    return "can't decompress " + name;
+
+  static constexpr uInt kInflateBufferSize = 1 << 20;
+  std::unique_ptr<char[]> buffer(new char[kInflateBufferSize]);
+  const char *input = bytes.data + header.size;
+  uint64_t inputSize = header.totalSize - header.size;
+  uint64_t written = 0;
+  int result = Z_OK;
+  while (result == Z_OK) {
+    if (stream.avail_in == 0) {
+      stream.avail_in = std::min<uint64_t>(inputSize, 1u << 30);
+      stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(input));
+      input += stream.avail_in;
+      inputSize -= stream.avail_in;
+    }
+    stream.next_out = reinterpret_cast<Bytef *>(buffer.get());
+    stream.avail_out = kInflateBufferSize;
+    result = inflate(&stream, Z_NO_FLUSH);
+    uint64_t produced = kInflateBufferSize - stream.avail_out;
+    if ((result != Z_OK && result != Z_STREAM_END) ||
+        produced > header.uncompressedSize - written ||
+        !writeAt(fd, buffer.get(), produced, written))
+      break;
+    written += produced;
+    // Out of input before the end of the stream.
+    if (result == Z_OK && produced == 0 && stream.avail_in == 0 && inputSize == 0)
+      break;
+  }
+  inflateEnd(&stream);
+
+  if (result != Z_STREAM_END)
+    return name + " has a corrupt compressed bundle";
+  if (written != header.uncompressedSize)
+    return name + " decompresses to " + std::to_string(written) + " bytes instead of " +
+           std::to_string(header.uncompressedSize);
+  return "";
+}
+
+// The parsed header of a bundle. Entries point into the bytes passed to parse, which must outlive
+// the bundle.
+class OffloadBundle {
+public:
+  static bool isOffloadBundle(ByteSpan bytes) {
+    return bytes.size >= sizeof(offloadBundleMagic) &&
+           memcmp(bytes.data, offloadBundleMagic, sizeof(offloadBundleMagic)) == 0;
+  }
+
+  // Returns an error message, or an empty string on success. name is only used in messages.
+  std::string parse(ByteSpan bytes_, const std::string &name) {
+    bytes = bytes_;
+    entries.clear();
+    if (!isOffloadBundle(bytes))
+      return name + " is not a Clang offload bundle";
+
+    uint64_t pos = sizeof(offloadBundleMagic);
+    uint64_t numEntries;
+    if (!readValue(pos, numEntries))
+      return name + " is truncated";
+    // Every entry takes at least 24 bytes of header, which bounds the reservation below.
+    if (numEntries > (bytes.size - pos) / 24)
+      return name + " has an invalid number of entries";
+
+    entries.reserve(numEntries);
+    for (uint64_t i = 0; i < numEntries; ++i) {
+      uint64_t offset, size, idLength;
+      if (!readValue(pos, offset) || !readValue(pos, size) || !readValue(pos, idLength) ||
+          idLength > bytes.size - pos)
+        return name + " has a truncated entry header";
+
+      OffloadBundleEntry &entry = entries.emplace_back();
+      entry.headerOffset = pos - 3 * sizeof(uint64_t);
+      entry.id = std::string_view(bytes.data + pos, idLength);
+      pos += idLength;
+
+      if (offset > bytes.size || size > bytes.size - offset)
+        return name + " entry " + std::string(entry.id) + " is out of bounds";
+      entry.offset = offset;
+      entry.contents = {bytes.data + offset, size};
+    }
+    headerSize = pos;
+    return "";
+  }
+
+  const std::vector<OffloadBundleEntry> &getEntries() const { return entries; }
+  uint64_t getHeaderSize() const { return headerSize; }
+  ByteSpan getBytes() const { return bytes; }
+
+  // Where the bundle ends, i.e. after its header or its last code object.
+  uint64_t getSize() const {
+    uint64_t size = headerSize;
+    for (const OffloadBundleEntry &entry : entries)
+      size = std::max(size, entry.offset + entry.contents.size);
+    return size;
+  }
+
+  // The number of bytes entry index can grow to without overlapping anything, i.e. up to the next
+  // code object, or any number for the last one. 0 if the entry shares its bytes with another
+  // entry, which a patch would change as well. Empty entries take no space.
+  uint64_t getSlotSize(size_t index) const {
+    const OffloadBundleEntry &entry = entries[index];
+    if (entry.offset < headerSize)
+      return 0;
+
+    uint64_t slotEnd = UINT64_MAX;
+    for (size_t i = 0; i < entries.size(); ++i) {
+      const OffloadBundleEntry &other = entries[i];
+      if (i == index || other.contents.size == 0)
+        continue;
+      if (other.offset > entry.offset)
+        slotEnd = std::min(slotEnd, other.offset);
+      else if (other.offset + other.contents.size > entry.offset)
+        return 0;
+    }
+    return slotEnd - entry.offset;
+  }
+
+  bool isLastCodeObject(size_t index) const {
+    return getSlotSize(index) == UINT64_MAX - entries[index].offset;
+  }
+
+private:
+  template <typename T> bool readValue(uint64_t &pos, T &value) const {
+    if (sizeof(T) > bytes.size - pos)
+      return false;
+    memcpy(&value, bytes.data + pos, sizeof(T));
+    pos += sizeof(T);
+    return true;
+  }
+
+  ByteSpan bytes;
+  std::vector<OffloadBundleEntry> entries;
+  uint64_t headerSize = 0;
+};
+
+// Where a bundle is in a bigger blob.
+struct BundleExtent {
+  uint64_t offset;
+  uint64_t size;
+};
+
+// Finds the bundles, compressed or not, stored back to back in bytes. That is what the linker
+// makes of the .hip_fatbin sections of several translation units, or of a -fgpu-rdc link. Zero
+// padding between bundles is skipped. Returns an error message, or an empty string on success.
+inline std::string findOffloadBundles(ByteSpan bytes, const std::string &name,
+                                      std::vector<BundleExtent> &bundles) {
+  bundles.clear();
+  uint64_t pos = 0;
+  while (true) {
+    while (pos < bytes.size && bytes.data[pos] == 0)
+      ++pos;
+    if (pos == bytes.size)
+      break;
+
+    ByteSpan rest = {bytes.data + pos, bytes.size - pos};
+    std::string bundleName = name + " (bundle at offset " + std::to_string(pos) + ")";
+    uint64_t size;
+    if (isCompressedOffloadBundle(rest)) {
+      CompressedBundleHeader header;
+      std::string error = parseCompressedBundleHeader(rest, bundleName, header);
+      if (!error.empty())
+        return error;
+      size = header.totalSize;
+    } else {
+      OffloadBundle bundle;
+      std::string error = bundle.parse(rest, bundleName);
+      if (!error.empty())
+        return error;
+      size = bundle.getSize();
+    }
+    bundles.push_back({pos, size});
+    pos += size;
+  }
+  return bundles.empty() ? name + " contains no offload bundle" : "";
+}
+
+// A bundle file, mapped and parsed. A compressed bundle is decompressed into an anonymous file
+// first, and everything refers to that instead.
+class OffloadBundleFile {
+public:
+  // Returns an error message, or an empty string on success.
+  std::string open(const std::string &filePath) {
+    std::string error = file.open(filePath);
+    if (!error.empty())
+      return error;
+    return parse(filePath);
+  }
+
+  // Opens a bundle from an open file, which is closed with the bundle. name is only used in
+  // messages.
+  std::string open(int fd, const std::string &name) {
+    std::string error = file.open(fd, name);
+    if (!error.empty())
+      return error;
+    return parse(name);
+  }
+
+  const OffloadBundle &getBundle() const { return bundle; }
+  const std::vector<OffloadBundleEntry> &getEntries() const { return bundle.getEntries(); }
+  bool isCompressed() const { return compressed; }
+
+  // The whole uncompressed bundle.
+  FileRange getFileRange() const { return getContents().getRange(); }
+
+  // The bytes of an entry in the uncompressed bundle, for copying.
+  FileRange getRange(const OffloadBundleEntry &entry) const {
+    return {getContents().getFd(), entry.offset, entry.contents.size};
+  }
+
+private:
+  // Decompresses file if needed, and parses the bundle. Anything but zero padding after the
+  // bundle is an error: the tools would silently ignore the other bundles of a .hip_fatbin that
+  // holds several, which extract-fatbin writes to files of their own.
+  std::string parse(const std::string &name) {
+    uint64_t end = 0;
+    if (isCompressedOffloadBundle(file.getBytes())) {
+      CompressedBundleHeader header;
+      std::string error = parseCompressedBundleHeader(file.getBytes(), name, header);
+      if (!error.empty())
+        return error;
+      end = header.totalSize;
+
+      int fd = memfd_create("offload-bundle", MFD_CLOEXEC);
+      if (fd < 0)
+        return "can't decompress " + name;
+      error = decompressOffloadBundle(file.getBytes(), name, fd);
+      if (!error.empty()) {
+        close(fd);
+        return error;
+      }
+      error = decompressed.open(fd, name);
+      if (!error.empty())
+        return error;
+      compressed = true;
+    }
+
+    std::string error = bundle.parse(getContents().getBytes(), name);
+    if (!error.empty())
+      return error;
+    if (!compressed)
+      end = bundle.getSize();
+    return checkTrailingBytes(end, name);
+  }
+
+  std::string checkTrailingBytes(uint64_t end, const std::string &name) const {
+    ByteSpan bytes = file.getBytes();
+    while (end < bytes.size && bytes.data[end] == 0)
+      ++end;
+    if (end == bytes.size)
+      return "";
+
+    std::vector<BundleExtent> bundles;
+    if (!findOffloadBundles(bytes, name, bundles).empty() || bundles.size() < 2)
+      return name + " has trailing data after its offload bundle";
+    return name + " holds " + std::to_string(bundles.size()) +
+           " offload bundles, from several translation units or -fgpu-rdc. Pass them one at a "
+           "time, as " + name + ".0 to " + name + "." + std::to_string(bundles.size() - 1) +
+           " written by extract-fatbin";
+  }
+
+  const MappedFile &getContents() const { return compressed ? decompressed : file; }
+
+  MappedFile file;
+  MappedFile decompressed;
+  bool compressed = false;
+  OffloadBundle bundle;
+};
+
+struct OffloadBundleWriterEntry {
+  std::string id;
+  FileRange contents;
+};
+
+// Size of the header of a bundle with these entries.
+inline uint64_t getOffloadBundleHeaderSize(const std::vector<OffloadBundleWriterEntry> &entries) {
+  uint64_t size = sizeof(offloadBundleMagic) + sizeof(uint64_t);
+  for (const OffloadBundleWriterEntry &entry : entries)
+    size += 3 * sizeof(uint64_t) + entry.id.size();
+  return size;
+}
+
+// Offsets of the entries in a bundle written by writeOffloadBundle, and the total size at the end.
+// Entry i is stored at the offset of entry copies[i], which is i for entries that aren't
+// duplicates of an earlier one.
+inline std::vector<uint64_t>
+layoutOffloadBundle(const std::vector<OffloadBundleWriterEntry> &entries,
+                    const std::vector<size_t> &copies) {
+  std::vector<uint64_t> offsets;
+  offsets.reserve(entries.size() + 1);
+  uint64_t end = getOffloadBundleHeaderSize(entries);
+  for (size_t i = 0; i < entries.size(); ++i) {
+    if (copies[i] != i) {
+      offsets.push_back(offsets[copies[i]]);
+      continue;
+    }
+    offsets.push_back(alignUp(end, kOffloadBundleAlignment));
+    end = offsets.back() + entries[i].contents.size;
+  }
+  offsets.push_back(end);
+  return offsets;
+}
+
+// Buffer size of the copyRange fallback. Large enough that the syscalls don't matter, small
+// enough that peak memory use stays flat for code objects of any size.
+static constexpr size_t kCopyBufferSize = 1 << 20;
+
+enum class CopyResult { Done, Unsupported, Failed };
+
+// Errors with which the kernel refuses a copy between these two files, rather than failing it.
+inline bool isCopyUnsupported(int error) {
+  return error == EXDEV || error == EINVAL || error == ENOSYS || error == EOPNOTSUPP ||
+         error == ENOTSUP;
+}
+
+// copy_file_range stays in the kernel, and may share extents instead of copying on filesystems
+// that support it.
+inline CopyResult copyWithCopyFileRange(const FileRange &source, int fd, uint64_t offset,
+                                        uint64_t &copied) {
+  while (copied < source.size) {
+    loff_t in = source.offset + copied;
+    loff_t out = offset + copied;
+    ssize_t result = copy_file_range(source.fd, &in, fd, &out, source.size - copied, 0);
+    if (result < 0 && errno == EINTR)
+      continue;
+    if (result < 0 && isCopyUnsupported(errno))
+      return CopyResult::Unsupported;
+    if (result <= 0)
+      return CopyResult::Failed;
+    copied += result;
+  }
+  return CopyResult::Done;
+}
+
+// sendfile writes at the file position of fd, which is only used by this function.
+inline CopyResult copyWithSendfile(const FileRange &source, int fd, uint64_t offset,
+                                   uint64_t &copied) {
+  if (lseek(fd, offset + copied, SEEK_SET) < 0)
+    return CopyResult::Unsupported;
+  while (copied < source.size) {
+    off_t in = source.offset + copied;
+    ssize_t result = sendfile(fd, source.fd, &in, source.size - copied);
+    if (result < 0 && errno == EINTR)
+      continue;
+    if (result < 0 && isCopyUnsupported(errno))
+      return CopyResult::Unsupported;
+    if (result <= 0)
+      return CopyResult::Failed;
+    copied += result;
+  }
+  return CopyResult::Done;
+}
+
+inline bool copyWithBuffer(const FileRange &source, int fd, uint64_t offset, uint64_t copied) {
+  std::unique_ptr<char[]> buffer(
+      new char[std::min<uint64_t>(kCopyBufferSize, source.size - copied)]);
+  while (copied < source.size) {
+    size_t chunk = std::min<uint64_t>(kCopyBufferSize, source.size - copied);
+    ssize_t numRead = pread(source.fd, buffer.get(), chunk, source.offset + copied);
+    if (numRead < 0 && errno == EINTR)
+      continue;
+    if (numRead <= 0 || !writeAt(fd, buffer.get(), numRead, offset + copied))
+      return false;
+    copied += numRead;
+  }
+  return true;
+}
+
+// Copies source to offset of fd with copy_file_range, falling back to sendfile, then to a user
+// space buffer when the kernel can't copy between these files. A fallback continues where the
+// previous method stopped.
+inline bool copyRange(const FileRange &source, int fd, uint64_t offset) {
+  uint64_t copied = 0;
+  CopyResult result = copyWithCopyFileRange(source, fd, offset, copied);
+  if (result == CopyResult::Unsupported)
+    result = copyWithSendfile(source, fd, offset, copied);
+  if (result == CopyResult::Unsupported)
+    return copyWithBuffer(source, fd, offset, copied);
+  return result == CopyResult::Done;
+}
+
+// Copies source to a new file. Returns an error message, or an empty string on success.
+inline std::string writeFile(const std::string &filePath, const FileRange &source) {
+  int fd = ::open(filePath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return "can't create " + filePath;
+  bool ok = copyRange(source, fd, 0);
+  ok = close(fd) == 0 && ok;
+  return ok ? "" : "can't write " + filePath;
+}
+
+// Copies source to the empty file fd, sharing its extents (a reflink) on filesystems that support
+// it.
+inline bool cloneFile(int fd, const FileRange &source) {
+  if (source.offset == 0 && ioctl(fd, FICLONE, source.fd) == 0)
+    return true;
+  return copyRange(source, fd, 0);
+}
+
+// Zeroes a byte range of fd, as a hole where the filesystem can punch one.
+inline bool zeroRange(int fd, uint64_t offset, uint64_t size) {
+  if (size == 0 ||
+      fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size) == 0)
+    return true;
+  static const char zeros[kOffloadBundleAlignment] = {};
+  for (uint64_t done = 0; done < size;) {
+    uint64_t chunk = std::min<uint64_t>(sizeof(zeros), size - done);
+    if (!writeAt(fd, zeros, chunk, offset + done))
+      return false;
+    done += chunk;
+  }
+  return true;
+}
+
+// A code object to write over entry entryIndex of a bundle.
+struct OffloadBundlePatch {
+  size_t entryIndex;
+  FileRange contents;
+};
+
+// Writes a copy of bundle with the patched entries replaced in place. Every patch has to fit
+// OffloadBundle::getSlotSize of its entry. Only the new code objects, the bytes left over from the
+// old ones (zeroed) and the size fields are written after the copy, which is a reflink where the
+// filesystem supports it. The bundle ends after its last code object, as a rebuilt one would.
+// fd has to be an empty file open for reading and writing.
+inline bool patchOffloadBundle(int fd, const OffloadBundleFile &bundle,
+                               const std::vector<OffloadBundlePatch> &patches) {
+  bool ok = cloneFile(fd, bundle.getFileRange());
+  for (size_t i = 0; ok && i < patches.size(); ++i) {
+    const OffloadBundleEntry &entry = bundle.getEntries()[patches[i].entryIndex];
+    uint64_t oldSize = entry.contents.size;
+    uint64_t newSize = patches[i].contents.size;
+    const OffloadBundle &source = bundle.getBundle();
+    ok = newSize <= source.getSlotSize(patches[i].entryIndex) &&
+         copyRange(patches[i].contents, fd, entry.offset);
+    if (ok && source.isLastCodeObject(patches[i].entryIndex))
+      ok = ftruncate(fd, entry.offset + newSize) == 0;
+    else if (ok && newSize < oldSize)
+      ok = zeroRange(fd, entry.offset + newSize, oldSize - newSize);
+    ok = ok && writeAt(fd, reinterpret_cast<const char *>(&newSize), sizeof(newSize),
+                       entry.headerOffset + sizeof(uint64_t));
+  }
+  return ok;
+}
+
+// Returns an error message, or an empty string on success.
+inline std::string patchOffloadBundle(const std::string &filePath, const OffloadBundleFile &bundle,
+                                      const std::vector<OffloadBundlePatch> &patches) {
+  int fd = ::open(filePath.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return "can't create " + filePath;
+  bool ok = patchOffloadBundle(fd, bundle, patches);
+  ok = close(fd) == 0 && ok;
+  return ok ? "" : "can't write " + filePath;
+}
+
+// Calls process(data, size) on consecutive pieces of range, read through a fixed size buffer.
+// Stops when process returns false. Returns false if that happened or range can't be read.
+template <typename Process> bool readRange(const FileRange &range, Process process) {
+  std::unique_ptr<char[]> buffer(new char[std::min<uint64_t>(kCopyBufferSize, range.size)]);
+  for (uint64_t done = 0; done < range.size;) {
+    size_t chunk = std::min<uint64_t>(kCopyBufferSize, range.size - done);
+    ssize_t numRead = pread(range.fd, buffer.get(), chunk, range.offset + done);
+    if (numRead < 0 && errno == EINTR)
+      continue;
+    if (numRead <= 0 || !process(buffer.get(), numRead))
+      return false;
+    done += numRead;
+  }
+  return true;
+}
+
+// Whether two ranges of the same size hold the same bytes.
+inline bool isSameContents(const FileRange &a, const FileRange &b) {
+  if (a.fd == b.fd && a.offset == b.offset)
+    return true;
+  std::unique_ptr<char[]> buffer(new char[std::min<uint64_t>(kCopyBufferSize, b.size)]);
+  uint64_t done = 0;
+  return readRange(a, [&](const char *data, size_t size) {
+    while (size) {
+      ssize_t numRead = pread(b.fd, buffer.get(), size, b.offset + done);
+      if (numRead < 0 && errno == EINTR)
+        continue;
+      if (numRead <= 0 || memcmp(data, buffer.get(), numRead) != 0)
+        return false;
+      data += numRead;
+      size -= numRead;
+      done += numRead;
+    }
+    return true;
+  });
+}
+
+// For every entry the index of the first entry with the same code object, or its own index.
+// Only entries of equal size are checksummed (zlib's crc32), and equal checksums are confirmed
+// byte by byte. Ranges at the same place in the same file, e.g. entries that already shared
+// their code object in the bundle being rewritten, are equal without reading them. Empty entries
+// are never merged, so they keep their usual offsets.
+inline std::vector<size_t>
+findDuplicateEntries(const std::vector<OffloadBundleWriterEntry> &entries) {
+  std::vector<size_t> copies(entries.size());
+  std::unordered_map<uint64_t, std::vector<size_t>> entriesBySize;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    copies[i] = i;
+    if (entries[i].contents.size)
+      entriesBySize[entries[i].contents.size].push_back(i);
+  }
+
+  std::vector<uLong> checksums(entries.size(), 0);
+  std::vector<bool> isChecksummed(entries.size(), false);
+  auto getChecksum = [&](size_t i) {
+    if (!isChecksummed[i]) {
+      uLong checksum = crc32(0, Z_NULL, 0);
+      readRange(entries[i].contents, [&checksum](const char *data, size_t size) {
+        checksum = crc32(checksum, reinterpret_cast<const Bytef *>(data), size);
+        return true;
+      });
+      checksums[i] = checksum;
+      isChecksummed[i] = true;
+    }
+    return checksums[i];
+  };
+
+  for (auto &sameSize : entriesBySize) {
+    const std::vector<size_t> &indices = sameSize.second;
+    for (size_t i = 1; i < indices.size(); ++i) {
+      const FileRange &contents = entries[indices[i]].contents;
+      for (size_t j = 0; j < i; ++j) {
+        const FileRange &other = entries[indices[j]].contents;
+        if (copies[indices[j]] != indices[j])
+          continue;
+        bool isSamePlace = contents.fd == other.fd && contents.offset == other.offset;
+        if (isSamePlace || (getChecksum(indices[i]) == getChecksum(indices[j]) &&
+                            isSameContents(contents, other))) {
+          copies[indices[i]] = indices[j];
+          break;
+        }
+      }
+    }
+  }
+  return copies;
+}
+
+// Writes a bundle with the entries in the given order to the empty file fd. Duplicate code
+// objects are stored once.
+inline bool writeOffloadBundle(int fd, const std::vector<OffloadBundleWriterEntry> &entries) {
+  std::vector<size_t> copies = findDuplicateEntries(entries);
+  std::vector<uint64_t> offsets = layoutOffloadBundle(entries, copies);
+
+  std::string header(offloadBundleMagic, sizeof(offloadBundleMagic));
+  auto append = [&header](uint64_t value) {
+    header.append(reinterpret_cast<const char *>(&value), sizeof(value));
+  };
+  append(entries.size());
+  for (size_t i = 0; i < entries.size(); ++i) {
+    append(offsets[i]);
+    append(entries[i].contents.size);
+    append(entries[i].id.size());
+    header += entries[i].id;
+  }
+
+  // Setting the size first leaves the padding between entries unwritten, i.e. as holes on
+  // filesystems that support them, and zeros on others.
+  bool ok = ftruncate(fd, offsets.back()) == 0 && writeAt(fd, header.data(), header.size(), 0);
+  for (size_t i = 0; ok && i < entries.size(); ++i) {
+    if (copies[i] == i)
+      ok = copyRange(entries[i].contents, fd, offsets[i]);
+  }
+  return ok;
+}
+
+// Returns an error message, or an empty string on success.
+inline std::string writeOffloadBundle(const std::string &filePath,
+                                      const std::vector<OffloadBundleWriterEntry> &entries) {
+  int fd = ::open(filePath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return "can't create " + filePath;
+  bool ok = writeOffloadBundle(fd, entries);
+  ok = close(fd) == 0 && ok;
+  return ok ? "" : "can't write " + filePath;
+}
+
+// The first 8 bytes of the MD5 digest of data (RFC 1321), as a little endian number. This is the
+// hash in compressed bundle headers.
+inline uint64_t getTruncatedMd5(ByteSpan data) {
+  static constexpr uint32_t k[64] = {
+      0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a,
+      0xa8304613, 0xfd469501, 0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+      0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821, 0xf61e2562, 0xc040b340,
+      0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+      0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8,
+      0x676f02d9, 0x8d2a4c8a, 0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+      0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70, 0x289b7ec6, 0xeaa127fa,
+      0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+      0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92,
+      0xffeff47d, 0x85845dd1, 0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+      0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+  };
+  static constexpr uint8_t shifts[16] = {7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21};
+  uint32_t h[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+
+  auto processBlock = [&](const unsigned char *block) {
+    uint32_t w[16];
+    for (int i = 0; i < 16; ++i)
+      w[i] = block[4 * i] | block[4 * i + 1] << 8 | block[4 * i + 2] << 16 |
+             uint32_t(block[4 * i + 3]) << 24;
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+    for (int i = 0; i < 64; ++i) {
+      uint32_t f;
+      int g;
+      if (i < 16) {
+        f = (b & c) | (~b & d);
+        g = i;
+      } else if (i < 32) {
+        f = (d & b) | (~d & c);
+        g = (5 * i + 1) % 16;
+      } else if (i < 48) {
+        f = b ^ c ^ d;
+        g = (3 * i + 5) % 16;
+      } else {
+        f = c ^ (b | ~d);
+        g = (7 * i) % 16;
+      }
+      uint32_t rotated = a + f + k[i] + w[g];
+      int shift = shifts[i / 16 * 4 + i % 4];
+      a = d;
+      d = c;
+      c = b;
+      b += (rotated << shift) | (rotated >> (32 - shift));
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+  };
+
+  const unsigned char *bytes = reinterpret_cast<const unsigned char *>(data.data);
+  uint64_t numBlocks = data.size / 64;
+  for (uint64_t i = 0; i < numBlocks; ++i)
+    processBlock(bytes + 64 * i);
+
+  // The rest, a one bit, zeros and the length in bits.
+  unsigned char tail[128] = {};
+  uint64_t rest = data.size % 64;
+  memcpy(tail, bytes + 64 * numBlocks, rest);
+  tail[rest] = 0x80;
+  uint64_t tailSize = rest < 56 ? 64 : 128;
+  for (int i = 0; i < 8; ++i)
+    tail[tailSize - 8 + i] = static_cast<unsigned char>((data.size * 8) >> (8 * i));
+  for (uint64_t i = 0; i < tailSize; i += 64)
+    processBlock(tail + i);
+  return h[0] | uint64_t(h[1]) << 32;
+}
+
+// Compression works on chunks this big, one per thread at a time.
+static constexpr uint64_t kCompressChunkSize = 4 << 20;
+
+// Deflates a chunk of bundle into raw deflate blocks that continue the stream of the chunks
+// before it: the 32 KiB before the chunk are its dictionary, and it ends on a byte boundary, or
+// with the final block for the last chunk.
+inline bool deflateChunk(ByteSpan bundle, uint64_t offset, uint64_t size, bool last,
+                         std::string &output) {
+  z_stream stream = {};
+  if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) !=
+      Z_OK)
+    return false;
+
+  const Bytef *input = reinterpret_cast<const Bytef *>(bundle.data);
+  uInt dictionarySize = std::min<uint64_t>(offset, 1 << 15);
+  bool ok = dictionarySize == 0 ||
+            deflateSetDictionary(&stream, input + offset - dictionarySize, dictionarySize) == Z_OK;
+
+  // The bound is for Z_FINISH, a sync flush adds at most an empty stored block.
+  output.resize(deflateBound(&stream, size) + 16);
+  stream.next_in = const_cast<Bytef *>(input + offset);
+  stream.avail_in = size;
+  stream.next_out = reinterpret_cast<Bytef *>(&output[0]);
+  stream.avail_out = output.size();
+  int result = ok ? deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH) : Z_STREAM_ERROR;
+  ok = last ? result == Z_STREAM_END : result == Z_OK && stream.avail_out > 0;
+  output.resize(stream.total_out);
+  deflateEnd(&stream);
+  return ok;
+}
+
+// Compresses a bundle into a version 2 CCOB container, or version 3 if it is too big for 32-bit
+// sizes. numThreads chunks are deflated at a time, and written out in order before the next ones
+// start, so memory use doesn't grow with the size of the bundle. Returns an error message, or an
+// empty string on success.
+inline std::string compressOffloadBundle(ByteSpan bundle, const std::string &filePath,
+                                         unsigned numThreads) {
+  int fd = ::open(filePath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return "can't create " + filePath;
+
+  uint64_t hash = 0;
+  std::thread hasher([&]() { hash = getTruncatedMd5(bundle); });
+
+  uint16_t version = bundle.size > UINT32_MAX ? 3 : 2;
+  uint64_t headerSize = version == 3 ? 32 : 24;
+  // A zlib header for the default compression level, no dictionary.
+  static const char zlibHeader[2] = {0x78, static_cast<char>(0x9c)};
+  bool ok = writeAt(fd, zlibHeader, sizeof(zlibHeader), headerSize);
+  uint64_t end = headerSize + sizeof(zlibHeader);
+
+  uint64_t numChunks = (bundle.size + kCompressChunkSize - 1) / kCompressChunkSize;
+  numThreads = std::max<uint64_t>(1, std::min<uint64_t>(numThreads, numChunks));
+  std::vector<std::string> outputs(numThreads);
+  std::vector<uLong> checksums(numThreads);
+  std::vector<char> chunkOk(numThreads);
+  uLong checksum = adler32(0, Z_NULL, 0);
+  for (uint64_t first = 0; ok && first < numChunks; first += numThreads) {
+    uint64_t count = std::min<uint64_t>(numThreads, numChunks - first);
+    auto compress = [&](uint64_t i) {
+      uint64_t offset = (first + i) * kCompressChunkSize;
+      uint64_t size = std::min(kCompressChunkSize, bundle.size - offset);
+      chunkOk[i] = deflateChunk(bundle, offset, size, first + i == numChunks - 1, outputs[i]);
+      checksums[i] =
+          adler32(adler32(0, Z_NULL, 0), reinterpret_cast<const Bytef *>(bundle.data + offset),
+                  size);
+    };
+    std::vector<std::thread> threads;
+    for (uint64_t i = 1; i < count; ++i)
+      threads.emplace_back(compress, i);
+    compress(0);
+    for (std::thread &thread : threads)
+      thread.join();
+
+    for (uint64_t i = 0; ok && i < count; ++i) {
+      uint64_t size = std::min(kCompressChunkSize, bundle.size - (first + i) * kCompressChunkSize);
+      ok = chunkOk[i] && writeAt(fd, outputs[i].data(), outputs[i].size(), end);
+      end += outputs[i].size();
+      checksum = adler32_combine(checksum, checksums[i], size);
+    }
+  }
+  hasher.join();
+
+  const char trailer[4] = {static_cast<char>(checksum >> 24), static_cast<char>(checksum >> 16),
+                           static_cast<char>(checksum >> 8), static_cast<char>(checksum)};
+  ok = ok && writeAt(fd, trailer, sizeof(trailer), end);
+  end += sizeof(trailer);
+
+  std::string header(compressedBundleMagic, sizeof(compressedBundleMagic));
+  auto append = [&header](auto value) {
+    header.append(reinterpret_cast<const char *>(&value), sizeof(value));
+  };
+  append(version);
+  append(static_cast<uint16_t>(CompressionMethod::Zlib));
+  if (version == 3) {
+    append(end);
+    append(bundle.size);
+  } else {
+    append(static_cast<uint32_t>(end));
+    append(static_cast<uint32_t>(bundle.size));
+  }
+  append(hash);
+  ok = ok && (version == 3 || end <= UINT32_MAX) && writeAt(fd, header.data(), header.size(), 0);
+
+  ok = close(fd) == 0 && ok;
+  return ok ? "" : "can't write " + filePath;
+}
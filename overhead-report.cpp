@@ -0,0 +1,262 @@
+#include "histogram-records.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// This tool reports how much instrumentation slowed down each kernel. It compares the GPU time
+// histograms of a baseline run (a census of the original binary) with those of an instrumented
+// run, both written by the preload library with DYNINST_AMDGPU_HISTOGRAMS set, joined by kernel
+// name and launch shape.
+//
+// usage:
+// overhead-report [--top <n>] <baseline-histograms> <instrumented-histograms>
+//
+// Either side can be several files (e.g. one per rank) given as @<file-with-paths>; their
+// histograms are added up first. Histograms are stored densely, so adding them up and computing
+// percentiles are plain loops over fixed size arrays, which the compiler vectorizes.
+
+static void showHelp(const char *toolName) {
+  std::cerr << "usage : \n";
+  std::cerr << "  ";
+  std::cerr << toolName << " [--top <n>] <baseline-histograms> <instrumented-histograms>\n\n";
+  std::cerr << toolName << " reports the GPU time added by instrumentation per kernel and shape\n";
+  std::cerr << "  @<file> reads histogram file paths from <file>, one per line\n";
+  std::cerr << "  --top <n> lists the <n> keys with the most added time (default 20, 0 for all)\n";
+}
+
+static constexpr unsigned kNumBuckets = LatencyHistogram::kNumBuckets;
+
+// The histograms of one run, one per (kernel, shape), sorted by key.
+struct Run {
+  std::vector<std::unique_ptr<HistogramFile>> files;
+  std::deque<HistogramFileRecord> combined; // keys that occur in several files
+  std::vector<const HistogramFileRecord *> records;
+  std::unordered_map<uint64_t, std::string> kernelNames;
+  uint64_t launches = 0;
+};
+
+static void readRun(const std::string &arg, Run &run) {
+  std::vector<std::string> paths;
+  if (arg.empty() || arg[0] != '@') {
+    paths.push_back(arg);
+  } else {
+    std::ifstream listFile(arg.substr(1));
+    if (!listFile) {
+      std::cerr << "error : can't open " << arg.substr(1) << std::endl;
+      exit(1);
+    }
+    std::string line;
+    while (std::getline(listFile, line)) {
+      if (!line.empty())
+        paths.push_back(line);
+    }
+  }
+
+  std::vector<const HistogramFileRecord *> all;
+  for (auto &path : paths) {
+    auto file = std::make_unique<HistogramFile>();
+    std::string error = file->open(path);
+    if (!error.empty()) {
+      std::cerr << "error : " << error << std::endl;
+      exit(1);
+    }
+    if (!file->readNames(run.kernelNames)) {
+      std::cerr << "error : " << path << " has a truncated name table" << std::endl;
+      exit(1);
+    }
+    for (const HistogramFileRecord &record : *file)
+      all.push_back(&record);
+    run.files.push_back(std::move(file));
+  }
+
+  // A single file is already sorted, so this only does work when combining files.
+  if (run.files.size() > 1) {
+    std::stable_sort(all.begin(), all.end(),
+                     [](const HistogramFileRecord *a, const HistogramFileRecord *b) {
+                       return *a < *b;
+                     });
+  }
+
+  for (size_t i = 0; i < all.size();) {
+    size_t end = i + 1;
+    while (end < all.size() && all[end]->sameKey(*all[i]))
+      ++end;
+
+    if (end == i + 1) {
+      run.records.push_back(all[i]);
+    } else {
+      HistogramFileRecord &sum = run.combined.emplace_back(*all[i]);
+      for (size_t j = i + 1; j < end; ++j)
+        sum.add(*all[j]);
+      run.records.push_back(&sum);
+    }
+    run.launches += run.records.back()->launches;
+    i = end;
+  }
+}
+
+// Approximate values (bucket midpoints) of the given percentiles of a histogram.
+template <size_t N>
+static void getPercentiles(const HistogramFileRecord &record, const double (&percentiles)[N],
+                           double (&values)[N]) {
+  uint64_t cumulative[kNumBuckets];
+  uint64_t total = 0;
+  for (unsigned i = 0; i < kNumBuckets; ++i) {
+    total += record.counts[i];
+    cumulative[i] = total;
+  }
+
+  for (size_t p = 0; p < N; ++p) {
+    uint64_t target = std::max<uint64_t>(1, static_cast<uint64_t>(percentiles[p] / 100.0 * total));
+    // The bucket holding the target is the number of buckets whose cumulative count is below it.
+    // Counting instead of searching keeps the loop free of branches.
+    unsigned index = 0;
+    for (unsigned i = 0; i < kNumBuckets; ++i)
+      index += cumulative[i] < target;
+    index = std::min(index, kNumBuckets - 1);
+    values[p] = LatencyHistogram::getBucketLowerBound(index) +
+                LatencyHistogram::getBucketWidth(index) / 2.0;
+  }
+}
+
+struct KeyReport {
+  const HistogramFileRecord *baseline;
+  const HistogramFileRecord *instrumented;
+  double meanSlowdown;
+  double percentileSlowdown[3]; // p50, p90, p99
+  double addedNs;               // instrumented time minus baseline mean times instrumented launches
+};
+
+static const double reportPercentiles[3] = {50, 90, 99};
+
+static KeyReport compare(const HistogramFileRecord &baseline,
+                         const HistogramFileRecord &instrumented) {
+  KeyReport report = {&baseline, &instrumented, 0, {0, 0, 0}, 0};
+
+  double baselineMean = baseline.launches ? double(baseline.totalNs) / baseline.launches : 0;
+  double instrumentedMean =
+      instrumented.launches ? double(instrumented.totalNs) / instrumented.launches : 0;
+  report.meanSlowdown = baselineMean > 0 ? instrumentedMean / baselineMean : 0;
+  report.addedNs = instrumented.totalNs - baselineMean * instrumented.launches;
+
+  double baselineValues[3], instrumentedValues[3];
+  getPercentiles(baseline, reportPercentiles, baselineValues);
+  getPercentiles(instrumented, reportPercentiles, instrumentedValues);
+  for (int p = 0; p < 3; ++p)
+    report.percentileSlowdown[p] = instrumentedValues[p] / baselineValues[p];
+  return report;
+}
+
+// The value below which the given percentile of the total weight lies.
+static double getWeightedPercentile(std::vector<std::pair<double, double>> valueWeights,
+                                    double percentile) {
+  if (valueWeights.empty())
+    return 0;
+  std::sort(valueWeights.begin(), valueWeights.end());
+  double total = 0;
+  for (auto &valueWeight : valueWeights)
+    total += valueWeight.second;
+
+  double seen = 0;
+  for (auto &valueWeight : valueWeights) {
+    seen += valueWeight.second;
+    if (seen >= percentile / 100.0 * total)
+      return valueWeight.first;
+  }
+  return valueWeights.back().first;
+}
+
+int main(int argc, char **argv) {
+  size_t top = 20;
+  std::vector<std::string> runArgs;
+
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg == "--top" && i + 1 < argc) {
+      top = std::stoul(argv[++i]);
+    } else if (arg[0] == '-') {
+      showHelp(argv[0]);
+      exit(1);
+    } else {
+      runArgs.push_back(arg);
+    }
+  }
+
+  if (runArgs.size() != 2) {
+    showHelp(argv[0]);
+    exit(1);
+  }
+
+  Run baseline, instrumented;
+  readRun(runArgs[0], baseline);
+  readRun(runArgs[1], instrumented);
+
+  // Both runs are sorted by key, so the join is a single merge pass.
+  std::vector<KeyReport> reports;
+  size_t onlyBaseline = 0, onlyInstrumented = 0;
+  size_t b = 0, i = 0;
+  while (b < baseline.records.size() || i < instrumented.records.size()) {
+    if (i == instrumented.records.size() ||
+        (b < baseline.records.size() && *baseline.records[b] < *instrumented.records[i])) {
+      ++onlyBaseline;
+      ++b;
+    } else if (b == baseline.records.size() || *instrumented.records[i] < *baseline.records[b]) {
+      ++onlyInstrumented;
+      ++i;
+    } else {
+      if (baseline.records[b]->launches && instrumented.records[i]->launches)
+        reports.push_back(compare(*baseline.records[b], *instrumented.records[i]));
+      ++b;
+      ++i;
+    }
+  }
+
+  double totalAddedNs = 0, totalBaselineNs = 0;
+  std::vector<std::pair<double, double>> slowdownWeights;
+  for (const KeyReport &report : reports) {
+    totalAddedNs += report.addedNs;
+    double baselineNs = report.instrumented->totalNs - report.addedNs;
+    totalBaselineNs += baselineNs;
+    slowdownWeights.emplace_back(report.meanSlowdown, baselineNs);
+  }
+
+  printf("baseline : %zu keys, %llu launches\n", baseline.records.size(),
+         static_cast<unsigned long long>(baseline.launches));
+  printf("instrumented : %zu keys, %llu launches\n", instrumented.records.size(),
+         static_cast<unsigned long long>(instrumented.launches));
+  printf("matched : %zu keys (%zu only in baseline, %zu only in instrumented)\n", reports.size(),
+         onlyBaseline, onlyInstrumented);
+  printf("added GPU time : %.3f ms over %.3f ms (%+.1f%%)\n", totalAddedNs / 1e6,
+         totalBaselineNs / 1e6, totalBaselineNs ? 100.0 * totalAddedNs / totalBaselineNs : 0.0);
+  printf("mean slowdown of matched keys, weighted by baseline GPU time : p50 %.2fx p90 %.2fx "
+         "p99 %.2fx max %.2fx\n\n",
+         getWeightedPercentile(slowdownWeights, 50), getWeightedPercentile(slowdownWeights, 90),
+         getWeightedPercentile(slowdownWeights, 99), getWeightedPercentile(slowdownWeights, 100));
+
+  std::sort(reports.begin(), reports.end(), [](const KeyReport &a, const KeyReport &b) {
+    return a.addedNs > b.addedNs;
+  });
+  if (top && reports.size() > top)
+    reports.resize(top);
+
+  printf("%12s %8s %8s %8s %8s %10s %10s  %s\n", "added ms", "mean", "p50", "p90", "p99",
+         "launches", "baseline", "kernel");
+  for (const KeyReport &report : reports) {
+    auto name = instrumented.kernelNames.find(report.instrumented->kernelHash);
+    printf("%12.3f %7.2fx %7.2fx %7.2fx %7.2fx %10llu %10llu  %s%s\n", report.addedNs / 1e6,
+           report.meanSlowdown, report.percentileSlowdown[0], report.percentileSlowdown[1],
+           report.percentileSlowdown[2],
+           static_cast<unsigned long long>(report.instrumented->launches),
+           static_cast<unsigned long long>(report.baseline->launches),
+           name != instrumented.kernelNames.end() ? name->second.c_str() : "<unknown>",
+           report.instrumented->shape.format().c_str());
+  }
+  return 0;
+}
@@ -0,0 +1,283 @@
+#pragma once
+
+// Aggregation of launches in the preload library.
+//
+// Launches are aggregated per kernel, or per (kernel, grid, block, shared memory size) if
+// DYNINST_AMDGPU_AGGREGATE_BY=shape. Both can be further split by host call site (see
+// preload-callsite.h). Either way the values live in a LaunchStatsTable: an open
+// addressing hash table that is allocated once, sized from the number of instrumented kernels,
+// and never grows or rehashes. Lookups and inserts don't take locks, so launches from different
+// threads never wait for each other.
+
+#include "counter-records.h"
+#include "histogram-records.h"
+#include "latency-histogram.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Environment variable selecting the aggregation key, "kernel" (default) or "shape":
+const char *aggregateByEnv = "DYNINST_AMDGPU_AGGREGATE_BY";
+
+// Environment variable for the GPU time histogram output template (e.g. hist.%r.bin), see
+// histogram-records.h. Implies DYNINST_AMDGPU_AGGREGATE_BY=shape:
+const char *histogramOutputEnv = "DYNINST_AMDGPU_HISTOGRAMS";
+
+// Environment variable for the number of distinct launch shapes expected per kernel (default 16):
+const char *shapesPerKernelEnv = "DYNINST_AMDGPU_SHAPES_PER_KERNEL";
+
+// Environment variable for the number of distinct call sites expected per kernel (default 8):
+const char *callSitesPerKernelEnv = "DYNINST_AMDGPU_CALLSITES_PER_KERNEL";
+
+struct LaunchKey {
+  uint32_t kernelId;
+  uint32_t callSite; // 0 unless call sites are captured
+  LaunchShape shape;
+
+  bool operator==(const LaunchKey &other) const {
+    return kernelId == other.kernelId && callSite == other.callSite && shape == other.shape;
+  }
+
+  uint64_t hash() const {
+    uint64_t h = hashKernelName(reinterpret_cast<const char *>(&shape), sizeof(shape));
+    return h ^ (kernelId * 0x9e3779b97f4a7c15ull) ^ (uint64_t(callSite) << 32);
+  }
+};
+
+// A consistent copy of the values of a LaunchStats.
+struct LaunchStatsSnapshot {
+  LaunchKey key;
+  uint64_t launches;
+  uint64_t totalNs;
+  uint64_t minNs;
+  uint64_t maxNs;
+  std::vector<uint64_t> sums;
+  std::vector<uint64_t> gpuTimeCounts; // buckets of gpuTimeHistogram, if asked for
+};
+
+struct LaunchStats {
+  enum State : uint32_t { Empty, Initializing, Ready };
+
+  std::atomic<uint32_t> state{Empty};
+  LaunchKey key;
+
+  // Seqlock of the values below. Several launches can update an entry at the same time, so
+  // instead of an odd/even sequence number there is one count of started and one of finished
+  // updates; nothing was in progress while a reader copied the values if the started count it
+  // reads afterwards equals the finished count it read before. Writers never wait for readers.
+  std::atomic<uint64_t> updatesStarted{0};
+  std::atomic<uint64_t> updatesFinished{0};
+
+  std::atomic<uint64_t> launches{0};
+  std::atomic<uint64_t> totalNs{0};
+  std::atomic<uint64_t> minNs{UINT64_MAX};
+  std::atomic<uint64_t> maxNs{0};
+
+  // Points into the table's value array, one sum per instrumentation variable.
+  std::atomic<uint64_t> *sums = nullptr;
+
+  // Allocated when the key is inserted.
+  std::unique_ptr<LatencyHistogram> gpuTimeHistogram;
+  std::unique_ptr<LatencyHistogram> overheadHistogram;
+
+  // ns is the GPU time of the launch.
+  void addLaunch(uint64_t ns) {
+    gpuTimeHistogram->record(ns);
+    launches.fetch_add(1, std::memory_order_relaxed);
+    totalNs.fetch_add(ns, std::memory_order_relaxed);
+
+    uint64_t current = minNs.load(std::memory_order_relaxed);
+    while (ns < current && !minNs.compare_exchange_weak(current, ns, std::memory_order_relaxed))
+      ;
+    current = maxNs.load(std::memory_order_relaxed);
+    while (ns > current && !maxNs.compare_exchange_weak(current, ns, std::memory_order_relaxed))
+      ;
+  }
+
+  // overheadNs is the time spent in the interposer that the application wouldn't otherwise spend.
+  void addOverhead(uint64_t overheadNs) { overheadHistogram->record(overheadNs); }
+
+  // Brackets an addLaunch and the updates of sums that belong to it.
+  void beginUpdate() {
+    updatesStarted.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+  void endUpdate() { updatesFinished.fetch_add(1, std::memory_order_release); }
+
+  // Copies the values into snapshot, and the GPU time histogram too if withHistogram is set.
+  // Returns false if an update was in progress on every attempt, in which case the copy may mix
+  // values from before and after that update.
+  bool snapshot(size_t numVars, LaunchStatsSnapshot &snapshot, bool withHistogram = false) const {
+    snapshot.key = key;
+    snapshot.sums.resize(numVars);
+    snapshot.gpuTimeCounts.resize(withHistogram ? LatencyHistogram::kNumBuckets : 0);
+    for (int attempt = 0; attempt < 8; ++attempt) {
+      uint64_t finished = updatesFinished.load(std::memory_order_acquire);
+      snapshot.launches = launches.load(std::memory_order_relaxed);
+      snapshot.totalNs = totalNs.load(std::memory_order_relaxed);
+      snapshot.minNs = minNs.load(std::memory_order_relaxed);
+      snapshot.maxNs = maxNs.load(std::memory_order_relaxed);
+      for (size_t v = 0; v < numVars; ++v)
+        snapshot.sums[v] = sums[v].load(std::memory_order_relaxed);
+      if (withHistogram)
+        gpuTimeHistogram->copyCounts(snapshot.gpuTimeCounts.data());
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (updatesStarted.load(std::memory_order_relaxed) == finished)
+        return true;
+    }
+    return false;
+  }
+};
+
+class LaunchStatsTable {
+public:
+  // Allocates room for at least expectedKeys keys at a load factor of 1/2.
+  void init(size_t expectedKeys, size_t numVars_) {
+    numVars = numVars_;
+    capacity = 16;
+    while (capacity < 2 * expectedKeys)
+      capacity <<= 1;
+
+    slots = std::make_unique<LaunchStats[]>(capacity);
+    values = std::make_unique<std::atomic<uint64_t>[]>(capacity * numVars);
+    for (size_t i = 0; i < capacity; ++i) {
+      slots[i].sums = &values[i * numVars];
+      for (size_t v = 0; v < numVars; ++v)
+        slots[i].sums[v].store(0, std::memory_order_relaxed);
+    }
+  }
+
+  // Returns nullptr if the table is full.
+  LaunchStats *findOrInsert(const LaunchKey &key) {
+    size_t mask = capacity - 1;
+    uint64_t hash = key.hash();
+    for (size_t probe = 0; probe < capacity; ++probe) {
+      LaunchStats &slot = slots[(hash + probe) & mask];
+
+      uint32_t state = slot.state.load(std::memory_order_acquire);
+      if (state == LaunchStats::Empty) {
+        if (slot.state.compare_exchange_strong(state, LaunchStats::Initializing,
+                                               std::memory_order_acquire)) {
+          slot.key = key;
+          slot.gpuTimeHistogram = std::make_unique<LatencyHistogram>();
+          slot.overheadHistogram = std::make_unique<LatencyHistogram>();
+          slot.state.store(LaunchStats::Ready, std::memory_order_release);
+          return &slot;
+        }
+      }
+
+      // Another thread is inserting into this slot, it won't take long.
+      while (state == LaunchStats::Initializing)
+        state = slot.state.load(std::memory_order_acquire);
+
+      if (slot.key == key)
+        return &slot;
+    }
+
+    overflow.fetch_add(1, std::memory_order_relaxed);
+    return nullptr;
+  }
+
+  // Calls f(const LaunchStats &) for every key seen so far.
+  template <typename F> void forEach(F f) const {
+    for (size_t i = 0; i < capacity; ++i) {
+      if (slots[i].state.load(std::memory_order_acquire) == LaunchStats::Ready)
+        f(slots[i]);
+    }
+  }
+
+  // Zeroes all values. Keys stay in the table.
+  void reset() {
+    for (size_t i = 0; i < capacity; ++i) {
+      LaunchStats &slot = slots[i];
+      slot.beginUpdate();
+      slot.launches.store(0, std::memory_order_relaxed);
+      slot.totalNs.store(0, std::memory_order_relaxed);
+      slot.minNs.store(UINT64_MAX, std::memory_order_relaxed);
+      slot.maxNs.store(0, std::memory_order_relaxed);
+      for (size_t v = 0; v < numVars; ++v)
+        slot.sums[v].store(0, std::memory_order_relaxed);
+      slot.endUpdate();
+      if (slot.state.load(std::memory_order_acquire) == LaunchStats::Ready) {
+        slot.gpuTimeHistogram->reset();
+        slot.overheadHistogram->reset();
+      }
+    }
+    overflow.store(0, std::memory_order_relaxed);
+  }
+
+  size_t getNumVars() const { return numVars; }
+  size_t getCapacity() const { return capacity; }
+  uint64_t getOverflow() const { return overflow.load(std::memory_order_relaxed); }
+
+private:
+  std::unique_ptr<LaunchStats[]> slots;
+  std::unique_ptr<std::atomic<uint64_t>[]> values;
+  size_t capacity = 0;
+  size_t numVars = 0;
+
+  // Launches that found the table full and weren't aggregated.
+  std::atomic<uint64_t> overflow{0};
+};
+
+inline bool aggregateByShape() {
+  const char *keyKind = getenv(aggregateByEnv);
+  return (keyKind && std::string(keyKind) == "shape") || getenv(histogramOutputEnv);
+}
+
+static size_t getPerKernelEstimate(const char *env, size_t defaultValue) {
+  const char *value = getenv(env);
+  return value ? std::max(1, atoi(value)) : defaultValue;
+}
+
+// Number of keys to size the table for, given the number of instrumented kernels.
+inline size_t getExpectedLaunchKeys(size_t numKernels, bool byShape, bool byCallSite) {
+  size_t keys = numKernels;
+  if (byShape)
+    keys *= getPerKernelEstimate(shapesPerKernelEnv, 16);
+  if (byCallSite)
+    keys *= getPerKernelEstimate(callSitesPerKernelEnv, 8);
+  return keys;
+}
+
+// Builds the histogram file records of the GPU times in table, one per (kernel, shape). Call sites
+// are merged. getKernelName maps LaunchKey::kernelId to the kernel name, and the names of the
+// kernels in the records are added to kernelNames.
+template <typename GetKernelName>
+std::vector<HistogramFileRecord>
+makeHistogramRecords(const LaunchStatsTable &table, GetKernelName getKernelName,
+                     std::unordered_map<uint64_t, std::string> &kernelNames) {
+  std::vector<HistogramFileRecord> records;
+  table.forEach([&](const LaunchStats &stats) {
+    uint64_t launches = stats.launches.load(std::memory_order_relaxed);
+    if (launches == 0)
+      return;
+
+    const std::string &name = getKernelName(stats.key.kernelId);
+    HistogramFileRecord &record = records.emplace_back();
+    record.kernelHash = hashKernelName(name);
+    record.shape = stats.key.shape;
+    record.launches = launches;
+    record.totalNs = stats.totalNs.load(std::memory_order_relaxed);
+    for (unsigned i = 0; i < LatencyHistogram::kNumBuckets; ++i)
+      record.counts[i] = stats.gpuTimeHistogram->getCount(i);
+    kernelNames.emplace(record.kernelHash, name);
+  });
+
+  std::sort(records.begin(), records.end());
+  size_t numUnique = 0;
+  for (size_t i = 0; i < records.size(); ++i) {
+    if (numUnique && records[numUnique - 1].sameKey(records[i]))
+      records[numUnique - 1].add(records[i]);
+    else
+      records[numUnique++] = records[i];
+  }
+  records.resize(numUnique);
+  return records;
+}
@@ -0,0 +1,224 @@
+#pragma once
+
+// Host call-site attribution of kernel launches.
+//
+// If DYNINST_AMDGPU_CALLSITE_DEPTH=<n> is set, every collected launch captures up to n return
+// addresses of its host caller, and launches are aggregated per (kernel, call site). The stack is
+// walked along frame pointers, which costs a few loads per frame. Code built without frame
+// pointers stops the walk early; DYNINST_AMDGPU_CALLSITE_UNWIND=1 uses _Unwind_Backtrace instead,
+// which works without frame pointers but is slower.
+//
+// Distinct stacks are interned into a fixed size table and identified by their slot index.
+// Addresses are only symbolized when the results are printed.
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <memory>
+#include <pthread.h>
+#include <string>
+#include <unwind.h>
+
+// Environment variable for the number of return addresses to capture per launch (0 = off):
+const char *callSiteDepthEnv = "DYNINST_AMDGPU_CALLSITE_DEPTH";
+
+// Environment variable to walk the stack with _Unwind_Backtrace instead of frame pointers:
+const char *callSiteUnwindEnv = "DYNINST_AMDGPU_CALLSITE_UNWIND";
+
+struct CallStack {
+  static constexpr unsigned kMaxDepth = 16;
+
+  unsigned depth = 0;
+  uintptr_t addresses[kMaxDepth];
+
+  bool operator==(const CallStack &other) const {
+    return depth == other.depth &&
+           memcmp(addresses, other.addresses, depth * sizeof(uintptr_t)) == 0;
+  }
+
+  uint64_t hash() const {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (unsigned i = 0; i < depth; ++i)
+      hash = (hash ^ addresses[i]) * 0x100000001b3ull;
+    return hash;
+  }
+};
+
+// Stack bounds of the calling thread, used to stop frame pointer walks at bogus frames.
+struct StackBounds {
+  uintptr_t low = 0;
+  uintptr_t high = 0;
+
+  StackBounds() {
+    pthread_attr_t attr;
+    if (pthread_getattr_np(pthread_self(), &attr) != 0)
+      return;
+    void *stackAddr;
+    size_t stackSize;
+    if (pthread_attr_getstack(&attr, &stackAddr, &stackSize) == 0) {
+      low = reinterpret_cast<uintptr_t>(stackAddr);
+      high = low + stackSize;
+    }
+    pthread_attr_destroy(&attr);
+  }
+};
+
+// Captures the return addresses above the caller of this function, i.e. skipping the frame of
+// the interposed function itself.
+__attribute__((noinline)) inline void captureFramePointerStack(CallStack &stack, unsigned depth) {
+  thread_local StackBounds bounds;
+
+  stack.depth = 0;
+  auto *frame = static_cast<uintptr_t *>(__builtin_frame_address(0));
+
+  // frame[0] is the caller's frame pointer, frame[1] the return address into the caller.
+  bool skippedInterposer = false;
+  while (stack.depth < depth) {
+    auto address = reinterpret_cast<uintptr_t>(frame);
+    if (address < bounds.low || address + 2 * sizeof(uintptr_t) > bounds.high ||
+        address % sizeof(uintptr_t) != 0)
+      break;
+
+    uintptr_t returnAddress = frame[1];
+    auto *next = reinterpret_cast<uintptr_t *>(frame[0]);
+    if (returnAddress == 0)
+      break;
+
+    if (skippedInterposer)
+      stack.addresses[stack.depth++] = returnAddress;
+    skippedInterposer = true;
+
+    // Frames must move towards the stack base.
+    if (next <= frame)
+      break;
+    frame = next;
+  }
+}
+
+struct UnwindState {
+  CallStack *stack;
+  unsigned depth;
+  unsigned skip;
+};
+
+static _Unwind_Reason_Code unwindCallback(_Unwind_Context *context, void *arg) {
+  auto *state = static_cast<UnwindState *>(arg);
+  if (state->skip) {
+    state->skip--;
+    return _URC_NO_REASON;
+  }
+  if (state->stack->depth == state->depth)
+    return _URC_END_OF_STACK;
+
+  uintptr_t ip = _Unwind_GetIP(context);
+  if (ip == 0)
+    return _URC_END_OF_STACK;
+  state->stack->addresses[state->stack->depth++] = ip;
+  return _URC_NO_REASON;
+}
+
+__attribute__((noinline)) inline void captureUnwindStack(CallStack &stack, unsigned depth) {
+  stack.depth = 0;
+  // Skip this function and the interposed function.
+  UnwindState state = {&stack, depth, 2};
+  _Unwind_Backtrace(unwindCallback, &state);
+}
+
+// Interned call stacks. Slot 0 is never used, so 0 means "no call site".
+class CallSiteTable {
+public:
+  void init(size_t capacity_) {
+    capacity = 16;
+    while (capacity < capacity_)
+      capacity <<= 1;
+    slots = std::make_unique<Slot[]>(capacity);
+  }
+
+  // Returns the id of stack, or 0 if the table is full.
+  uint32_t intern(const CallStack &stack) {
+    size_t mask = capacity - 1;
+    uint64_t hash = stack.hash();
+    for (size_t probe = 0; probe < capacity; ++probe) {
+      size_t index = (hash + probe) & mask;
+      if (index == 0)
+        continue;
+      Slot &slot = slots[index];
+
+      uint32_t state = slot.state.load(std::memory_order_acquire);
+      if (state == Empty &&
+          slot.state.compare_exchange_strong(state, Initializing, std::memory_order_acquire)) {
+        slot.stack = stack;
+        slot.state.store(Ready, std::memory_order_release);
+        return index;
+      }
+
+      while (state == Initializing)
+        state = slot.state.load(std::memory_order_acquire);
+
+      if (slot.stack == stack)
+        return index;
+    }
+    return 0;
+  }
+
+  // Symbolizes a call site as "function+0xoffset (module) <- ...", innermost frame first.
+  std::string format(uint32_t id) const {
+    if (id == 0 || slots[id].state.load(std::memory_order_acquire) != Ready)
+      return "unknown";
+
+    const CallStack &stack = slots[id].stack;
+    std::string text;
+    for (unsigned i = 0; i < stack.depth; ++i) {
+      if (i)
+        text += " <- ";
+      text += symbolize(stack.addresses[i]);
+    }
+    return text;
+  }
+
+private:
+  enum State : uint32_t { Empty, Initializing, Ready };
+
+  struct Slot {
+    std::atomic<uint32_t> state{Empty};
+    CallStack stack;
+  };
+
+  static std::string symbolize(uintptr_t address) {
+    char buffer[32];
+    Dl_info info;
+    // Return addresses point after the call, look up the call instruction itself.
+    if (!dladdr(reinterpret_cast<void *>(address - 1), &info)) {
+      snprintf(buffer, sizeof(buffer), "0x%lx", static_cast<unsigned long>(address));
+      return buffer;
+    }
+
+    std::string text;
+    if (info.dli_sname) {
+      int status;
+      char *demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+      text = status == 0 ? demangled : info.dli_sname;
+      free(demangled);
+      snprintf(buffer, sizeof(buffer), "+0x%lx",
+               static_cast<unsigned long>(address - reinterpret_cast<uintptr_t>(info.dli_saddr)));
+    } else {
+      snprintf(buffer, sizeof(buffer), "0x%lx",
+               static_cast<unsigned long>(address - reinterpret_cast<uintptr_t>(info.dli_fbase)));
+    }
+    text += buffer;
+
+    if (info.dli_fname) {
+      const char *slash = strrchr(info.dli_fname, '/');
+      text += " (";
+      text += slash ? slash + 1 : info.dli_fname;
+      text += ")";
+    }
+    return text;
+  }
+
+  std::unique_ptr<Slot[]> slots;
+  size_t capacity = 0;
+};
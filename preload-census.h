@@ -0,0 +1,282 @@
+#pragma once
+
+// Launch census of the preload library.
+//
+// If DYNINST_AMDGPU_CENSUS is set (an output path template, see preload-output.h), the preload
+// library doesn't need instrumented code or any of the instrumentation files. Instead it counts
+// the launches of every registered kernel and measures their GPU time, and writes a profile ranked
+// by GPU time at exit. select-kernels turns the profile into a list of kernels to instrument.
+//
+// Launches are never synchronized. Every launch is bracketed by two events, and the elapsed times
+// of completed launches are collected at later launches of the same thread. With
+// DYNINST_AMDGPU_CENSUS_TIME_EVERY=<n>, only every n-th launch of a kernel is timed and its GPU
+// time is extrapolated from those.
+//
+// If DYNINST_AMDGPU_HISTOGRAMS is set as well, the timed launches are also recorded in GPU time
+// histograms per (kernel, launch shape), which overhead-report compares with those of an
+// instrumented run.
+
+#include "hip/hip_runtime.h"
+#include "preload-aggregate.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Environment variable for the census profile output template (e.g. census.%r.txt):
+const char *censusEnv = "DYNINST_AMDGPU_CENSUS";
+
+// Environment variable to time only every n-th launch of each kernel in census mode (default 1):
+const char *censusTimeEveryEnv = "DYNINST_AMDGPU_CENSUS_TIME_EVERY";
+
+// Environment variable for the number of (kernel, shape) histograms to make room for (default 4096):
+const char *censusShapesEnv = "DYNINST_AMDGPU_CENSUS_SHAPES";
+
+struct CensusEntry {
+  uint32_t id; // index into Census::entries
+  std::string kernelName;
+  std::atomic<uint64_t> launches{0};
+  std::atomic<uint64_t> timedLaunches{0};
+  std::atomic<uint64_t> gpuNs{0};
+
+  // GPU time of all launches, extrapolated from the timed ones.
+  uint64_t getEstimatedGpuNs() const {
+    uint64_t timed = timedLaunches.load(std::memory_order_relaxed);
+    if (timed == 0)
+      return 0;
+    return static_cast<uint64_t>(static_cast<double>(gpuNs.load(std::memory_order_relaxed)) *
+                                 launches.load(std::memory_order_relaxed) / timed);
+  }
+};
+
+class Census {
+public:
+  // shapeHistograms is the number of (kernel, shape) histograms to make room for, 0 to not record
+  // histograms.
+  void init(unsigned timeEvery_, size_t shapeHistograms) {
+    timeEvery = std::max(1u, timeEvery_);
+    if (shapeHistograms)
+      shapes.init(shapeHistograms, 0);
+    recordShapes = shapeHistograms != 0;
+    enabled = true;
+  }
+
+  bool isEnabled() const { return enabled; }
+
+  // Called for every registered kernel, whether or not the census is enabled. Kernels registered
+  // by several modules share one entry.
+  void registerKernel(const void *hostFunction, const std::string &kernelName) {
+    std::unique_lock<std::shared_mutex> lock(entriesMutex);
+    auto it = entriesByName.find(kernelName);
+    if (it == entriesByName.end()) {
+      entries.emplace_back();
+      entries.back().id = entries.size() - 1;
+      entries.back().kernelName = kernelName;
+      it = entriesByName.emplace(kernelName, &entries.back()).first;
+    }
+    entriesByFunction[hostFunction] = it->second;
+  }
+
+  CensusEntry *getEntry(const void *hostFunction) {
+    std::shared_lock<std::shared_mutex> lock(entriesMutex);
+    auto it = entriesByFunction.find(hostFunction);
+    return it == entriesByFunction.end() ? nullptr : it->second;
+  }
+
+  // Counts a launch of entry with shape on stream, made by calling launch().
+  template <typename Launch>
+  void launch(CensusEntry &entry, const LaunchShape &shape, hipStream_t stream, Launch launch) {
+    uint64_t launchIndex = entry.launches.fetch_add(1, std::memory_order_relaxed);
+    PendingLaunches &pending = getPendingLaunches();
+    std::lock_guard<std::mutex> lock(pending.mutex);
+    collect(pending, false);
+
+    if (launchIndex % timeEvery != 0) {
+      launch();
+      return;
+    }
+
+    PendingLaunch timed = pending.makeLaunch(entry);
+    timed.shape = shape;
+    hipEventRecord(timed.start, stream);
+    launch();
+    hipEventRecord(timed.stop, stream);
+    pending.launches.push_back(timed);
+
+    // Bounds the number of events in flight if launches are never collected.
+    if (pending.launches.size() > kMaxPendingLaunches)
+      collectFront(pending, true);
+  }
+
+  // Waits for all timed launches and adds their GPU times.
+  void collectAll() {
+    std::lock_guard<std::mutex> lock(pendingListMutex);
+    for (PendingLaunches *pending : pendingList) {
+      std::lock_guard<std::mutex> pendingLock(pending->mutex);
+      collect(*pending, true);
+    }
+  }
+
+  // Writes the kernels that were launched, by decreasing GPU time, as
+  //   <rank> <gpu ns> <percent> <cumulative percent> <launches> <timed launches> <kernel name>
+  bool writeProfile(const std::string &filePath) {
+    collectAll();
+
+    std::vector<const CensusEntry *> launched;
+    {
+      std::shared_lock<std::shared_mutex> lock(entriesMutex);
+      for (const CensusEntry &entry : entries) {
+        if (entry.launches.load(std::memory_order_relaxed) != 0)
+          launched.push_back(&entry);
+      }
+    }
+    std::stable_sort(launched.begin(), launched.end(),
+                     [](const CensusEntry *a, const CensusEntry *b) {
+                       return a->getEstimatedGpuNs() > b->getEstimatedGpuNs();
+                     });
+
+    uint64_t totalNs = 0, totalLaunches = 0;
+    for (const CensusEntry *entry : launched) {
+      totalNs += entry->getEstimatedGpuNs();
+      totalLaunches += entry->launches.load(std::memory_order_relaxed);
+    }
+
+    FILE *file = fopen(filePath.c_str(), "w");
+    if (!file)
+      return false;
+
+    fprintf(file, "# census : %zu kernels, %llu launches, %llu ns GPU time\n", launched.size(),
+            static_cast<unsigned long long>(totalLaunches),
+            static_cast<unsigned long long>(totalNs));
+    fprintf(file, "# rank gpu_ns percent cumulative_percent launches timed_launches kernel\n");
+    uint64_t cumulativeNs = 0;
+    for (size_t i = 0; i < launched.size(); ++i) {
+      const CensusEntry *entry = launched[i];
+      uint64_t ns = entry->getEstimatedGpuNs();
+      cumulativeNs += ns;
+      fprintf(file, "%zu %llu %.3f %.3f %llu %llu %s\n", i + 1,
+              static_cast<unsigned long long>(ns), totalNs ? 100.0 * ns / totalNs : 0.0,
+              totalNs ? 100.0 * cumulativeNs / totalNs : 0.0,
+              static_cast<unsigned long long>(entry->launches.load(std::memory_order_relaxed)),
+              static_cast<unsigned long long>(entry->timedLaunches.load(std::memory_order_relaxed)),
+              entry->kernelName.c_str());
+    }
+    return fclose(file) == 0;
+  }
+
+  // Writes the GPU time histograms of the timed launches, see histogram-records.h.
+  bool writeHistograms(const std::string &filePath, const HistogramFileHeader &header) {
+    collectAll();
+
+    std::unordered_map<uint64_t, std::string> kernelNames;
+    std::vector<HistogramFileRecord> records;
+    {
+      std::shared_lock<std::shared_mutex> lock(entriesMutex);
+      records = makeHistogramRecords(
+          shapes, [this](uint32_t id) -> const std::string & { return entries[id].kernelName; },
+          kernelNames);
+    }
+    return writeHistogramFile(filePath, header, records, kernelNames);
+  }
+
+private:
+  static constexpr size_t kMaxPendingLaunches = 4096;
+
+  struct PendingLaunch {
+    CensusEntry *entry;
+    LaunchShape shape;
+    hipEvent_t start;
+    hipEvent_t stop;
+  };
+
+  // Timed launches of one thread that haven't been collected yet. The mutex is only contended
+  // while collectAll runs.
+  struct PendingLaunches {
+    std::mutex mutex;
+    std::deque<PendingLaunch> launches;
+    std::vector<std::pair<hipEvent_t, hipEvent_t>> spareEvents;
+
+    PendingLaunch makeLaunch(CensusEntry &entry) {
+      PendingLaunch launch = {&entry, {}, nullptr, nullptr};
+      if (!spareEvents.empty()) {
+        launch.start = spareEvents.back().first;
+        launch.stop = spareEvents.back().second;
+        spareEvents.pop_back();
+      } else {
+        hipEventCreate(&launch.start);
+        hipEventCreate(&launch.stop);
+      }
+      return launch;
+    }
+  };
+
+  // Collects the oldest launch of pending. Returns false if wait is false and it hasn't completed.
+  bool collectFront(PendingLaunches &pending, bool wait) {
+    PendingLaunch &launch = pending.launches.front();
+    if (wait)
+      hipEventSynchronize(launch.stop);
+    else if (hipEventQuery(launch.stop) != hipSuccess)
+      return false;
+
+    float ms = 0;
+    if (hipEventElapsedTime(&ms, launch.start, launch.stop) == hipSuccess) {
+      uint64_t ns = static_cast<uint64_t>(ms * 1e6);
+      launch.entry->gpuNs.fetch_add(ns, std::memory_order_relaxed);
+      launch.entry->timedLaunches.fetch_add(1, std::memory_order_relaxed);
+
+      if (recordShapes) {
+        LaunchKey key = {};
+        key.kernelId = launch.entry->id;
+        key.shape = launch.shape;
+        if (LaunchStats *stats = shapes.findOrInsert(key))
+          stats->addLaunch(ns);
+      }
+    }
+    pending.spareEvents.emplace_back(launch.start, launch.stop);
+    pending.launches.pop_front();
+    return true;
+  }
+
+  // Launches complete in order on a stream, but not across streams, so collection without
+  // waiting stops at the first launch that hasn't completed.
+  void collect(PendingLaunches &pending, bool wait) {
+    while (!pending.launches.empty() && collectFront(pending, wait))
+      ;
+  }
+
+  // Never destroyed, since threads may exit with launches pending.
+  PendingLaunches &getPendingLaunches() {
+    thread_local PendingLaunches *instance = [this]() {
+      auto *pending = new PendingLaunches;
+      std::lock_guard<std::mutex> lock(pendingListMutex);
+      pendingList.push_back(pending);
+      return pending;
+    }();
+    return *instance;
+  }
+
+  bool enabled = false;
+  unsigned timeEvery = 1;
+
+  // GPU time histograms per (kernel, shape), keyed by CensusEntry::id.
+  bool recordShapes = false;
+  LaunchStatsTable shapes;
+
+  // Kernels are mostly registered before the first launch, but modules loaded later register
+  // theirs while other threads launch.
+  std::shared_mutex entriesMutex;
+  std::deque<CensusEntry> entries;
+  std::unordered_map<std::string, CensusEntry *> entriesByName;
+  std::unordered_map<const void *, CensusEntry *> entriesByFunction;
+
+  std::mutex pendingListMutex;
+  std::vector<PendingLaunches *> pendingList;
+};
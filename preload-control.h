@@ -0,0 +1,259 @@
+#pragma once
+
+// Runtime control of the preload library.
+//
+// If DYNINST_AMDGPU_CONTROL_SOCKET is set, the preload library listens on a
+// Unix-domain socket at that path. An operator can connect to it (e.g. with
+// `socat - UNIX-CONNECT:<path>`) and send one command per line:
+//
+//   enable <glob>                 collect for instrumented kernels matching <glob>
+//   disable <glob>                launch matching kernels without instrumentation
+//   mode <per-launch|aggregate>   print per launch, or accumulate until a flush
+//   flush                         print the aggregated values
+//   reset                         zero the aggregated values
+//   status                        print the current configuration
+//
+// Every command is answered with a single line starting with "ok" or "error".
+//
+// Commands never modify the configuration that launches are using. Instead a
+// new CollectionConfig is built and published with a single atomic store, so
+// the launch path only has to load one pointer.
+
+#include <atomic>
+#include <cerrno>
+#include <fnmatch.h>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Environment variable for the control socket path:
+const char *controlSocketEnv = "DYNINST_AMDGPU_CONTROL_SOCKET";
+
+enum class OutputMode { PerLaunch, Aggregate };
+
+struct CollectionRule {
+  std::string glob;
+  bool enable;
+};
+
+// An immutable snapshot of what should be collected. Once published, a
+// snapshot is never modified or freed, so launches can keep using the one they
+// loaded while a newer one gets published.
+struct CollectionConfig {
+  OutputMode mode = OutputMode::PerLaunch;
+
+  // Rules in the order they were given. A later rule overrides an earlier one.
+  std::vector<CollectionRule> rules;
+
+  // Indexed by instrumented kernel id.
+  std::vector<char> kernelEnabled;
+};
+
+struct ControlState {
+  std::atomic<const CollectionConfig *> current{nullptr};
+
+  // Names of instrumented kernels, indexed by kernel id
+  std::vector<std::string> kernelNames;
+
+  std::function<void()> onFlush;
+  std::function<void()> onReset;
+
+  // Serializes commands. Launches never take this lock.
+  std::mutex commandMutex;
+
+  std::string socketPath;
+};
+
+inline ControlState &getControlState() {
+  static ControlState instance;
+  return instance;
+}
+
+inline const CollectionConfig *getCollectionConfig() {
+  return getControlState().current.load(std::memory_order_acquire);
+}
+
+static const char *outputModeName(OutputMode mode) {
+  return mode == OutputMode::PerLaunch ? "per-launch" : "aggregate";
+}
+
+static void computeKernelEnabled(CollectionConfig &config,
+                                 const std::vector<std::string> &kernelNames) {
+  config.kernelEnabled.assign(kernelNames.size(), 1);
+  for (const CollectionRule &rule : config.rules) {
+    for (size_t i = 0; i < kernelNames.size(); ++i) {
+      if (fnmatch(rule.glob.c_str(), kernelNames[i].c_str(), 0) == 0)
+        config.kernelEnabled[i] = rule.enable;
+    }
+  }
+}
+
+static void publishConfig(CollectionConfig *config) {
+  // Old snapshots are deliberately leaked, a launch may still be reading one.
+  // Configuration changes are rare and snapshots are small.
+  getControlState().current.store(config, std::memory_order_release);
+}
+
+// Publishes the initial configuration: everything enabled, per-launch output.
+inline void initCollectionConfig(const std::vector<std::string> &kernelNames,
+                                 std::function<void()> onFlush, std::function<void()> onReset) {
+  auto &state = getControlState();
+  state.kernelNames = kernelNames;
+  state.onFlush = std::move(onFlush);
+  state.onReset = std::move(onReset);
+
+  auto *config = new CollectionConfig();
+  computeKernelEnabled(*config, state.kernelNames);
+  publishConfig(config);
+}
+
+// Runs a single control command and returns the reply line.
+inline std::string executeControlCommand(const std::string &commandLine) {
+  auto &state = getControlState();
+  std::lock_guard<std::mutex> lock(state.commandMutex);
+
+  std::stringstream ss(commandLine);
+  std::string command, argument, extra;
+  ss >> command >> argument >> extra;
+
+  if (command.empty())
+    return "error : empty command\n";
+
+  if (!extra.empty())
+    return "error : too many arguments to " + command + "\n";
+
+  const CollectionConfig *current = getCollectionConfig();
+
+  if (command == "enable" || command == "disable") {
+    if (argument.empty())
+      return "error : " + command + " expects a kernel name or glob\n";
+
+    auto *config = new CollectionConfig(*current);
+    config->rules.push_back({argument, command == "enable"});
+    computeKernelEnabled(*config, state.kernelNames);
+
+    size_t numEnabled = 0;
+    for (char enabled : config->kernelEnabled)
+      numEnabled += enabled;
+
+    publishConfig(config);
+    return "ok " + std::to_string(numEnabled) + " of " + std::to_string(state.kernelNames.size()) +
+           " instrumented kernels enabled\n";
+  }
+
+  if (command == "mode") {
+    OutputMode mode;
+    if (argument == "per-launch")
+      mode = OutputMode::PerLaunch;
+    else if (argument == "aggregate")
+      mode = OutputMode::Aggregate;
+    else
+      return "error : mode must be per-launch or aggregate\n";
+
+    auto *config = new CollectionConfig(*current);
+    config->mode = mode;
+    publishConfig(config);
+    return std::string("ok mode ") + outputModeName(mode) + "\n";
+  }
+
+  if (!argument.empty())
+    return "error : " + command + " takes no arguments\n";
+
+  if (command == "flush") {
+    state.onFlush();
+    return "ok flushed\n";
+  }
+
+  if (command == "reset") {
+    state.onReset();
+    return "ok reset\n";
+  }
+
+  if (command == "status") {
+    std::string reply = std::string("ok mode ") + outputModeName(current->mode);
+    for (size_t i = 0; i < state.kernelNames.size(); ++i) {
+      reply += current->kernelEnabled[i] ? " +" : " -";
+      reply += state.kernelNames[i];
+    }
+    return reply + "\n";
+  }
+
+  return "error : unknown command " + command + "\n";
+}
+
+static void serveControlConnection(int fd) {
+  std::string pending;
+  char buffer[512];
+  ssize_t count;
+  while ((count = read(fd, buffer, sizeof(buffer))) > 0) {
+    pending.append(buffer, count);
+
+    size_t newline;
+    while ((newline = pending.find('\n')) != std::string::npos) {
+      std::string reply = executeControlCommand(pending.substr(0, newline));
+      pending.erase(0, newline + 1);
+      if (write(fd, reply.data(), reply.size()) < 0)
+        return;
+    }
+  }
+}
+
+static void removeControlSocket() {
+  auto &state = getControlState();
+  if (!state.socketPath.empty())
+    unlink(state.socketPath.c_str());
+}
+
+// Starts a background thread that accepts control connections on socketPath.
+// Connections are served one at a time.
+inline bool startControlServer(const std::string &socketPath) {
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (socketPath.size() >= sizeof(addr.sun_path)) {
+    std::cerr << "control socket path too long : " << socketPath << '\n';
+    return false;
+  }
+  socketPath.copy(addr.sun_path, socketPath.size());
+
+  int listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listenFd < 0) {
+    perror("control socket");
+    return false;
+  }
+
+  // A stale socket from an earlier run would make bind fail.
+  unlink(socketPath.c_str());
+  if (bind(listenFd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 ||
+      listen(listenFd, 4) != 0) {
+    perror("control socket");
+    close(listenFd);
+    return false;
+  }
+
+  getControlState().socketPath = socketPath;
+  atexit(removeControlSocket);
+
+  std::thread([listenFd]() {
+    while (true) {
+      int fd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+      if (fd < 0) {
+        if (errno == EINTR || errno == ECONNABORTED)
+          continue;
+        perror("control socket");
+        return;
+      }
+      serveControlConnection(fd);
+      close(fd);
+    }
+  }).detach();
+
+  std::cerr << "LD_PRELOAD setup: control socket at " << socketPath << '\n';
+  return true;
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+// Dirty-chunk readback of instrumentation buffers.
+//
+// If DYNINST_AMDGPU_DIRTY_CHUNK=<bytes> is set, the instrumentation variables are split into
+// chunks of that many bytes, and every instrumentation buffer gets a header holding one dirty bit
+// per chunk. The header sits right before the address passed to the kernel, so variable offsets
+// are the same as without it:
+//
+//   buffer                          kernel argument
+//   |                               |
+//   [ bitmap words ... | padding ]  [ chunk 0 | chunk 1 | ... ]
+//   <------ headerBytes ---------->
+//
+// Bit (i % 32) of the 32 bit word i / 32 of the bitmap is set by instrumented code that writes to
+// chunk i, e.g. with an atomic or at (argument - headerBytes) + 4 * (i / 32). Only code generated
+// for this protocol may run with the option set, since chunks without their bit set are never
+// copied back.
+//
+// After a launch the header is copied first, then the runs of dirty chunks, each with its own
+// async copy, so the transfer size follows what the kernel touched rather than the table size.
+
+#include "hip/hip_runtime.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+// Environment variable for the dirty chunk size in bytes, enables the dirty-chunk bitmap:
+const char *dirtyChunkEnv = "DYNINST_AMDGPU_DIRTY_CHUNK";
+
+struct InstrumentationBufferLayout {
+  size_t headerBytes = 0; // 0 without a dirty-chunk bitmap
+  size_t dataBytes = 0;
+  size_t chunkBytes = 0;
+  size_t numChunks = 0;
+
+  size_t getTotalBytes() const { return headerBytes + dataBytes; }
+  bool hasDirtyBitmap() const { return headerBytes != 0; }
+};
+
+// Keeps the variables as aligned as hipMalloc would.
+static constexpr size_t kDirtyHeaderAlignment = 256;
+
+inline InstrumentationBufferLayout makeInstrumentationBufferLayout(size_t dataBytes,
+                                                                   size_t chunkBytes) {
+  InstrumentationBufferLayout layout;
+  layout.dataBytes = dataBytes;
+  if (chunkBytes == 0)
+    return layout;
+
+  // Chunks hold whole variables.
+  layout.chunkBytes = (chunkBytes + 3) / 4 * 4;
+  layout.numChunks = (dataBytes + layout.chunkBytes - 1) / layout.chunkBytes;
+  size_t bitmapBytes = (layout.numChunks + 31) / 32 * 4;
+  layout.headerBytes =
+      (bitmapBytes + kDirtyHeaderAlignment - 1) / kDirtyHeaderAlignment * kDirtyHeaderAlignment;
+  return layout;
+}
+
+// Copies the header and the dirty chunks of the device buffer to the host buffer, both of
+// layout.getTotalBytes(), and zeroes the clean chunks on the host. host must be pinned for the
+// copies to be asynchronous. Returns the number of bytes copied.
+inline size_t readDirtyChunks(const InstrumentationBufferLayout &layout, void *host,
+                              const void *device, hipStream_t stream) {
+  assert(layout.hasDirtyBitmap());
+  auto *hostBytes = static_cast<char *>(host);
+  auto *deviceBytes = static_cast<const char *>(device);
+
+  hipError_t hip_ret = hipMemcpyAsync(hostBytes, deviceBytes, layout.headerBytes,
+                                      hipMemcpyDeviceToHost, stream);
+  assert(hip_ret == hipSuccess);
+  hip_ret = hipStreamSynchronize(stream);
+  assert(hip_ret == hipSuccess);
+
+  const uint32_t *bitmap = reinterpret_cast<const uint32_t *>(hostBytes);
+  auto isDirty = [bitmap](size_t chunk) { return (bitmap[chunk / 32] >> (chunk % 32)) & 1; };
+
+  char *hostData = hostBytes + layout.headerBytes;
+  const char *deviceData = deviceBytes + layout.headerBytes;
+  size_t copied = layout.headerBytes;
+
+  // Each run of dirty chunks is one copy, clean runs are zeroed, as they are on the device.
+  size_t chunk = 0;
+  while (chunk < layout.numChunks) {
+    size_t end = chunk + 1;
+    bool dirty = isDirty(chunk);
+    while (end < layout.numChunks && isDirty(end) == dirty)
+      ++end;
+
+    size_t offset = chunk * layout.chunkBytes;
+    size_t size = std::min(end * layout.chunkBytes, layout.dataBytes) - offset;
+    if (dirty) {
+      hip_ret = hipMemcpyAsync(hostData + offset, deviceData + offset, size,
+                               hipMemcpyDeviceToHost, stream);
+      assert(hip_ret == hipSuccess);
+      copied += size;
+    } else {
+      memset(hostData + offset, 0, size);
+    }
+    chunk = end;
+  }
+
+  hip_ret = hipStreamSynchronize(stream);
+  assert(hip_ret == hipSuccess);
+  return copied;
+}
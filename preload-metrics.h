@@ -0,0 +1,227 @@
+#pragma once
+
+// Live metrics endpoint of the preload library.
+//
+// If DYNINST_AMDGPU_METRICS_ADDR is set, the preload library serves the aggregated values in the
+// Prometheus text exposition format over HTTP. The address is either unix:<path> for a
+// Unix-domain socket, or [127.0.0.1:]<port> for a TCP socket, which only ever listens on the
+// loopback interface. For example:
+//
+//   curl --unix-socket /tmp/metrics.sock http://localhost/metrics
+//   curl http://127.0.0.1:9400/metrics
+//
+// Every request is answered with the current values, whatever the path. Values are copied out of
+// the aggregation table (see LaunchStats::snapshot), together with the GPU time histograms the
+// quantiles come from, so scrapes never block launches and a page is consistent per key. A Unix
+// socket is removed at exit by the process that created it.
+
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <netinet/in.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+
+// Environment variable for the metrics endpoint address (unix:<path> or [127.0.0.1:]<port>):
+const char *metricsAddrEnv = "DYNINST_AMDGPU_METRICS_ADDR";
+
+// The Unix socket bound by this process, if any, and the process that bound it. Forked children
+// inherit both, but mustn't remove the socket of their parent.
+static std::string metricsSocketPath;
+static pid_t metricsSocketOwner = 0;
+
+// Builds a metrics page in the Prometheus text format. Labels are added with label() and samples
+// with sample(); all samples of a metric family must follow its family() line.
+class MetricsPage {
+public:
+  void family(const char *name, const char *type, const char *help) {
+    text += "# HELP ";
+    text += name;
+    text += ' ';
+    text += help;
+    text += "\n# TYPE ";
+    text += name;
+    text += ' ';
+    text += type;
+    text += '\n';
+  }
+
+  // Starts the label set of the next sample.
+  void clearLabels() { labels.clear(); }
+
+  void label(const char *name, const std::string &value) {
+    labels += labels.empty() ? "" : ",";
+    labels += name;
+    labels += "=\"";
+    for (char c : value) {
+      if (c == '\\' || c == '"')
+        labels += '\\';
+      if (c == '\n') {
+        labels += "\\n";
+        continue;
+      }
+      labels += c;
+    }
+    labels += '"';
+  }
+
+  void sample(const char *name, double value, const char *extraLabel = nullptr,
+              const char *extraValue = nullptr) {
+    text += name;
+    if (!labels.empty() || extraLabel) {
+      text += '{';
+      text += labels;
+      if (extraLabel) {
+        text += labels.empty() ? "" : ",";
+        text += extraLabel;
+        text += "=\"";
+        text += extraValue;
+        text += '"';
+      }
+      text += '}';
+    }
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), " %.17g\n", value);
+    text += buffer;
+  }
+
+  const std::string &getText() const { return text; }
+
+private:
+  std::string text;
+  std::string labels;
+};
+
+// Reads one request and answers it with the page built by render.
+static void serveMetricsConnection(int fd, const std::function<std::string()> &render) {
+  // The request itself doesn't matter, but it has to be read before replying or some clients
+  // see a reset connection.
+  std::string request;
+  char buffer[1024];
+  while (request.find("\r\n\r\n") == std::string::npos && request.size() < 16384) {
+    ssize_t count = read(fd, buffer, sizeof(buffer));
+    if (count <= 0)
+      break;
+    request.append(buffer, count);
+  }
+
+  std::string body = render();
+  std::string reply = "HTTP/1.0 200 OK\r\n"
+                      "Content-Type: text/plain; version=0.0.4\r\n"
+                      "Content-Length: " +
+                      std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+
+  size_t written = 0;
+  while (written < reply.size()) {
+    ssize_t count = write(fd, reply.data() + written, reply.size() - written);
+    if (count < 0 && errno == EINTR)
+      continue;
+    if (count <= 0)
+      return;
+    written += count;
+  }
+}
+
+static int listenOnMetricsAddr(const std::string &addr) {
+  int fd;
+  if (addr.compare(0, 5, "unix:") == 0) {
+    std::string socketPath = addr.substr(5);
+    sockaddr_un unixAddr = {};
+    unixAddr.sun_family = AF_UNIX;
+    if (socketPath.empty() || socketPath.size() >= sizeof(unixAddr.sun_path)) {
+      std::cerr << "invalid metrics socket path : " << socketPath << '\n';
+      return -1;
+    }
+    socketPath.copy(unixAddr.sun_path, socketPath.size());
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+      return -1;
+    // A stale socket from an earlier run would make bind fail.
+    unlink(socketPath.c_str());
+    if (bind(fd, reinterpret_cast<sockaddr *>(&unixAddr), sizeof(unixAddr)) != 0) {
+      close(fd);
+      return -1;
+    }
+    metricsSocketPath = socketPath;
+    metricsSocketOwner = getpid();
+  } else {
+    std::string host = "127.0.0.1";
+    std::string port = addr;
+    size_t colon = addr.rfind(':');
+    if (colon != std::string::npos) {
+      host = addr.substr(0, colon);
+      port = addr.substr(colon + 1);
+    }
+    if (host != "127.0.0.1" && host != "localhost") {
+      std::cerr << "metrics endpoint only listens on 127.0.0.1, not " << host << '\n';
+      return -1;
+    }
+
+    sockaddr_in inetAddr = {};
+    inetAddr.sin_family = AF_INET;
+    inetAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int portNumber = atoi(port.c_str());
+    if (portNumber <= 0 || portNumber > 65535) {
+      std::cerr << "invalid metrics port : " << port << '\n';
+      return -1;
+    }
+    inetAddr.sin_port = htons(portNumber);
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+      return -1;
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (bind(fd, reinterpret_cast<sockaddr *>(&inetAddr), sizeof(inetAddr)) != 0) {
+      close(fd);
+      return -1;
+    }
+  }
+
+  if (listen(fd, 16) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Starts a background thread answering metrics requests on addr with the page built by render.
+// Requests are served one at a time.
+inline bool startMetricsServer(const std::string &addr, std::function<std::string()> render) {
+  int listenFd = listenOnMetricsAddr(addr);
+  if (listenFd < 0) {
+    perror("metrics socket");
+    return false;
+  }
+
+  std::thread([listenFd, render]() {
+    while (true) {
+      int fd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+      if (fd < 0) {
+        if (errno == EINTR || errno == ECONNABORTED)
+          continue;
+        perror("metrics socket");
+        return;
+      }
+      serveMetricsConnection(fd, render);
+      close(fd);
+    }
+  }).detach();
+
+  std::cerr << "LD_PRELOAD setup: serving metrics at " << addr << '\n';
+  return true;
+}
+
+// Removes the Unix socket of the metrics server. The server thread is left to exit with the
+// process.
+inline void removeMetricsSocket() {
+  if (!metricsSocketPath.empty() && metricsSocketOwner == getpid())
+    unlink(metricsSocketPath.c_str());
+  metricsSocketPath.clear();
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+// NUMA placement helpers for the preload library.
+//
+// The NUMA node of a device is read from sysfs. DYNINST_AMDGPU_SYSFS_ROOT replaces /sys, so a
+// fake tree can be used for testing. Memory is bound with the mbind system call directly, to not
+// depend on libnuma.
+
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sched.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Environment variable replacing /sys when looking up NUMA nodes:
+const char *sysfsRootEnv = "DYNINST_AMDGPU_SYSFS_ROOT";
+
+inline std::string getSysfsRoot() {
+  const char *root = getenv(sysfsRootEnv);
+  return root ? root : "/sys";
+}
+
+// Returns the NUMA node of the PCI device with the given bus id (e.g. 0000:c1:00.0), or -1 if
+// unknown.
+inline int getPciNumaNode(std::string busId) {
+  for (char &c : busId)
+    c = tolower(c);
+
+  std::ifstream file(getSysfsRoot() + "/bus/pci/devices/" + busId + "/numa_node");
+  int node = -1;
+  if (!(file >> node))
+    return -1;
+  return node;
+}
+
+// Parses a sysfs cpulist such as "0-15,32-47".
+inline bool parseCpuList(const std::string &cpuList, cpu_set_t &cpus) {
+  CPU_ZERO(&cpus);
+  size_t pos = 0;
+  while (pos < cpuList.size()) {
+    size_t end = cpuList.find(',', pos);
+    if (end == std::string::npos)
+      end = cpuList.size();
+
+    std::string range = cpuList.substr(pos, end - pos);
+    size_t dash = range.find('-');
+    try {
+      int first = std::stoi(range.substr(0, dash));
+      int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+      for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu)
+        CPU_SET(cpu, &cpus);
+    } catch (...) {
+      return false;
+    }
+    pos = end + 1;
+  }
+  return CPU_COUNT(&cpus) != 0;
+}
+
+// Restricts the calling thread to the CPUs of a NUMA node.
+inline bool bindThreadToNumaNode(int node) {
+  std::ifstream file(getSysfsRoot() + "/devices/system/node/node" + std::to_string(node) +
+                     "/cpulist");
+  std::string cpuList;
+  cpu_set_t cpus;
+  if (!std::getline(file, cpuList) || !parseCpuList(cpuList, cpus))
+    return false;
+  return sched_setaffinity(0, sizeof(cpus), &cpus) == 0;
+}
+
+// mmaps size bytes bound to a NUMA node. Binding is best effort, a node of -1 or a failing mbind
+// leaves the default policy.
+inline void *allocateOnNumaNode(size_t size, int node) {
+  void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (addr == MAP_FAILED)
+    return nullptr;
+
+  if (node >= 0 && node < 64) {
+    // MPOL_BIND from <linux/mempolicy.h>.
+    constexpr int mpolBind = 2;
+    unsigned long nodeMask = 1ul << node;
+    // The kernel reads maxnode - 1 bits, so the last node of the mask needs one more.
+    syscall(SYS_mbind, addr, size, mpolBind, &nodeMask, sizeof(nodeMask) * 8 + 1, 0);
+  }
+
+  // Fault the pages in now, under the policy set above.
+  memset(addr, 0, size);
+  return addr;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+// Output file naming for the preload library.
+//
+// Output paths are templates, so that every process of a multi-process job writes its own file:
+//   %r  rank of this process, read from the usual MPI / Slurm environment variables
+//   %h  host name
+//   %p  process id
+//   %%  a literal %
+
+#include <cstdlib>
+#include <string>
+#include <unistd.h>
+
+// Environment variable for the counter output file template (e.g. counters.%r.%h.%p.bin):
+const char *counterOutputEnv = "DYNINST_AMDGPU_OUTPUT";
+
+// Returns the rank of this process in the job, or -1 if not launched by a known launcher.
+inline int getJobRank() {
+  static const char *rankEnvs[] = {"OMPI_COMM_WORLD_RANK", "PMIX_RANK", "PMI_RANK",
+                                   "MV2_COMM_WORLD_RANK", "SLURM_PROCID"};
+  for (const char *env : rankEnvs) {
+    if (const char *value = getenv(env))
+      return atoi(value);
+  }
+  return -1;
+}
+
+inline std::string getHostName() {
+  char hostName[256] = {};
+  if (gethostname(hostName, sizeof(hostName) - 1) != 0)
+    return "unknown";
+  return hostName;
+}
+
+inline std::string expandOutputPath(const std::string &pathTemplate) {
+  std::string path;
+  for (size_t i = 0; i < pathTemplate.size(); ++i) {
+    if (pathTemplate[i] != '%' || i + 1 == pathTemplate.size()) {
+      path += pathTemplate[i];
+      continue;
+    }
+
+    switch (pathTemplate[++i]) {
+    case 'r': {
+      int rank = getJobRank();
+      path += rank < 0 ? std::string("norank") : std::to_string(rank);
+      break;
+    }
+    case 'h':
+      path += getHostName();
+      break;
+    case 'p':
+      path += std::to_string(getpid());
+      break;
+    case '%':
+      path += '%';
+      break;
+    default:
+      path += '%';
+      path += pathTemplate[i];
+      break;
+    }
+  }
+  return path;
+}
@@ -0,0 +1,225 @@
+#pragma once
+
+// Periodic compressed snapshots of the aggregated values.
+//
+// If DYNINST_AMDGPU_SNAPSHOTS is set (an output path template, see preload-output.h), a background
+// thread appends a snapshot of the aggregation table to that file every
+// DYNINST_AMDGPU_SNAPSHOT_INTERVAL_MS milliseconds (default 1000), and once more at exit. Each
+// snapshot only holds what changed since the previous one, packed with msgpack and deflated with
+// msgpack::zbuffer. The format is described in snapshot-records.h, read-snapshots expands it.
+
+#include "preload-aggregate.h"
+#include "snapshot-records.h"
+
+#include <msgpack.hpp>
+#include <msgpack/zbuffer.hpp>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Environment variable for the snapshot output template (e.g. snapshots.%r.bin):
+const char *snapshotOutputEnv = "DYNINST_AMDGPU_SNAPSHOTS";
+
+// Environment variable for the time between snapshots in milliseconds (default 1000):
+const char *snapshotIntervalEnv = "DYNINST_AMDGPU_SNAPSHOT_INTERVAL_MS";
+
+class SnapshotWriter {
+public:
+  // Describes a key when it first appears: its kernel name and call site.
+  using DescribeKey =
+      std::function<void(const LaunchKey &key, std::string &kernelName, std::string &callSite)>;
+
+  // table and varNames must outlive the writer.
+  bool open(const std::string &filePath, unsigned intervalMs, const LaunchStatsTable &table_,
+            const std::vector<std::string> &varNames_, DescribeKey describeKey_) {
+    file = fopen(filePath.c_str(), "wb");
+    if (!file)
+      return false;
+    if (fwrite(snapshotFileMagic, sizeof(snapshotFileMagic), 1, file) != 1) {
+      fclose(file);
+      file = nullptr;
+      return false;
+    }
+
+    table = &table_;
+    varNames = &varNames_;
+    describeKey = std::move(describeKey_);
+    thread = std::thread([this, intervalMs]() { run(intervalMs); });
+    return true;
+  }
+
+  bool isOpen() const { return file != nullptr; }
+
+  // Writes a last snapshot and closes the file.
+  void close() {
+    if (!file)
+      return;
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    condition.notify_one();
+    thread.join();
+
+    writeSnapshot();
+    fclose(file);
+    file = nullptr;
+  }
+
+private:
+  // Forwards packed bytes to the compressor and counts them.
+  struct CountingZbuffer {
+    msgpack::zbuffer &zbuffer;
+    size_t size = 0;
+
+    void write(const char *data, size_t length) {
+      zbuffer.write(data, length);
+      size += length;
+    }
+  };
+
+  struct KeyState {
+    uint32_t keyIndex;
+    LaunchStatsSnapshot previous;
+  };
+
+  void run(unsigned intervalMs) {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!condition.wait_for(lock, std::chrono::milliseconds(intervalMs),
+                               [this]() { return stopping; })) {
+      lock.unlock();
+      writeSnapshot();
+      lock.lock();
+    }
+  }
+
+  void writeSnapshot() {
+    struct NewKey {
+      uint32_t keyIndex;
+      const LaunchKey *key;
+    };
+    std::vector<NewKey> newKeys;
+    std::vector<std::pair<KeyState *, size_t>> changes; // index into current
+
+    // One pass over the table, so a key inserted meanwhile can't shift the snapshots.
+    size_t numVars = varNames->size();
+    current.resize(0);
+    table->forEach([&](const LaunchStats &stats) {
+      LaunchStatsSnapshot &snapshot = current.emplace_back();
+      stats.snapshot(numVars, snapshot);
+
+      auto it = statesBySlot.find(&stats);
+      if (it == statesBySlot.end()) {
+        KeyState state;
+        state.keyIndex = statesBySlot.size();
+        state.previous.key = snapshot.key;
+        state.previous.launches = 0;
+        state.previous.totalNs = 0;
+        state.previous.minNs = UINT64_MAX;
+        state.previous.maxNs = 0;
+        state.previous.sums.assign(numVars, 0);
+        it = statesBySlot.emplace(&stats, std::move(state)).first;
+        newKeys.push_back({it->second.keyIndex, &stats.key});
+      }
+
+      const LaunchStatsSnapshot &previous = it->second.previous;
+      if (snapshot.launches != previous.launches || snapshot.totalNs != previous.totalNs ||
+          snapshot.sums != previous.sums)
+        changes.emplace_back(&it->second, current.size() - 1);
+    });
+
+    msgpack::zbuffer zbuffer(Z_BEST_SPEED);
+    CountingZbuffer counting = {zbuffer};
+    msgpack::packer<CountingZbuffer> packer(counting);
+
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    packer.pack_array(5);
+    packer.pack_uint64(sequence);
+    packer.pack_uint64(uint64_t(now.tv_sec) * 1000000000 + now.tv_nsec);
+
+    if (sequence == 0) {
+      packer.pack_array(numVars);
+      for (auto &name : *varNames)
+        packer.pack(name);
+    } else {
+      packer.pack_array(0);
+    }
+
+    packer.pack_array(newKeys.size());
+    std::string kernelName, callSite;
+    for (const NewKey &newKey : newKeys) {
+      describeKey(*newKey.key, kernelName, callSite);
+      const LaunchShape &shape = newKey.key->shape;
+      packer.pack_array(4);
+      packer.pack_uint32(newKey.keyIndex);
+      packer.pack(kernelName);
+      packer.pack_array(7);
+      for (uint32_t value : shape.grid)
+        packer.pack_uint32(value);
+      for (uint32_t value : shape.block)
+        packer.pack_uint32(value);
+      packer.pack_uint64(shape.sharedMemBytes);
+      packer.pack(callSite);
+    }
+
+    packer.pack_array(changes.size());
+    for (auto &change : changes) {
+      LaunchStatsSnapshot &previous = change.first->previous;
+      const LaunchStatsSnapshot &snapshot = current[change.second];
+
+      packer.pack_array(6);
+      packer.pack_uint32(change.first->keyIndex);
+      packer.pack_int64(int64_t(snapshot.launches - previous.launches));
+      packer.pack_int64(int64_t(snapshot.totalNs - previous.totalNs));
+      packer.pack_uint64(snapshot.minNs);
+      packer.pack_uint64(snapshot.maxNs);
+
+      size_t numChangedVars = 0;
+      for (size_t v = 0; v < numVars; ++v)
+        numChangedVars += snapshot.sums[v] != previous.sums[v];
+      packer.pack_array(2 * numChangedVars);
+      for (size_t v = 0; v < numVars; ++v) {
+        if (snapshot.sums[v] != previous.sums[v]) {
+          packer.pack_uint32(v);
+          packer.pack_int64(int64_t(snapshot.sums[v] - previous.sums[v]));
+        }
+      }
+      previous = snapshot;
+    }
+
+    zbuffer.flush();
+    SnapshotFrameHeader header = {static_cast<uint32_t>(zbuffer.size()),
+                                  static_cast<uint32_t>(counting.size)};
+    if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+        fwrite(zbuffer.data(), zbuffer.size(), 1, file) != 1 || fflush(file) != 0)
+      perror("snapshot write");
+    ++sequence;
+  }
+
+  FILE *file = nullptr;
+  const LaunchStatsTable *table = nullptr;
+  const std::vector<std::string> *varNames = nullptr;
+  DescribeKey describeKey;
+
+  std::mutex mutex;
+  std::condition_variable condition;
+  bool stopping = false;
+  std::thread thread;
+
+  // Only used by the writer thread, and by close() after the thread has stopped.
+  uint64_t sequence = 0;
+  std::vector<LaunchStatsSnapshot> current;
+  std::unordered_map<const LaunchStats *, KeyState> statesBySlot;
+};
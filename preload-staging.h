@@ -0,0 +1,127 @@
+#pragma once
+
+// Staging buffers for copying instrumentation variables back from the GPU.
+//
+// Every device gets a pool of (device buffer, pinned host buffer) pairs, so launches don't
+// allocate, and host buffers are placed on the NUMA node the device is attached to. On multi
+// socket nodes a host buffer on the far socket makes every readback cross the socket
+// interconnect.
+
+#include "hip/hip_runtime.h"
+#include "preload-numa.h"
+
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+struct StagingBuffer {
+  void *device = nullptr;
+  void *host = nullptr;
+};
+
+class StagingPool {
+public:
+  StagingPool(int device_, size_t bufferSize_) : device(device_), bufferSize(bufferSize_) {
+    char busId[64] = {};
+    if (hipDeviceGetPCIBusId(busId, sizeof(busId), device) == hipSuccess)
+      numaNode = getPciNumaNode(busId);
+  }
+
+  StagingBuffer acquire() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!free.empty()) {
+        StagingBuffer buffer = free.back();
+        free.pop_back();
+        return buffer;
+      }
+    }
+
+    StagingBuffer buffer;
+    hipError_t hip_ret = hipMalloc(&buffer.device, bufferSize);
+    assert(hip_ret == hipSuccess);
+
+    // Pages are rounded up, hipHostRegister pins whole pages anyway.
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    size_t hostSize = (bufferSize + pageSize - 1) / pageSize * pageSize;
+    buffer.host = allocateOnNumaNode(hostSize, numaNode);
+    assert(buffer.host);
+    hip_ret = hipHostRegister(buffer.host, hostSize, hipHostRegisterDefault);
+    assert(hip_ret == hipSuccess);
+    return buffer;
+  }
+
+  void release(const StagingBuffer &buffer) {
+    std::lock_guard<std::mutex> lock(mutex);
+    free.push_back(buffer);
+  }
+
+  void recordCopy(uint64_t bytes, uint64_t ns) {
+    copies.fetch_add(1, std::memory_order_relaxed);
+    copiedBytes.fetch_add(bytes, std::memory_order_relaxed);
+    copyNs.fetch_add(ns, std::memory_order_relaxed);
+  }
+
+  void printStats(std::ostream &os) const {
+    uint64_t numCopies = copies.load(std::memory_order_relaxed);
+    if (numCopies == 0)
+      return;
+
+    uint64_t bytes = copiedBytes.load(std::memory_order_relaxed);
+    uint64_t ns = copyNs.load(std::memory_order_relaxed);
+    os << "Device " << device << " (NUMA node " << numaNode << ") : " << numCopies
+       << " readbacks, " << bytes << " bytes, " << (ns ? bytes / (ns / 1e9) / 1e9 : 0)
+       << " GB/s\n";
+  }
+
+  void resetStats() {
+    copies.store(0, std::memory_order_relaxed);
+    copiedBytes.store(0, std::memory_order_relaxed);
+    copyNs.store(0, std::memory_order_relaxed);
+  }
+
+  int getNumaNode() const { return numaNode; }
+
+private:
+  int device;
+  int numaNode = -1;
+  size_t bufferSize;
+
+  std::mutex mutex;
+  std::vector<StagingBuffer> free;
+
+  std::atomic<uint64_t> copies{0};
+  std::atomic<uint64_t> copiedBytes{0};
+  std::atomic<uint64_t> copyNs{0};
+};
+
+class StagingPools {
+public:
+  static constexpr int kMaxDevices = 64;
+
+  void init(size_t bufferSize_) { bufferSize = bufferSize_; }
+
+  StagingPool &get(int device) {
+    assert(device >= 0 && device < kMaxDevices);
+    std::call_once(created[device],
+                   [&]() { pools[device] = std::make_unique<StagingPool>(device, bufferSize); });
+    return *pools[device];
+  }
+
+  template <typename F> void forEach(F f) {
+    for (auto &pool : pools) {
+      if (pool)
+        f(*pool);
+    }
+  }
+
+private:
+  size_t bufferSize = 0;
+  std::array<std::once_flag, kMaxDevices> created;
+  std::array<std::unique_ptr<StagingPool>, kMaxDevices> pools;
+};
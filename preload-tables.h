@@ -0,0 +1,70 @@
+#pragma once
+
+// Compile-time kernel tables for application-specific preload libraries.
+//
+// gen-preload-tables turns the preload info file written by update-note and the instrumentation
+// variable table of the mutator into a C++ file of constexpr tables. When preload.cpp is built
+// with DYNINST_AMDGPU_GENERATED_TABLES set to that file (the PRELOAD_TABLES CMake option), it uses
+// these tables instead of reading both files at startup.
+//
+// Kernel names are looked up with a perfect hash built with hash-and-displace (CHD):
+// every name hashes with seed 0 to a bucket, and the bucket's displacement is the seed that sends
+// all its names to distinct free slots. A lookup is two hashes, two array loads and one string
+// compare, with no probing.
+
+#include <cstdint>
+#include <string_view>
+
+struct GeneratedKernel {
+  std::string_view name;
+  int kernargSize;
+  int firstHiddenArgIndex;
+};
+
+struct GeneratedVar {
+  int offset;
+  std::string_view name;
+};
+
+// Seeded FNV-1a with a final mix, so that nearby seeds give unrelated slots.
+constexpr uint64_t hashTableKey(std::string_view key, uint64_t seed) {
+  uint64_t hash = 0xcbf29ce484222325ull ^ (seed * 0x9e3779b97f4a7c15ull);
+  for (char c : key) {
+    hash ^= static_cast<unsigned char>(c);
+    hash *= 0x100000001b3ull;
+  }
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdull;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+struct GeneratedTables {
+  const GeneratedKernel *kernels;
+  uint32_t numKernels;
+  const uint32_t *displacements; // one seed per bucket
+  uint32_t numBuckets;
+  const uint32_t *slots; // kernel index per slot, numKernels if free
+  uint32_t numSlots;
+  const GeneratedVar *vars; // sorted by offset
+  uint32_t numVars;
+
+  // Index of the kernel in kernels, i.e. its kernel id, or -1 if it isn't instrumented.
+  constexpr int find(std::string_view name) const {
+    if (numKernels == 0)
+      return -1;
+    uint32_t bucket = hashTableKey(name, 0) % numBuckets;
+    uint32_t slot = hashTableKey(name, displacements[bucket]) % numSlots;
+    uint32_t index = slots[slot];
+    return index < numKernels && kernels[index].name == name ? static_cast<int>(index) : -1;
+  }
+
+  // Whether every kernel is found at its own index, checked by gen-preload-tables.
+  constexpr bool isConsistent() const {
+    for (uint32_t i = 0; i < numKernels; ++i) {
+      if (find(kernels[i].name) != static_cast<int>(i))
+        return false;
+    }
+    return true;
+  }
+};
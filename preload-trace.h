@@ -0,0 +1,296 @@
+#pragma once
+
+// Chrome Trace Event export of instrumented launches.
+//
+// If DYNINST_AMDGPU_TRACE is set (an output path template, see preload-output.h), every collected
+// launch becomes a complete ("X") event on a track of its (device, stream), with the launch shape,
+// the interposer overhead and the instrumentation variable values as args. The file loads in
+// chrome://tracing and ui.perfetto.dev.
+//
+// Launches only copy a small binary record into the current chunk. A background thread formats
+// full chunks as JSON and writes each with a single write call, so the launching threads never
+// wait for the file system. If the writer falls kMaxPendingChunks chunks behind, full chunks are
+// dropped and counted instead, so a slow file system can't grow the queue without bound.
+
+#include "counter-records.h"
+#include "preload-numa.h"
+
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <fcntl.h>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+// Environment variable for the trace output file template (e.g. trace.%r.%p.json):
+const char *traceOutputEnv = "DYNINST_AMDGPU_TRACE";
+
+struct TraceEvent {
+  uint32_t kernelId;
+  int device;
+  const void *stream;
+  uint64_t startNs;
+  uint64_t gpuNs;
+  uint64_t overheadNs;
+  LaunchShape shape;
+  uint32_t firstValue; // index into TraceChunk::values
+  uint32_t numValues;
+};
+
+struct TraceChunk {
+  static constexpr size_t kMaxEvents = 8192;
+
+  std::vector<TraceEvent> events;
+  std::vector<uint32_t> values;
+
+  void clear() {
+    events.clear();
+    values.clear();
+  }
+};
+
+class TraceWriter {
+public:
+  static constexpr size_t kMaxPendingChunks = 16;
+
+  // kernelNames and varNames must outlive the writer.
+  bool open(const std::string &filePath, const std::vector<std::string> &kernelNames_,
+            const std::vector<std::string> &varNames_) {
+    fd = ::open(filePath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+      return false;
+
+    kernelNames = &kernelNames_;
+    varNames = &varNames_;
+    pid = getpid();
+    current = std::make_unique<TraceChunk>();
+    current->events.reserve(TraceChunk::kMaxEvents);
+
+    writeAll("[\n");
+    thread = std::thread([this]() { run(); });
+    return true;
+  }
+
+  bool isOpen() const { return fd >= 0; }
+
+  // Events dropped because the writer thread fell behind. Read it after close.
+  uint64_t getDroppedEvents() const { return droppedEvents; }
+
+  // Moves the writer thread onto the CPUs of a NUMA node. Only the first call has an effect, so
+  // the thread stays next to the first device that launched.
+  void setNumaNode(int node) {
+    if (node < 0 || numaNode.load(std::memory_order_relaxed) >= 0)
+      return;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    int unset = -1;
+    if (numaNode.compare_exchange_strong(unset, node, std::memory_order_relaxed))
+      condition.notify_one();
+  }
+
+  void addEvent(const TraceEvent &event, const uint32_t *values) {
+    std::lock_guard<std::mutex> lock(mutex);
+    TraceEvent &added = current->events.emplace_back(event);
+    added.firstValue = current->values.size();
+    current->values.insert(current->values.end(), values, values + event.numValues);
+
+    if (current->events.size() == TraceChunk::kMaxEvents)
+      submitCurrent();
+  }
+
+  // Hands the events collected so far to the writer thread.
+  void flush() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!current->events.empty())
+      submitCurrent();
+  }
+
+  // Writes out all events and closes the file.
+  void close() {
+    if (fd < 0)
+      return;
+
+    // Nothing is added after this, so the last chunk is queued whatever the backlog.
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!current->events.empty()) {
+        pending.push_back(std::move(current));
+        current = std::make_unique<TraceChunk>();
+      }
+      stopping = true;
+    }
+    condition.notify_one();
+    thread.join();
+
+    writeAll("\n]\n");
+    ::close(fd);
+    fd = -1;
+  }
+
+private:
+  // Called with mutex held.
+  void submitCurrent() {
+    if (pending.size() >= kMaxPendingChunks) {
+      droppedEvents += current->events.size();
+      current->clear();
+      return;
+    }
+
+    pending.push_back(std::move(current));
+    if (!spare.empty()) {
+      current = std::move(spare.back());
+      spare.pop_back();
+    } else {
+      current = std::make_unique<TraceChunk>();
+      current->events.reserve(TraceChunk::kMaxEvents);
+    }
+    condition.notify_one();
+  }
+
+  void run() {
+    std::string text;
+    while (true) {
+      std::unique_ptr<TraceChunk> chunk;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        condition.wait(lock, [this]() {
+          return stopping || !pending.empty() ||
+                 numaNode.load(std::memory_order_relaxed) != boundNode;
+        });
+        int node = numaNode.load(std::memory_order_relaxed);
+        if (node != boundNode) {
+          bindThreadToNumaNode(node);
+          boundNode = node;
+        }
+        if (pending.empty()) {
+          if (stopping)
+            return;
+          continue;
+        }
+        chunk = std::move(pending.front());
+        pending.pop_front();
+      }
+
+      text.clear();
+      format(*chunk, text);
+      writeAll(text);
+
+      chunk->clear();
+      std::lock_guard<std::mutex> lock(mutex);
+      spare.push_back(std::move(chunk));
+    }
+  }
+
+  void format(const TraceChunk &chunk, std::string &text) {
+    for (const TraceEvent &event : chunk.events) {
+      int tid = getTrack(event.device, event.stream, text);
+
+      text += first ? "" : ",\n";
+      first = false;
+      text += "{\"ph\":\"X\",\"cat\":\"kernel\",\"name\":\"";
+      appendEscaped(text, (*kernelNames)[event.kernelId]);
+      text += "\",\"pid\":" + std::to_string(pid) + ",\"tid\":" + std::to_string(tid);
+      text += ",\"ts\":" + formatMicroseconds(event.startNs);
+      text += ",\"dur\":" + formatMicroseconds(event.gpuNs);
+      text += ",\"args\":{\"overhead_us\":" + formatMicroseconds(event.overheadNs);
+      if (!event.shape.isEmpty()) {
+        text += ",\"grid\":\"" + std::to_string(event.shape.grid[0]) + "," +
+                std::to_string(event.shape.grid[1]) + "," + std::to_string(event.shape.grid[2]) +
+                "\",\"block\":\"" + std::to_string(event.shape.block[0]) + "," +
+                std::to_string(event.shape.block[1]) + "," + std::to_string(event.shape.block[2]) +
+                "\",\"shared\":" + std::to_string(event.shape.sharedMemBytes);
+      }
+      for (uint32_t i = 0; i < event.numValues; ++i) {
+        text += ",\"";
+        appendEscaped(text, (*varNames)[i]);
+        text += "\":" + std::to_string(chunk.values[event.firstValue + i]);
+      }
+      text += "}}";
+    }
+  }
+
+  // Returns the track (tid) of a (device, stream). A new track gets a name event first.
+  int getTrack(int device, const void *stream, std::string &text) {
+    auto key = std::make_pair(device, stream);
+    auto it = tracks.find(key);
+    if (it != tracks.end())
+      return it->second;
+
+    int tid = tracks.size() + 1;
+    tracks[key] = tid;
+
+    char name[64];
+    snprintf(name, sizeof(name), "device %d stream %p", device, stream);
+    text += first ? "" : ",\n";
+    first = false;
+    text += "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":" + std::to_string(pid) +
+            ",\"tid\":" + std::to_string(tid) + ",\"args\":{\"name\":\"" + name + "\"}}";
+    return tid;
+  }
+
+  static std::string formatMicroseconds(uint64_t ns) {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%llu.%03llu", static_cast<unsigned long long>(ns / 1000),
+             static_cast<unsigned long long>(ns % 1000));
+    return buffer;
+  }
+
+  static void appendEscaped(std::string &text, const std::string &str) {
+    for (char c : str) {
+      if (c == '"' || c == '\\') {
+        text += '\\';
+        text += c;
+      } else if (static_cast<unsigned char>(c) < 0x20) {
+        char buffer[8];
+        snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+        text += buffer;
+      } else {
+        text += c;
+      }
+    }
+  }
+
+  void writeAll(const std::string &text) {
+    size_t written = 0;
+    while (written < text.size()) {
+      ssize_t count = write(fd, text.data() + written, text.size() - written);
+      if (count < 0) {
+        if (errno == EINTR)
+          continue;
+        perror("trace write");
+        return;
+      }
+      written += count;
+    }
+  }
+
+  int fd = -1;
+  int pid = 0;
+  const std::vector<std::string> *kernelNames = nullptr;
+  const std::vector<std::string> *varNames = nullptr;
+
+  std::mutex mutex;
+  std::condition_variable condition;
+  std::unique_ptr<TraceChunk> current;
+  std::deque<std::unique_ptr<TraceChunk>> pending;
+  std::vector<std::unique_ptr<TraceChunk>> spare;
+  bool stopping = false;
+  uint64_t droppedEvents = 0;
+  std::thread thread;
+  std::atomic<int> numaNode{-1};
+
+  // Only used by the writer thread.
+  int boundNode = -1;
+  bool first = true;
+  std::map<std::pair<int, const void *>, int> tracks;
+};
@@ -1,5 +1,19 @@
 #include "hip/hip_runtime.h"
 
+#include "counter-ring.h"
+#include "preload-aggregate.h"
+#include "preload-census.h"
+#include "preload-callsite.h"
+#include "preload-control.h"
+#include "preload-dirty.h"
+#include "preload-metrics.h"
+#include "preload-output.h"
+#include "preload-snapshot.h"
+#include "preload-staging.h"
+#include "preload-trace.h"
+
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <dlfcn.h>
 #include <iostream>
@@ -8,9 +22,16 @@
 #include <string>
 #include <sstream>
 #include <cstring>
+#include <memory>
 #include <vector>
 #include <unordered_map>
 
+// Application-specific builds compile in the kernel tables generated by gen-preload-tables, see
+// preload-tables.h.
+#ifdef DYNINST_AMDGPU_GENERATED_TABLES
+#include DYNINST_AMDGPU_GENERATED_TABLES
+#endif
+
 // Environment variable for the instrumentation variable table path:
 const char *instrumentationVariableTableEnv = "DYNINST_AMDGPU_INSTRUMENTATON_VAR_TABLE";
 
@@ -23,11 +44,16 @@ struct InstrumentationVarTableEntry {
   std::string name;
   // TODO : This needs a size field too
 
+  // <offset> <name> [<instrumentation point address>], the address is only used by
+  // attribute-lines.
   InstrumentationVarTableEntry(std::vector<std::string> words) {
-    assert(words.size() == 2);
+    assert(words.size() == 2 || words.size() == 3);
     offset = std::stoi(words[0]);
     name = words[1];
   }
+
+  InstrumentationVarTableEntry(int offset, std::string name)
+      : offset(offset), name(std::move(name)) {}
 };
 
 std::unordered_map<std::string, int> &getKernargSizeMap() {
@@ -40,11 +66,41 @@ std::unordered_map<std::string, int> &getFirstHiddenArgIndexMap() {
   return instance;
 }
 
+// Instrumented kernels are identified by their position in the preload info file.
+std::unordered_map<std::string, int> &getKernelIdMap() {
+  static std::unordered_map<std::string, int> instance;
+  return instance;
+}
+
+std::vector<std::string> &getInstrumentedKernelNames() {
+  static std::vector<std::string> instance;
+  return instance;
+}
+
 std::vector<InstrumentationVarTableEntry> &getInstrumentationVarTableEntries() {
   static std::vector<InstrumentationVarTableEntry> instance;
   return instance;
 }
 
+// Instrumentation variable values accumulated over launches, used in the aggregate output mode.
+// LaunchStats::sums is indexed like the instrumentation variable table.
+LaunchStatsTable &getLaunchStatsTable() {
+  static LaunchStatsTable instance;
+  return instance;
+}
+
+// Whether LaunchKeys include the launch geometry, see preload-aggregate.h.
+static bool keyByShape = false;
+
+// Number of return addresses captured per launch, 0 if call sites aren't captured.
+static unsigned callSiteDepth = 0;
+static bool callSiteUnwind = false;
+
+CallSiteTable &getCallSiteTable() {
+  static CallSiteTable instance;
+  return instance;
+}
+
 // Read words from a string
 void getWords(const std::string &str, std::vector<std::string> &words) {
   std::stringstream ss(str);
@@ -87,6 +143,8 @@ void readInstrumentedVarTable(const std::string &filePath) {
 void readPreloadInfo(const std::string &filePath) {
   auto &kernargSizeMap = getKernargSizeMap();
   auto &firstHiddenArgIndexMap = getFirstHiddenArgIndexMap();
+  auto &kernelIdMap = getKernelIdMap();
+  auto &kernelNames = getInstrumentedKernelNames();
 
   std::cerr << "readPreloadMaps : reading " << filePath << "\n";
   std::ifstream mapFile(filePath);
@@ -115,11 +173,42 @@ void readPreloadInfo(const std::string &filePath) {
     int firstHiddenArgIndex = std::stoi(words[2]);
     firstHiddenArgIndexMap[kernelName] = firstHiddenArgIndex;
 
+    if (kernelIdMap.emplace(kernelName, kernelNames.size()).second)
+      kernelNames.push_back(kernelName);
+
     words.clear();
   }
   mapFile.close();
 }
 
+struct InstrumentedKernelInfo {
+  int kernelId;
+  int kernargSize;
+  int firstHiddenArgIndex;
+};
+
+// Looks up an instrumented kernel, with the generated perfect hash if it is compiled in. Returns
+// false if the kernel isn't instrumented.
+static bool findInstrumentedKernel(const std::string &kernelName, InstrumentedKernelInfo &info) {
+#ifdef DYNINST_AMDGPU_GENERATED_TABLES
+  int index = generatedTables.find(kernelName);
+  if (index < 0)
+    return false;
+  const GeneratedKernel &kernel = generatedTables.kernels[index];
+  info = {index, kernel.kernargSize, kernel.firstHiddenArgIndex};
+  return true;
+#else
+  auto it = getKernelIdMap().find(kernelName);
+  auto kernargSize = getKernargSizeMap().find(kernelName);
+  auto firstHiddenArgIndex = getFirstHiddenArgIndexMap().find(kernelName);
+  if (it == getKernelIdMap().end() || kernargSize == getKernargSizeMap().end() ||
+      firstHiddenArgIndex == getFirstHiddenArgIndexMap().end())
+    return false;
+  info = {it->second, kernargSize->second, firstHiddenArgIndex->second};
+  return true;
+#endif
+}
+
 typedef void (*registerFunc_t ) (
     void** modules,
     const void*  hostFunction,
@@ -134,7 +223,33 @@ typedef void (*registerFunc_t ) (
 
 static registerFunc_t realRegisterFunction;
 
-static std::unordered_map<const void *, std::string> addressToKernelName;
+// What a launch needs to know about a registered kernel, resolved once so that launches don't
+// look anything up by name.
+struct RegisteredKernel {
+  std::string name;
+  bool isInstrumented = false;
+  InstrumentedKernelInfo info = {};
+  // Set once "not instrumented" has been reported for the kernel.
+  std::atomic<bool> isReported{false};
+};
+
+static std::unordered_map<const void *, RegisteredKernel> registeredKernels;
+
+// Set by setup once the instrumented kernels are known. Kernels registered before that are
+// resolved by setup.
+static bool instrumentedKernelsLoaded = false;
+
+static void resolveRegisteredKernel(RegisteredKernel &kernel) {
+  kernel.isInstrumented = findInstrumentedKernel(kernel.name, kernel.info);
+}
+
+static Census census;
+
+// Where the census profile is written, if the census is enabled.
+static std::string censusOutputPath;
+
+// If set, GPU time histograms are written to this file at exit.
+static std::string histogramOutputPath;
 
 extern "C" void __hipRegisterFunction(
     void** modules,
@@ -150,9 +265,13 @@ extern "C" void __hipRegisterFunction(
 
   if(realRegisterFunction == 0) {
     realRegisterFunction = (registerFunc_t) dlsym(RTLD_NEXT,"__hipRegisterFunction");
-    // Map address to kernel name
-    addressToKernelName[hostFunction] = std::string(deviceFunction);
   }
+  // Map address to kernel name
+  RegisteredKernel &kernel = registeredKernels[hostFunction];
+  kernel.name = deviceFunction;
+  if (instrumentedKernelsLoaded)
+    resolveRegisteredKernel(kernel);
+  census.registerKernel(hostFunction, deviceFunction);
   realRegisterFunction(modules,hostFunction,deviceFunction,deviceName,threadLimit,tid,bid,blockDim,gridDim,wSize);
   return;
 }
@@ -162,6 +281,303 @@ typedef uint32_t (*launch_t)(const void *hostFunction, dim3 gridDim,
                              hipStream_t stream);
 launch_t realLaunch = 0;
 
+// If attached, per-launch values are published here instead of being printed.
+static CounterRing counterRing;
+
+// The arguments of an instrumented launch: the original ones, and the instrumentation buffer at
+// the first hidden argument. The array is per thread, so launches don't allocate.
+static void **makeInstrumentedArgs(void **args, const InstrumentedKernelInfo &info,
+                                   void **instrumentationData) {
+  thread_local std::vector<void *> newArgs;
+  size_t numArgs = std::max<size_t>((info.kernargSize + sizeof(void *)) / sizeof(void *) + 1,
+                                    info.firstHiddenArgIndex + 1);
+  if (newArgs.size() < numArgs)
+    newArgs.resize(numArgs);
+  memcpy(newArgs.data(), args, info.kernargSize);
+  newArgs[info.firstHiddenArgIndex] = (void *)instrumentationData;
+  return newArgs.data();
+}
+
+static void publishInstrumentationData(const std::string &kernelName, const unsigned *data) {
+  auto &instrumentationVarTableEntries = getInstrumentationVarTableEntries();
+
+  CounterRecord record;
+  record.setKernelName(kernelName);
+  record.pid = getpid();
+
+  uint32_t numVars = instrumentationVarTableEntries.size();
+  for (uint32_t first = 0; first < numVars; first += CounterRecord::kMaxValues) {
+    record.firstVar = first;
+    record.numValues = std::min(numVars - first, CounterRecord::kMaxValues);
+    for (uint32_t i = 0; i < record.numValues; ++i)
+      record.values[i] = data[instrumentationVarTableEntries[first + i].offset / 4];
+    counterRing.push(record);
+  }
+}
+
+static size_t getInstrumentationDataSize() {
+  // TODO: Use size
+  auto &instrumentationVarTableEntries = getInstrumentationVarTableEntries();
+  assert(!instrumentationVarTableEntries.empty());
+  InstrumentationVarTableEntry lastEntry = *(instrumentationVarTableEntries.end() - 1);
+  return lastEntry.offset + 4;
+}
+
+// Layout of the buffers passed to instrumented kernels, see preload-dirty.h.
+static InstrumentationBufferLayout bufferLayout;
+
+// Instrumented kernels always expect the extra argument, even when collection is disabled for
+// them. Such launches share this buffer, and its contents are never read.
+static void *getScratchInstrumentationData() {
+  static void *scratch = []() {
+    char *buffer = nullptr;
+    hipError_t hip_ret = hipMalloc((void **)&buffer, bufferLayout.getTotalBytes());
+    assert(hip_ret == hipSuccess);
+    return buffer + bufferLayout.headerBytes;
+  }();
+  return scratch;
+}
+
+// If set, aggregated values are written to this file instead of being printed.
+static std::string counterOutputPath;
+
+// Names of the instrumentation variables, indexed like the instrumentation variable table.
+static std::vector<std::string> instrumentationVarNames;
+
+static TraceWriter traceWriter;
+
+// Set if values are served on a metrics endpoint, which needs them aggregated.
+static bool serveMetrics = false;
+
+static SnapshotWriter snapshotWriter;
+
+static StagingPools stagingPools;
+
+// Events bracketing an instrumented launch, to measure its GPU time. One pair per launching
+// thread, never destroyed since thread exit may happen after the HIP runtime is gone.
+struct LaunchEvents {
+  hipEvent_t start;
+  hipEvent_t stop;
+
+  LaunchEvents() {
+    hipError_t hip_ret = hipEventCreate(&start);
+    assert(hip_ret == hipSuccess);
+    hip_ret = hipEventCreate(&stop);
+    assert(hip_ret == hipSuccess);
+  }
+};
+
+static LaunchEvents &getLaunchEvents() {
+  thread_local LaunchEvents instance;
+  return instance;
+}
+
+static LaunchShape makeLaunchShape(dim3 gridDim, dim3 blockDim, size_t sharedMemBytes) {
+  LaunchShape shape;
+  shape.grid[0] = gridDim.x;
+  shape.grid[1] = gridDim.y;
+  shape.grid[2] = gridDim.z;
+  shape.block[0] = blockDim.x;
+  shape.block[1] = blockDim.y;
+  shape.block[2] = blockDim.z;
+  shape.sharedMemBytes = sharedMemBytes;
+  return shape;
+}
+
+static LaunchKey makeLaunchKey(int kernelId, uint32_t callSite, dim3 gridDim, dim3 blockDim,
+                               size_t sharedMemBytes) {
+  LaunchKey key = {};
+  key.kernelId = kernelId;
+  key.callSite = callSite;
+  if (keyByShape)
+    key.shape = makeLaunchShape(gridDim, blockDim, sharedMemBytes);
+  return key;
+}
+
+// Keys with at least one launch since the last reset, ordered by kernel name and shape.
+static std::vector<const LaunchStats *> getSortedLaunchStats() {
+  auto &kernelNames = getInstrumentedKernelNames();
+
+  std::vector<const LaunchStats *> sorted;
+  getLaunchStatsTable().forEach([&sorted](const LaunchStats &stats) {
+    if (stats.launches.load(std::memory_order_relaxed) != 0)
+      sorted.push_back(&stats);
+  });
+
+  std::sort(sorted.begin(), sorted.end(), [&kernelNames](const LaunchStats *a, const LaunchStats *b) {
+    if (a->key.kernelId != b->key.kernelId)
+      return kernelNames[a->key.kernelId] < kernelNames[b->key.kernelId];
+    if (!(a->key.shape == b->key.shape))
+      return a->key.shape < b->key.shape;
+    return a->key.callSite < b->key.callSite;
+  });
+  return sorted;
+}
+
+static void printPercentiles(const char *label, const LatencyHistogram &histogram) {
+  std::cerr << label << " percentiles :";
+  for (double percentile : {50.0, 90.0, 99.0, 99.9})
+    std::cerr << " p" << percentile << " " << histogram.getPercentile(percentile) / 1e6 << " ms";
+  std::cerr << '\n';
+}
+
+static void writeAggregates(const std::string &filePath) {
+  auto &kernelNames = getInstrumentedKernelNames();
+  auto &instrumentationVarTableEntries = getInstrumentationVarTableEntries();
+
+  std::vector<CounterFileRecord> records;
+  CounterFileNames names;
+  for (const LaunchStats *stats : getSortedLaunchStats()) {
+    const std::string &kernelName = kernelNames[stats->key.kernelId];
+    uint64_t kernelHash = hashKernelName(kernelName);
+    names.kernels[kernelHash] = kernelName;
+    for (size_t i = 0; i < instrumentationVarTableEntries.size(); ++i) {
+      CounterFileRecord record = {};
+      record.kernelHash = kernelHash;
+      record.shape = stats->key.shape;
+      record.varIndex = i;
+      record.launches = stats->launches.load(std::memory_order_relaxed);
+      record.sum = stats->sums[i].load(std::memory_order_relaxed);
+      records.push_back(record);
+    }
+  }
+
+  for (auto &entry : instrumentationVarTableEntries)
+    names.vars.push_back(entry.name);
+
+  // Counter files don't distinguish call sites, add up their values.
+  std::sort(records.begin(), records.end());
+  size_t numUnique = 0;
+  for (size_t i = 0; i < records.size(); ++i) {
+    if (numUnique && records[numUnique - 1].sameKey(records[i])) {
+      records[numUnique - 1].launches += records[i].launches;
+      records[numUnique - 1].sum += records[i].sum;
+    } else {
+      records[numUnique++] = records[i];
+    }
+  }
+  records.resize(numUnique);
+
+  CounterFileHeader header = makeCounterFileHeader(getJobRank(), getpid(), getHostName());
+  if (!writeCounterFile(filePath, header, records, names))
+    std::cerr << "error : can't write counters to " << filePath << '\n';
+}
+
+static void flushAggregates() {
+  if (traceWriter.isOpen())
+    traceWriter.flush();
+
+  if (!counterOutputPath.empty()) {
+    writeAggregates(counterOutputPath);
+    return;
+  }
+
+  auto &kernelNames = getInstrumentedKernelNames();
+  auto &instrumentationVarTableEntries = getInstrumentationVarTableEntries();
+
+  for (const LaunchStats *stats : getSortedLaunchStats()) {
+    uint64_t launches = stats->launches.load(std::memory_order_relaxed);
+    double totalMs = stats->totalNs.load(std::memory_order_relaxed) / 1e6;
+    std::cerr << "Aggregated instrumentation variable values for " << kernelNames[stats->key.kernelId]
+              << stats->key.shape.format() << " (" << launches << " launches): \n";
+    if (callSiteDepth)
+      std::cerr << "Called from : " << getCallSiteTable().format(stats->key.callSite) << '\n';
+    std::cerr << "Runtime : total " << totalMs << " ms, mean " << totalMs / launches << " ms, min "
+              << stats->minNs.load(std::memory_order_relaxed) / 1e6 << " ms, max "
+              << stats->maxNs.load(std::memory_order_relaxed) / 1e6 << " ms\n";
+    printPercentiles("Runtime", *stats->gpuTimeHistogram);
+    printPercentiles("Interposer overhead", *stats->overheadHistogram);
+    for (size_t i = 0; i < instrumentationVarTableEntries.size(); ++i) {
+      std::cerr << instrumentationVarTableEntries[i].name << " = "
+                << stats->sums[i].load(std::memory_order_relaxed) << '\n';
+    }
+    std::cerr << '\n';
+  }
+
+  if (uint64_t overflow = getLaunchStatsTable().getOverflow()) {
+    std::cerr << overflow << " launches were not aggregated, increase " << shapesPerKernelEnv
+              << '\n';
+  }
+
+  stagingPools.forEach([](const StagingPool &pool) { pool.printStats(std::cerr); });
+}
+
+static std::string renderMetrics() {
+  auto &kernelNames = getInstrumentedKernelNames();
+  auto &varNames = instrumentationVarNames;
+  std::vector<const LaunchStats *> sorted = getSortedLaunchStats();
+
+  std::vector<LaunchStatsSnapshot> snapshots(sorted.size());
+  for (size_t i = 0; i < sorted.size(); ++i)
+    sorted[i]->snapshot(varNames.size(), snapshots[i], true);
+
+  MetricsPage page;
+  auto setLabels = [&](const LaunchKey &key) {
+    page.clearLabels();
+    page.label("kernel", kernelNames[key.kernelId]);
+    if (keyByShape) {
+      const LaunchShape &shape = key.shape;
+      page.label("grid", std::to_string(shape.grid[0]) + "," + std::to_string(shape.grid[1]) +
+                             "," + std::to_string(shape.grid[2]));
+      page.label("block", std::to_string(shape.block[0]) + "," + std::to_string(shape.block[1]) +
+                              "," + std::to_string(shape.block[2]));
+      page.label("shared_mem", std::to_string(shape.sharedMemBytes));
+    }
+    if (callSiteDepth)
+      page.label("call_site", getCallSiteTable().format(key.callSite));
+  };
+
+  page.family("dyninst_amdgpu_kernel_gpu_seconds", "summary",
+              "GPU time of instrumented launches.");
+  for (size_t i = 0; i < sorted.size(); ++i) {
+    setLabels(snapshots[i].key);
+    for (const char *quantile : {"0.5", "0.9", "0.99"}) {
+      double percentile = atof(quantile) * 100;
+      page.sample(
+          "dyninst_amdgpu_kernel_gpu_seconds",
+          LatencyHistogram::getPercentile(snapshots[i].gpuTimeCounts.data(), percentile) / 1e9,
+          "quantile", quantile);
+    }
+    page.sample("dyninst_amdgpu_kernel_gpu_seconds_sum", snapshots[i].totalNs / 1e9);
+    page.sample("dyninst_amdgpu_kernel_gpu_seconds_count", snapshots[i].launches);
+  }
+
+  page.family("dyninst_amdgpu_kernel_gpu_seconds_min", "gauge",
+              "Shortest GPU time of an instrumented launch.");
+  for (const LaunchStatsSnapshot &snapshot : snapshots) {
+    setLabels(snapshot.key);
+    page.sample("dyninst_amdgpu_kernel_gpu_seconds_min", snapshot.minNs / 1e9);
+  }
+
+  page.family("dyninst_amdgpu_kernel_gpu_seconds_max", "gauge",
+              "Longest GPU time of an instrumented launch.");
+  for (const LaunchStatsSnapshot &snapshot : snapshots) {
+    setLabels(snapshot.key);
+    page.sample("dyninst_amdgpu_kernel_gpu_seconds_max", snapshot.maxNs / 1e9);
+  }
+
+  page.family("dyninst_amdgpu_counter_total", "counter",
+              "Sum of an instrumentation variable over all launches.");
+  for (const LaunchStatsSnapshot &snapshot : snapshots) {
+    for (size_t v = 0; v < varNames.size(); ++v) {
+      setLabels(snapshot.key);
+      page.label("variable", varNames[v]);
+      page.sample("dyninst_amdgpu_counter_total", snapshot.sums[v]);
+    }
+  }
+
+  page.family("dyninst_amdgpu_unaggregated_launches_total", "counter",
+              "Launches that found the aggregation table full.");
+  page.clearLabels();
+  page.sample("dyninst_amdgpu_unaggregated_launches_total", getLaunchStatsTable().getOverflow());
+  return page.getText();
+}
+
+static void resetAggregates() {
+  getLaunchStatsTable().reset();
+  stagingPools.forEach([](StagingPool &pool) { pool.resetStats(); });
+}
+
 extern "C" hipError_t hipLaunchKernel(const void *hostFunction, dim3 gridDim,
                                       dim3 blockDim, void **args,
                                       size_t sharedMemBytes,
@@ -172,12 +588,21 @@ extern "C" hipError_t hipLaunchKernel(const void *hostFunction, dim3 gridDim,
   }
   assert(realLaunch != 0);
 
-  auto &kernargSizeMap = getKernargSizeMap();
-  auto &instrumentationVarTableEntries = getInstrumentationVarTableEntries();
+  // In census mode nothing is instrumented, launches are only counted and timed.
+  if (census.isEnabled()) {
+    auto launch = [&]() {
+      realLaunch(hostFunction, gridDim, blockDim, args, sharedMemBytes, stream);
+    };
+    if (CensusEntry *entry = census.getEntry(hostFunction))
+      census.launch(*entry, makeLaunchShape(gridDim, blockDim, sharedMemBytes), stream, launch);
+    else
+      launch();
+    return hipSuccess;
+  }
 
-  // Step 0. Get kernel name
-  auto iter = addressToKernelName.find(hostFunction);
-  if (iter == addressToKernelName.end()) {
+  // Step 0. Find the kernel, resolved when it was registered.
+  auto iter = registeredKernels.find(hostFunction);
+  if (iter == registeredKernels.end()) {
     std::cerr << "ERROR : kernel being launched wasn't registered by hipRegisterFunction\n"
               << "Doing regular launch...";
 
@@ -187,75 +612,199 @@ extern "C" hipError_t hipLaunchKernel(const void *hostFunction, dim3 gridDim,
     return hipSuccess;
   }
 
-  std::string kernelName = iter->second;
+  RegisteredKernel &kernel = iter->second;
 
   // Step 1. Check whether this is an instrumented kernel, i.e it should be in kernargSizeMapPath.
   // If not instrumented, just launch it.
-  auto it = kernargSizeMap.find(kernelName);
-  int kernargSize = it->second;
-  if (it == kernargSizeMap.end()) {
+  if (!kernel.isInstrumented) {
     // Do regular launch
-    std::cerr << kernelName << " is not instrumented. Doing regular launch\n";
+    if (!kernel.isReported.exchange(true, std::memory_order_relaxed))
+      std::cerr << kernel.name << " is not instrumented. Doing regular launches\n";
     realLaunch(hostFunction, gridDim, blockDim, args, sharedMemBytes, stream);
     return hipSuccess;
   }
 
-  // Step 2. Get size of instrumentation memory
-  // TODO: Use size
-  assert(!instrumentationVarTableEntries.empty());
-  InstrumentationVarTableEntry lastEntry = *(instrumentationVarTableEntries.end() - 1);
-  size_t allocSize = lastEntry.offset + 4;
-  unsigned *instrumentationDataHost = (unsigned *)calloc(1, allocSize);
-
-  std::cerr << '\n';
+  // Step 2. Check whether collection is enabled for this kernel. If not, launch it with the
+  // scratch buffer and skip the readback.
+  const CollectionConfig *config = getCollectionConfig();
+  int kernelId = kernel.info.kernelId;
+  if (!config->kernelEnabled[kernelId]) {
+    void *scratch = getScratchInstrumentationData();
+    realLaunch(hostFunction, gridDim, blockDim, makeInstrumentedArgs(args, kernel.info, &scratch),
+               sharedMemBytes, stream);
+    return hipSuccess;
+  }
 
-  unsigned *instrumentationDataDevice;
+  const std::string &kernelName = kernel.name;
+  auto &instrumentationVarTableEntries = getInstrumentationVarTableEntries();
 
-  hipError_t hip_ret = hipMalloc((void **)&instrumentationDataDevice, allocSize);
-  assert(hip_ret == hipSuccess);
+  // Everything from here on is interposer overhead, except for the kernel itself.
+  auto interposerStart = std::chrono::high_resolution_clock::now();
+
+  uint32_t callSite = 0;
+  if (callSiteDepth) {
+    CallStack callStack;
+    if (callSiteUnwind)
+      captureUnwindStack(callStack, callSiteDepth);
+    else
+      captureFramePointerStack(callStack, callSiteDepth);
+    callSite = getCallSiteTable().intern(callStack);
+  }
 
-  hip_ret = hipMemset(instrumentationDataDevice, 0, allocSize);
+  // Step 3. Get a staging buffer on this device
+  size_t allocSize = bufferLayout.getTotalBytes();
+  int device = 0;
+  hipGetDevice(&device);
+  StagingPool &stagingPool = stagingPools.get(device);
+  StagingBuffer staging = stagingPool.acquire();
+
+  // Variables start after the dirty-chunk header, if there is one.
+  unsigned *instrumentationDataHost =
+      reinterpret_cast<unsigned *>(static_cast<char *>(staging.host) + bufferLayout.headerBytes);
+  unsigned *instrumentationDataDevice =
+      reinterpret_cast<unsigned *>(static_cast<char *>(staging.device) + bufferLayout.headerBytes);
+  if (traceWriter.isOpen())
+    traceWriter.setNumaNode(stagingPool.getNumaNode());
+
+  // Progress messages are only for per-launch output, anything else would grow with the number
+  // of launches. The trace has the same per-launch information, without stalling on stderr.
+  bool isPerLaunch = config->mode == OutputMode::PerLaunch && !traceWriter.isOpen();
+  if (isPerLaunch)
+    std::cerr << '\n';
+
+  hipError_t hip_ret = hipMemset(staging.device, 0, allocSize);
 
   assert(hip_ret == hipSuccess);
 
-  int newKernargSize = kernargSize + sizeof(void *);
-  void **newArgs = (void **)malloc(newKernargSize);
+  void **newArgs = makeInstrumentedArgs(args, kernel.info, (void **)&instrumentationDataDevice);
 
-  memcpy(newArgs, args, kernargSize);
-
-  int newArgIndex = getFirstHiddenArgIndexMap()[kernelName];
-  newArgs[newArgIndex] = (void *)(&instrumentationDataDevice);
-
-  std::cerr << "Launching instrumented kernel : " << kernelName << '\n';
+  if (isPerLaunch)
+    std::cerr << "Launching instrumented kernel : " << kernelName << '\n';
 
+  LaunchEvents &events = getLaunchEvents();
   auto start = std::chrono::high_resolution_clock::now();
 
+  hipEventRecord(events.start, stream);
   realLaunch(hostFunction, gridDim, blockDim, newArgs, sharedMemBytes, stream);
+  hipEventRecord(events.stop, stream);
   assert(hipStreamSynchronize(stream) == hipSuccess);
 
   auto end = std::chrono::high_resolution_clock::now();
 
+  float gpuMs = 0;
+  hipEventElapsedTime(&gpuMs, events.start, events.stop);
+  uint64_t gpuNs = static_cast<uint64_t>(gpuMs * 1e6);
+
   std::chrono::duration<double, std::milli> elapsed = end - start;
-  std::cout << "Runtime : " << elapsed.count() << " ms\n";
+  if (isPerLaunch) {
+    std::cout << "Runtime : " << elapsed.count() << " ms\n";
+    std::cerr << "Kernel execution complete. Copying instrumentation variables to host...\n";
+  }
 
-  std::cerr << "Kernel execution complete. Copying instrumentation variables to host...\n";
+  auto copyStart = std::chrono::high_resolution_clock::now();
+  size_t copiedSize = allocSize;
+  if (bufferLayout.hasDirtyBitmap()) {
+    copiedSize = readDirtyChunks(bufferLayout, staging.host, staging.device, stream);
+  } else {
+    hip_ret = hipMemcpy(instrumentationDataHost, instrumentationDataDevice, /* size = */ allocSize,
+              hipMemcpyDeviceToHost);
+    assert(hip_ret == hipSuccess);
+  }
+  stagingPool.recordCopy(copiedSize, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                         std::chrono::high_resolution_clock::now() - copyStart)
+                                         .count());
+
+  if (isPerLaunch)
+    std::cerr << "Done.\n";
+
+  // Values in instrumentation variable table order, for the trace.
+  thread_local std::vector<uint32_t> values;
+  if (traceWriter.isOpen()) {
+    values.clear();
+    for (auto &entry : instrumentationVarTableEntries)
+      values.push_back(instrumentationDataHost[entry.offset / 4]);
+  }
 
-  hip_ret = hipMemcpy(instrumentationDataHost, instrumentationDataDevice, /* size = */ allocSize,
-            hipMemcpyDeviceToHost);
-  assert(hip_ret == hipSuccess);
+  // Values always go to the output file or metrics endpoint if there is one. They are printed or
+  // written at the next flush.
+  LaunchStats *stats = nullptr;
+  if (config->mode == OutputMode::Aggregate || !counterOutputPath.empty() || serveMetrics ||
+      !histogramOutputPath.empty() || snapshotWriter.isOpen()) {
+    LaunchKey key = makeLaunchKey(kernelId, callSite, gridDim, blockDim, sharedMemBytes);
+    if ((stats = getLaunchStatsTable().findOrInsert(key))) {
+      stats->beginUpdate();
+      stats->addLaunch(gpuNs);
+      for (size_t i = 0; i < instrumentationVarTableEntries.size(); ++i) {
+        stats->sums[i].fetch_add(instrumentationDataHost[instrumentationVarTableEntries[i].offset / 4],
+                                 std::memory_order_relaxed);
+      }
+      stats->endUpdate();
+    }
+  } else if (counterRing.isOpen()) {
+    publishInstrumentationData(kernelName, instrumentationDataHost);
+  } else if (isPerLaunch) {
+    std::cerr << "Instrumentation variable values: \n";
+    for (auto entry : instrumentationVarTableEntries) {
+      std::cerr << entry.name << " = " << instrumentationDataHost[entry.offset / 4] << '\n';
+    }
+    std::cerr << '\n';
+  }
 
-  std::cerr << "Done.\n";
-  std::cerr << "Instrumentation variable values: \n";
-  for (auto entry : instrumentationVarTableEntries) {
-    std::cerr << entry.name << " = " << instrumentationDataHost[entry.offset / 4] << '\n';
+  stagingPool.release(staging);
+
+  if (stats || traceWriter.isOpen()) {
+    auto interposerEnd = std::chrono::high_resolution_clock::now();
+    uint64_t totalNs =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(interposerEnd - interposerStart).count();
+    uint64_t overheadNs = totalNs > gpuNs ? totalNs - gpuNs : 0;
+
+    if (stats)
+      stats->addOverhead(overheadNs);
+
+    if (traceWriter.isOpen()) {
+      TraceEvent event = {};
+      event.kernelId = kernelId;
+      event.device = device;
+      event.stream = stream;
+      event.startNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          start.time_since_epoch()).count();
+      event.gpuNs = gpuNs;
+      event.overheadNs = overheadNs;
+      event.shape = makeLaunchShape(gridDim, blockDim, sharedMemBytes);
+      event.numValues = instrumentationVarTableEntries.size();
+      traceWriter.addEvent(event, values.data());
+    }
   }
-  std::cerr << '\n';
   return hipSuccess;
 }
 
 __attribute__((constructor)) void setup(void) {
   realLaunch = 0;
 
+  if (const char *histogramTemplate = getenv(histogramOutputEnv))
+    histogramOutputPath = expandOutputPath(histogramTemplate);
+
+  if (const char *censusTemplate = getenv(censusEnv)) {
+    const char *timeEvery = getenv(censusTimeEveryEnv);
+    const char *shapes = getenv(censusShapesEnv);
+    size_t shapeHistograms = 0;
+    if (!histogramOutputPath.empty())
+      shapeHistograms = shapes ? std::max(1, atoi(shapes)) : 4096;
+    census.init(timeEvery ? std::max(1, atoi(timeEvery)) : 1, shapeHistograms);
+    censusOutputPath = expandOutputPath(censusTemplate);
+    std::cerr << "LD_PRELOAD setup: census mode, writing profile to " << censusOutputPath << '\n';
+    return;
+  }
+
+#ifdef DYNINST_AMDGPU_GENERATED_TABLES
+  // Nothing to parse, the names are only copied for the output code that takes std::strings.
+  for (uint32_t i = 0; i < generatedTables.numKernels; ++i)
+    getInstrumentedKernelNames().emplace_back(generatedTables.kernels[i].name);
+  for (uint32_t i = 0; i < generatedTables.numVars; ++i) {
+    const GeneratedVar &var = generatedTables.vars[i];
+    getInstrumentationVarTableEntries().emplace_back(var.offset, std::string(var.name));
+  }
+#else
   const char *kernargSizeMapPath = getenv(instrumentedKernelNamesEnv);
   if (!kernargSizeMapPath) {
     std::cerr << "LD_PRELOAD setup: " << instrumentedKernelNamesEnv << " not defined\n";
@@ -270,4 +819,104 @@ __attribute__((constructor)) void setup(void) {
     exit(1);
   }
   readInstrumentedVarTable(tableFilePath);
+#endif
+
+  keyByShape = aggregateByShape();
+  if (const char *depth = getenv(callSiteDepthEnv))
+    callSiteDepth = std::min<unsigned>(std::max(0, atoi(depth)), CallStack::kMaxDepth);
+  callSiteUnwind = getenv(callSiteUnwindEnv) != nullptr;
+
+  size_t expectedKeys = getExpectedLaunchKeys(getInstrumentedKernelNames().size(), keyByShape,
+                                              callSiteDepth);
+  getLaunchStatsTable().init(expectedKeys, getInstrumentationVarTableEntries().size());
+  const char *dirtyChunk = getenv(dirtyChunkEnv);
+  bufferLayout = makeInstrumentationBufferLayout(getInstrumentationDataSize(),
+                                                 dirtyChunk ? std::max(0, atoi(dirtyChunk)) : 0);
+  stagingPools.init(bufferLayout.getTotalBytes());
+  if (callSiteDepth)
+    getCallSiteTable().init(2 * expectedKeys);
+
+  initCollectionConfig(getInstrumentedKernelNames(), flushAggregates, resetAggregates);
+
+  for (auto &registered : registeredKernels)
+    resolveRegisteredKernel(registered.second);
+  instrumentedKernelsLoaded = true;
+
+  if (const char *outputTemplate = getenv(counterOutputEnv)) {
+    counterOutputPath = expandOutputPath(outputTemplate);
+    std::cerr << "LD_PRELOAD setup: writing counters to " << counterOutputPath << '\n';
+  }
+
+  for (auto &entry : getInstrumentationVarTableEntries())
+    instrumentationVarNames.push_back(entry.name);
+
+  if (const char *traceTemplate = getenv(traceOutputEnv)) {
+    std::string tracePath = expandOutputPath(traceTemplate);
+    if (traceWriter.open(tracePath, getInstrumentedKernelNames(), instrumentationVarNames))
+      std::cerr << "LD_PRELOAD setup: writing trace to " << tracePath << '\n';
+    else
+      std::cerr << "LD_PRELOAD setup: can't create " << tracePath << '\n';
+  }
+
+  if (const char *controlSocketPath = getenv(controlSocketEnv))
+    startControlServer(controlSocketPath);
+
+  if (const char *metricsAddr = getenv(metricsAddrEnv))
+    serveMetrics = startMetricsServer(metricsAddr, renderMetrics);
+
+  if (const char *snapshotTemplate = getenv(snapshotOutputEnv)) {
+    std::string snapshotPath = expandOutputPath(snapshotTemplate);
+    const char *interval = getenv(snapshotIntervalEnv);
+    auto describeKey = [](const LaunchKey &key, std::string &kernelName, std::string &callSite) {
+      kernelName = getInstrumentedKernelNames()[key.kernelId];
+      callSite = callSiteDepth ? getCallSiteTable().format(key.callSite) : "";
+    };
+    if (snapshotWriter.open(snapshotPath, interval ? std::max(1, atoi(interval)) : 1000,
+                            getLaunchStatsTable(), instrumentationVarNames, describeKey))
+      std::cerr << "LD_PRELOAD setup: writing snapshots to " << snapshotPath << '\n';
+    else
+      std::cerr << "LD_PRELOAD setup: can't create " << snapshotPath << '\n';
+  }
+
+  if (const char *ringName = getenv(counterRingEnv)) {
+    if (counterRing.attach(ringName))
+      std::cerr << "LD_PRELOAD setup: publishing counters to " << ringName << '\n';
+    else
+      std::cerr << "LD_PRELOAD setup: can't attach to " << ringName << ", printing counters\n";
+  }
+}
+
+// Values aggregated since the last flush would otherwise be lost at exit.
+__attribute__((destructor)) void teardown(void) {
+  HistogramFileHeader histogramHeader = makeHistogramFileHeader(
+      census.isEnabled() ? HistogramSource::Census : HistogramSource::Instrumented, getJobRank(),
+      getpid(), getHostName());
+
+  if (census.isEnabled()) {
+    if (!census.writeProfile(censusOutputPath))
+      std::cerr << "error : can't write census profile to " << censusOutputPath << '\n';
+    if (!histogramOutputPath.empty() &&
+        !census.writeHistograms(histogramOutputPath, histogramHeader))
+      std::cerr << "error : can't write histograms to " << histogramOutputPath << '\n';
+    return;
+  }
+
+  removeMetricsSocket();
+  flushAggregates();
+  traceWriter.close();
+  if (traceWriter.getDroppedEvents())
+    std::cerr << "LD_PRELOAD teardown: the trace writer fell behind, "
+              << traceWriter.getDroppedEvents() << " launches are missing from the trace\n";
+  snapshotWriter.close();
+
+  if (!histogramOutputPath.empty()) {
+    auto &kernelNames = getInstrumentedKernelNames();
+    std::unordered_map<uint64_t, std::string> histogramKernelNames;
+    std::vector<HistogramFileRecord> records = makeHistogramRecords(
+        getLaunchStatsTable(),
+        [&kernelNames](uint32_t id) -> const std::string & { return kernelNames[id]; },
+        histogramKernelNames);
+    if (!writeHistogramFile(histogramOutputPath, histogramHeader, records, histogramKernelNames))
+      std::cerr << "error : can't write histograms to " << histogramOutputPath << '\n';
+  }
 }
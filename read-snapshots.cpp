@@ -0,0 +1,217 @@
+#include "snapshot-records.h"
+
+#include <msgpack.hpp>
+#include <zlib.h>
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+// This tool expands the compressed snapshot files written by the preload library with
+// DYNINST_AMDGPU_SNAPSHOTS set (see snapshot-records.h), and prints the aggregated values.
+//
+// usage:
+// read-snapshots [--all] [--stats] <snapshot-file>
+//
+// By default only the values as of the last snapshot are printed. --all prints the values after
+// every snapshot, --stats prints the compressed and expanded size of every snapshot.
+
+static void showHelp(const char *toolName) {
+  std::cerr << "usage : \n";
+  std::cerr << "  ";
+  std::cerr << toolName << " [--all] [--stats] <snapshot-file>\n\n";
+  std::cerr << toolName << " prints the aggregated values stored in a snapshot file\n";
+  std::cerr << "  --all prints the values after every snapshot instead of only the last\n";
+  std::cerr << "  --stats prints the size of every snapshot\n";
+}
+
+struct KeyValues {
+  std::string kernelName;
+  std::string shape;
+  std::string callSite;
+  uint64_t launches = 0;
+  uint64_t totalNs = 0;
+  uint64_t minNs = 0;
+  uint64_t maxNs = 0;
+  std::vector<uint64_t> sums;
+};
+
+struct SnapshotState {
+  std::vector<std::string> varNames;
+  std::map<uint32_t, KeyValues> keys;
+};
+
+static std::string formatShape(const std::vector<uint64_t> &shape) {
+  bool empty = true;
+  for (uint64_t value : shape)
+    empty &= value == 0;
+  if (empty || shape.size() != 7)
+    return "";
+  return " grid (" + std::to_string(shape[0]) + ", " + std::to_string(shape[1]) + ", " +
+         std::to_string(shape[2]) + ") block (" + std::to_string(shape[3]) + ", " +
+         std::to_string(shape[4]) + ", " + std::to_string(shape[5]) + ") shared " +
+         std::to_string(shape[6]);
+}
+
+// Applies one expanded snapshot to state. Returns the sequence number and time of the snapshot.
+static void applySnapshot(const msgpack::object &frame, SnapshotState &state, uint64_t &sequence,
+                          uint64_t &timeNs) {
+  if (frame.type != msgpack::type::ARRAY || frame.via.array.size != 5)
+    throw msgpack::type_error();
+  const msgpack::object *fields = frame.via.array.ptr;
+
+  sequence = fields[0].as<uint64_t>();
+  timeNs = fields[1].as<uint64_t>();
+
+  std::vector<std::string> varNames = fields[2].as<std::vector<std::string>>();
+  if (!varNames.empty())
+    state.varNames = varNames;
+
+  for (const msgpack::object &newKey : fields[3].as<std::vector<msgpack::object>>()) {
+    auto values = newKey.as<std::vector<msgpack::object>>();
+    if (values.size() != 4)
+      throw msgpack::type_error();
+    KeyValues &key = state.keys[values[0].as<uint32_t>()];
+    key.kernelName = values[1].as<std::string>();
+    key.shape = formatShape(values[2].as<std::vector<uint64_t>>());
+    key.callSite = values[3].as<std::string>();
+    key.sums.assign(state.varNames.size(), 0);
+  }
+
+  for (const msgpack::object &change : fields[4].as<std::vector<msgpack::object>>()) {
+    auto values = change.as<std::vector<msgpack::object>>();
+    if (values.size() != 6)
+      throw msgpack::type_error();
+    KeyValues &key = state.keys[values[0].as<uint32_t>()];
+    key.launches += values[1].as<int64_t>();
+    key.totalNs += values[2].as<int64_t>();
+    key.minNs = values[3].as<uint64_t>();
+    key.maxNs = values[4].as<uint64_t>();
+
+    auto sumDeltas = values[5].as<std::vector<int64_t>>();
+    for (size_t i = 0; i + 1 < sumDeltas.size(); i += 2) {
+      uint64_t varIndex = sumDeltas[i];
+      if (varIndex >= key.sums.size())
+        key.sums.resize(varIndex + 1, 0);
+      key.sums[varIndex] += sumDeltas[i + 1];
+    }
+  }
+}
+
+static void printState(const SnapshotState &state, uint64_t sequence, uint64_t timeNs) {
+  std::cout << "Snapshot " << sequence << " at " << timeNs / 1000000000 << "."
+            << (timeNs / 1000000) % 1000 << '\n';
+  for (auto &it : state.keys) {
+    const KeyValues &key = it.second;
+    if (key.launches == 0)
+      continue;
+    std::cout << key.kernelName << key.shape << " (" << key.launches << " launches)\n";
+    if (!key.callSite.empty())
+      std::cout << "Called from : " << key.callSite << '\n';
+    std::cout << "Runtime : total " << key.totalNs / 1e6 << " ms, min " << key.minNs / 1e6
+              << " ms, max " << key.maxNs / 1e6 << " ms\n";
+    for (size_t v = 0; v < key.sums.size(); ++v) {
+      std::cout << (v < state.varNames.size() ? state.varNames[v] : std::to_string(v)) << " = "
+                << key.sums[v] << '\n';
+    }
+    std::cout << '\n';
+  }
+}
+
+int main(int argc, char **argv) {
+  bool printAll = false;
+  bool printStats = false;
+  std::string inputPath;
+
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg == "--all") {
+      printAll = true;
+    } else if (arg == "--stats") {
+      printStats = true;
+    } else if (arg[0] == '-' || !inputPath.empty()) {
+      showHelp(argv[0]);
+      exit(1);
+    } else {
+      inputPath = arg;
+    }
+  }
+
+  if (inputPath.empty()) {
+    showHelp(argv[0]);
+    exit(1);
+  }
+
+  std::ifstream file(inputPath, std::ios::binary);
+  if (!file) {
+    std::cerr << "error : can't open " << inputPath << std::endl;
+    exit(1);
+  }
+
+  char magic[sizeof(snapshotFileMagic)];
+  if (!file.read(magic, sizeof(magic)) || memcmp(magic, snapshotFileMagic, sizeof(magic)) != 0) {
+    std::cerr << "error : " << inputPath << " is not a snapshot file" << std::endl;
+    exit(1);
+  }
+
+  SnapshotState state;
+  uint64_t sequence = 0, timeNs = 0;
+  uint64_t numSnapshots = 0, compressedTotal = 0, rawTotal = 0;
+  std::vector<char> compressed, raw;
+  SnapshotFrameHeader header;
+  while (file.read(reinterpret_cast<char *>(&header), sizeof(header))) {
+    compressed.resize(header.compressedSize);
+    raw.resize(header.rawSize);
+    if (!file.read(compressed.data(), compressed.size())) {
+      // The process may have been killed while writing the last snapshot.
+      std::cerr << "warning : " << inputPath << " ends in a truncated snapshot\n";
+      break;
+    }
+
+    uLongf rawSize = raw.size();
+    if (uncompress(reinterpret_cast<Bytef *>(raw.data()), &rawSize,
+                   reinterpret_cast<const Bytef *>(compressed.data()), compressed.size()) != Z_OK ||
+        rawSize != raw.size()) {
+      std::cerr << "error : snapshot " << numSnapshots << " of " << inputPath
+                << " can't be expanded" << std::endl;
+      exit(1);
+    }
+
+    try {
+      msgpack::object_handle handle = msgpack::unpack(raw.data(), raw.size());
+      applySnapshot(handle.get(), state, sequence, timeNs);
+    } catch (const std::exception &e) {
+      std::cerr << "error : snapshot " << numSnapshots << " of " << inputPath
+                << " is malformed : " << e.what() << std::endl;
+      exit(1);
+    }
+
+    if (printStats) {
+      std::cout << "Snapshot " << sequence << " : " << header.compressedSize << " bytes, "
+                << header.rawSize << " expanded\n";
+    }
+    if (printAll)
+      printState(state, sequence, timeNs);
+
+    ++numSnapshots;
+    compressedTotal += header.compressedSize + sizeof(header);
+    rawTotal += header.rawSize;
+  }
+
+  if (numSnapshots == 0) {
+    std::cerr << "error : " << inputPath << " has no snapshots" << std::endl;
+    exit(1);
+  }
+
+  if (!printAll)
+    printState(state, sequence, timeNs);
+  if (printStats) {
+    std::cout << numSnapshots << " snapshots, " << compressedTotal << " bytes, " << rawTotal
+              << " expanded\n";
+  }
+  return 0;
+}
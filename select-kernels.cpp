@@ -0,0 +1,140 @@
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// This tool picks the kernels worth instrumenting from census profiles written by preload.so with
+// DYNINST_AMDGPU_CENSUS set (see preload-census.h), and writes their names one per line.
+//
+// usage:
+// select-kernels (--top <n> | --percent <x>) [-o <names-file>] <profile>...
+//
+// --top <n> selects the n kernels with the most GPU time, --percent <x> the fewest kernels that
+// together account for at least x% of the GPU time. Profiles of several ranks or runs are added up
+// by kernel name first.
+
+static void showHelp(const char *toolName) {
+  std::cerr << "usage : \n";
+  std::cerr << "  ";
+  std::cerr << toolName << " (--top <n> | --percent <x>) [-o <names-file>] <profile>...\n\n";
+  std::cerr << toolName << " writes the names of the kernels with the most GPU time in the given "
+            << "census profiles\n";
+}
+
+struct KernelProfile {
+  std::string name;
+  uint64_t gpuNs = 0;
+  uint64_t launches = 0;
+};
+
+// Adds the kernels of a census profile to profiles.
+static void readProfile(const std::string &filePath, std::vector<KernelProfile> &profiles,
+                        std::unordered_map<std::string, size_t> &indexByName) {
+  std::ifstream file(filePath);
+  if (!file) {
+    std::cerr << "error : can't open " << filePath << std::endl;
+    exit(1);
+  }
+
+  std::string line;
+  size_t lineNumber = 0;
+  while (std::getline(file, line)) {
+    ++lineNumber;
+    if (line.empty() || line[0] == '#')
+      continue;
+
+    // <rank> <gpu ns> <percent> <cumulative percent> <launches> <timed launches> <kernel name>
+    std::stringstream ss(line);
+    uint64_t rank, gpuNs, launches, timedLaunches;
+    double percent, cumulativePercent;
+    std::string name;
+    if (!(ss >> rank >> gpuNs >> percent >> cumulativePercent >> launches >> timedLaunches >>
+          name)) {
+      std::cerr << "error : " << filePath << ":" << lineNumber << " is not a census profile line"
+                << std::endl;
+      exit(1);
+    }
+
+    auto inserted = indexByName.emplace(name, profiles.size());
+    if (inserted.second)
+      profiles.push_back({name, 0, 0});
+    KernelProfile &profile = profiles[inserted.first->second];
+    profile.gpuNs += gpuNs;
+    profile.launches += launches;
+  }
+}
+
+int main(int argc, char **argv) {
+  long top = -1;
+  double percent = -1;
+  std::string outputPath;
+  std::vector<std::string> inputPaths;
+
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--top" && i + 1 < argc) {
+      top = std::stol(argv[++i]);
+    } else if (arg == "--percent" && i + 1 < argc) {
+      percent = std::stod(argv[++i]);
+    } else if (arg == "-o" && i + 1 < argc) {
+      outputPath = argv[++i];
+    } else if (arg[0] == '-') {
+      showHelp(argv[0]);
+      exit(1);
+    } else {
+      inputPaths.push_back(arg);
+    }
+  }
+
+  if (inputPaths.empty() || (top < 0) == (percent < 0) || percent > 100) {
+    showHelp(argv[0]);
+    exit(1);
+  }
+
+  std::vector<KernelProfile> profiles;
+  std::unordered_map<std::string, size_t> indexByName;
+  for (auto &inputPath : inputPaths)
+    readProfile(inputPath, profiles, indexByName);
+
+  std::sort(profiles.begin(), profiles.end(), [](const KernelProfile &a, const KernelProfile &b) {
+    if (a.gpuNs != b.gpuNs)
+      return a.gpuNs > b.gpuNs;
+    return a.name < b.name;
+  });
+
+  uint64_t totalNs = 0;
+  for (auto &profile : profiles)
+    totalNs += profile.gpuNs;
+
+  size_t numSelected = 0;
+  uint64_t selectedNs = 0;
+  if (top >= 0) {
+    numSelected = std::min<size_t>(top, profiles.size());
+    for (size_t i = 0; i < numSelected; ++i)
+      selectedNs += profiles[i].gpuNs;
+  } else {
+    while (numSelected < profiles.size() && selectedNs < percent / 100.0 * totalNs)
+      selectedNs += profiles[numSelected++].gpuNs;
+  }
+
+  std::ofstream outputFile;
+  if (!outputPath.empty()) {
+    outputFile.open(outputPath);
+    if (!outputFile) {
+      std::cerr << "error : can't create " << outputPath << std::endl;
+      exit(1);
+    }
+  }
+  std::ostream &output = outputPath.empty() ? std::cout : outputFile;
+  for (size_t i = 0; i < numSelected; ++i)
+    output << profiles[i].name << '\n';
+
+  std::cerr << "selected " << numSelected << " of " << profiles.size() << " kernels, "
+            << (totalNs ? 100.0 * selectedNs / totalNs : 0.0) << "% of " << totalNs / 1e6
+            << " ms GPU time\n";
+  return 0;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+// Periodic counter snapshots written by the preload library and expanded by read-snapshots.
+//
+// A snapshot file is the magic followed by one frame per snapshot:
+//
+//   SnapshotFrameHeader
+//   char data[compressedSize]   a complete zlib stream of rawSize bytes of msgpack
+//
+// Every frame holds one msgpack array:
+//
+//   [sequence, timeNs, varNames, newKeys, changes]
+//
+//   sequence  snapshot number, starting at 0
+//   timeNs    CLOCK_REALTIME of the snapshot
+//   varNames  the instrumentation variable names in the first frame, [] afterwards
+//   newKeys   keys first seen in this snapshot, each
+//             [keyIndex, kernelName, [grid x, y, z, block x, y, z, shared mem], callSite]
+//   changes   keys whose values changed since the previous snapshot, each
+//             [keyIndex, launches delta, totalNs delta, minNs, maxNs, [varIndex, sum delta, ...]]
+//
+// Deltas are signed, since aggregated values can be reset through the control socket. Keys and
+// variables that didn't change aren't written at all, so snapshots of a workload that launches a
+// few kernels over and over stay small.
+
+#include <cstdint>
+
+static constexpr char snapshotFileMagic[8] = {'D', 'Y', 'N', 'S', 'N', 'P', '0', '1'};
+
+struct SnapshotFrameHeader {
+  uint32_t compressedSize;
+  uint32_t rawSize;
+};
@@ -0,0 +1,265 @@
+#pragma once
+
+// AMDGPU target ids and the ids of offload bundle entries.
+//
+// A bundle entry id is <offload kind>-<triple>-<target id>, where the triple has four components
+// (the environment is usually empty), e.g.
+//
+//   hipv4-amdgcn-amd-amdhsa--gfx90a:sramecc+:xnack-
+//   kind  triple             target id
+//
+// A target id is a processor followed by features that are either on (+) or off (-). A feature
+// that isn't mentioned is "any": the code object runs with the feature on or off. The processor
+// may be a generic target such as gfx9-generic, whose code objects run on every processor of the
+// family.
+//
+// Matching follows the HIP runtime when it picks the code object to load: the processor has to be
+// the same or covered by the generic target, and no feature may contradict the request. Among the
+// compatible entries, specific processors beat generic ones, and entries whose features say the
+// same as the request beat those that say less, which beat those that say more. If different code
+// objects are equally good, e.g. gfx90a:xnack+ and gfx90a:xnack- for gfx90a, the one that runs
+// depends on the device, so the request is ambiguous.
+
+#include "offload-bundle.h"
+
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+enum class TargetFeature : uint8_t { Any, On, Off };
+
+struct TargetId {
+  std::string processor;
+  std::vector<std::pair<std::string, TargetFeature>> features; // sorted by name, no Any
+
+  // Parses e.g. gfx90a:sramecc+:xnack-. Returns false if str isn't a target id.
+  static bool parse(std::string_view str, TargetId &id) {
+    id = TargetId();
+    size_t colon = str.find(':');
+    id.processor = std::string(str.substr(0, colon));
+    if (id.processor.empty())
+      return false;
+
+    while (colon != std::string_view::npos) {
+      str = str.substr(colon + 1);
+      colon = str.find(':');
+      std::string_view feature = str.substr(0, colon);
+      if (feature.size() < 2 || (feature.back() != '+' && feature.back() != '-'))
+        return false;
+      std::string name(feature.substr(0, feature.size() - 1));
+      if (id.getFeature(name) != TargetFeature::Any)
+        return false;
+      id.features.emplace_back(name,
+                               feature.back() == '+' ? TargetFeature::On : TargetFeature::Off);
+    }
+    std::sort(id.features.begin(), id.features.end());
+    return true;
+  }
+
+  TargetFeature getFeature(const std::string &name) const {
+    for (auto &feature : features) {
+      if (feature.first == name)
+        return feature.second;
+    }
+    return TargetFeature::Any;
+  }
+
+  bool isGeneric() const {
+    return processor.size() > 8 && processor.compare(processor.size() - 8, 8, "-generic") == 0;
+  }
+
+  std::string format() const {
+    std::string str = processor;
+    for (auto &feature : features)
+      str += ":" + feature.first + (feature.second == TargetFeature::On ? "+" : "-");
+    return str;
+  }
+
+  bool operator==(const TargetId &other) const {
+    return processor == other.processor && features == other.features;
+  }
+};
+
+// Whether code objects for the generic target run on processor. From the generic processor
+// versions in LLVM's AMDGPUUsage.
+inline bool isCoveredByGenericTarget(const std::string &processor, const std::string &generic) {
+  static const std::pair<const char *, std::vector<const char *>> genericTargets[] = {
+      {"gfx9-generic", {"gfx900", "gfx902", "gfx904", "gfx906", "gfx909", "gfx90c"}},
+      {"gfx9-4-generic", {"gfx940", "gfx941", "gfx942", "gfx950"}},
+      {"gfx10-1-generic", {"gfx1010", "gfx1011", "gfx1012", "gfx1013"}},
+      {"gfx10-3-generic",
+       {"gfx1030", "gfx1031", "gfx1032", "gfx1033", "gfx1034", "gfx1035", "gfx1036"}},
+      {"gfx11-generic",
+       {"gfx1100", "gfx1101", "gfx1102", "gfx1103", "gfx1150", "gfx1151", "gfx1152", "gfx1153"}},
+      {"gfx12-generic", {"gfx1200", "gfx1201"}},
+  };
+  for (auto &target : genericTargets) {
+    if (generic == target.first)
+      return std::find(target.second.begin(), target.second.end(), processor) !=
+             target.second.end();
+  }
+  return false;
+}
+
+// How well a code object for entry fits a request for query, higher is better, or -1 if it
+// can't run there.
+inline int getTargetMatchRank(const TargetId &entry, const TargetId &query) {
+  int rank = 1000;
+  if (entry.processor != query.processor) {
+    if (!entry.isGeneric() || !isCoveredByGenericTarget(query.processor, entry.processor))
+      return -1;
+    rank = 500;
+  }
+
+  // Agreeing (including both "any") costs nothing. An entry that is "any" where the request says
+  // on or off costs 1, an entry that assumes a setting the request leaves open costs 2, since it
+  // may not match the device. Contradicting disqualifies.
+  std::vector<std::string> names;
+  for (auto &feature : entry.features)
+    names.push_back(feature.first);
+  for (auto &feature : query.features)
+    names.push_back(feature.first);
+  std::sort(names.begin(), names.end());
+  names.erase(std::unique(names.begin(), names.end()), names.end());
+
+  for (const std::string &name : names) {
+    TargetFeature entryFeature = entry.getFeature(name);
+    TargetFeature queryFeature = query.getFeature(name);
+    if (entryFeature == queryFeature)
+      continue;
+    if (entryFeature == TargetFeature::Any)
+      rank -= 1;
+    else if (queryFeature == TargetFeature::Any)
+      rank -= 2;
+    else
+      return -1;
+  }
+  return rank;
+}
+
+struct BundleEntryId {
+  std::string_view kind;
+  std::string_view triple;
+  TargetId target; // empty processor if the entry has no target id, e.g. the host entry
+
+  // Parses e.g. hipv4-amdgcn-amd-amdhsa--gfx908. Older toolchains wrote three-part triples
+  // (hip-amdgcn-amd-amdhsa-gfx906), recognized by a processor where the environment would be.
+  // Returns false if id has no triple.
+  static bool parse(std::string_view id, BundleEntryId &entryId) {
+    entryId = BundleEntryId();
+    size_t kindEnd = id.find('-');
+    if (kindEnd == std::string_view::npos)
+      return false;
+    entryId.kind = id.substr(0, kindEnd);
+
+    // The dash after the os, i.e. before the environment.
+    size_t pos = kindEnd;
+    for (int component = 0; component < 3; ++component) {
+      pos = id.find('-', pos + 1);
+      if (pos == std::string_view::npos)
+        return false;
+    }
+
+    size_t tripleEnd = id.find('-', pos + 1);
+    size_t targetStart = tripleEnd == std::string_view::npos ? id.size() : tripleEnd + 1;
+    if (id.compare(pos + 1, 3, "gfx") == 0) {
+      tripleEnd = pos;
+      targetStart = pos + 1;
+    } else if (tripleEnd == std::string_view::npos) {
+      tripleEnd = id.size();
+    }
+
+    entryId.triple = id.substr(kindEnd + 1, tripleEnd - kindEnd - 1);
+    if (targetStart < id.size() && !TargetId::parse(id.substr(targetStart), entryId.target))
+      return false;
+    return true;
+  }
+
+  bool isDeviceEntry() const { return kind != "host" && !target.processor.empty(); }
+};
+
+// Parses a target requested on the command line, either a target id (gfx908, gfx90a:xnack+) or a
+// whole bundle entry id.
+inline bool parseRequestedTarget(const std::string &arg, TargetId &target) {
+  if (arg.find("--") != std::string::npos) {
+    BundleEntryId entryId;
+    if (!BundleEntryId::parse(arg, entryId) || !entryId.isDeviceEntry())
+      return false;
+    target = entryId.target;
+    return true;
+  }
+  return TargetId::parse(arg, target);
+}
+
+// The parsed ids of the device entries of a bundle, for repeated lookups.
+class TargetIndex {
+public:
+  explicit TargetIndex(const OffloadBundleFile &fatbin_) : fatbin(fatbin_) {
+    const std::vector<OffloadBundleEntry> &entries = fatbin.getEntries();
+    for (size_t i = 0; i < entries.size(); ++i) {
+      BundleEntryId entryId;
+      if (BundleEntryId::parse(entries[i].id, entryId) && entryId.isDeviceEntry())
+        targets.push_back({i, std::move(entryId.target), &entries[i]});
+    }
+  }
+
+  // Sets index to the best compatible entry, or -1 if there is none. An entry with exactly the
+  // requested target id always wins. Equally good entries are only accepted if they hold the same
+  // code object, otherwise the error lists them. Returns an error message, or an empty string on
+  // success.
+  std::string findBest(const TargetId &query, int &index) const {
+    index = -1;
+    int bestRank = -1;
+    std::vector<const Target *> best;
+    for (auto &target : targets) {
+      int rank = getTargetMatchRank(target.target, query);
+      if (rank < 0 || rank < bestRank)
+        continue;
+      if (rank > bestRank)
+        best.clear();
+      bestRank = rank;
+      best.push_back(&target);
+    }
+    if (best.empty())
+      return "";
+
+    for (const Target *target : best) {
+      if (!isSameCodeObject(*target->entry, *best.front()->entry)) {
+        std::string error = query.format() + " matches several code objects equally well (";
+        for (const Target *candidate : best)
+          error += (candidate == best.front() ? "" : ", ") + std::string(candidate->entry->id);
+        return error + "), pass one of their target ids instead";
+      }
+    }
+    index = best.front()->entryIndex;
+    return "";
+  }
+
+  // Target id of an entry, nullptr for entries that aren't device code objects.
+  const TargetId *getTarget(size_t entryIndex) const {
+    for (auto &target : targets) {
+      if (target.entryIndex == entryIndex)
+        return &target.target;
+    }
+    return nullptr;
+  }
+
+private:
+  struct Target {
+    size_t entryIndex;
+    TargetId target;
+    const OffloadBundleEntry *entry;
+  };
+
+  // Compared through a fixed size buffer rather than the mapping, which would fault in both code
+  // objects.
+  bool isSameCodeObject(const OffloadBundleEntry &a, const OffloadBundleEntry &b) const {
+    return a.contents.size == b.contents.size &&
+           isSameContents(fatbin.getRange(a), fatbin.getRange(b));
+  }
+
+  const OffloadBundleFile &fatbin;
+  std::vector<Target> targets;
+};
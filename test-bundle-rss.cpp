@@ -0,0 +1,158 @@
+#include "offload-bundle.h"
+
+#include <iostream>
+#include <string>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <vector>
+
+// usage:
+// test-bundle-rss <extract-gpubin> <update-fatbin> <work-dir>
+//
+// Runs extract-gpubin --all and update-fatbin, in place and with --rebuild, on a sparse bundle
+// with a 2 GiB code object, and fails if the peak RSS of any of them goes over kRssCeiling.
+// The tools copy code objects between files without holding them in memory, so their peak RSS
+// doesn't depend on the size of the code objects. The files are written to <work-dir> and
+// removed at the end.
+
+static constexpr uint64_t kCodeObjectSize = 2ull << 30;
+static constexpr long kRssCeilingKb = 64 * 1024;
+
+static constexpr char kHostId[] = "host-x86_64-unknown-linux-gnu-";
+static constexpr char kDeviceId[] = "hipv4-amdgcn-amd-amdhsa--gfx908";
+
+// Written at the start and the end of the code object, so that a copy can be told apart from
+// the zeros of a hole.
+static constexpr char kHeadMarker[] = "\x7f" "ELF head";
+static constexpr char kTailMarker[] = "tail";
+
+// The bundle, with the host entry first as clang writes it, and the code object as a hole
+// between the markers.
+static bool writeBundle(const std::string &path) {
+  std::string header(offloadBundleMagic, sizeof(offloadBundleMagic));
+  auto append = [&header](uint64_t value) {
+    header.append(reinterpret_cast<const char *>(&value), sizeof(value));
+  };
+  append(2);
+  append(kOffloadBundleAlignment);
+  append(0);
+  append(sizeof(kHostId) - 1);
+  header += kHostId;
+  append(kOffloadBundleAlignment);
+  append(kCodeObjectSize);
+  append(sizeof(kDeviceId) - 1);
+  header += kDeviceId;
+
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return false;
+  uint64_t end = kOffloadBundleAlignment + kCodeObjectSize;
+  bool ok = ftruncate(fd, end) == 0 && writeAt(fd, header.data(), header.size(), 0) &&
+            writeAt(fd, kHeadMarker, sizeof(kHeadMarker), kOffloadBundleAlignment) &&
+            writeAt(fd, kTailMarker, sizeof(kTailMarker), end - sizeof(kTailMarker));
+  return close(fd) == 0 && ok;
+}
+
+// Whether range holds the code object of writeBundle. Only the markers are read.
+static bool isCodeObject(const FileRange &range) {
+  char head[sizeof(kHeadMarker)], tail[sizeof(kTailMarker)];
+  return range.size == kCodeObjectSize &&
+         pread(range.fd, head, sizeof(head), range.offset) == sizeof(head) &&
+         pread(range.fd, tail, sizeof(tail), range.offset + range.size - sizeof(tail)) ==
+             sizeof(tail) &&
+         memcmp(head, kHeadMarker, sizeof(head)) == 0 &&
+         memcmp(tail, kTailMarker, sizeof(tail)) == 0;
+}
+
+// Whether path is a bundle with the entries of writeBundle.
+static bool isBundle(const std::string &path) {
+  OffloadBundleFile bundle;
+  if (!bundle.open(path).empty() || bundle.getEntries().size() != 2)
+    return false;
+  const OffloadBundleEntry &device = bundle.getEntries()[1];
+  return device.id == kDeviceId && isCodeObject(bundle.getRange(device));
+}
+
+// Runs a tool and checks its exit status and peak RSS.
+static bool run(const std::vector<std::string> &args) {
+  std::string command;
+  std::vector<char *> argv;
+  for (const std::string &arg : args) {
+    command += (command.empty() ? "" : " ") + arg;
+    argv.push_back(const_cast<char *>(arg.c_str()));
+  }
+  argv.push_back(nullptr);
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    std::cerr << "error : can't fork" << std::endl;
+    return false;
+  }
+  if (pid == 0) {
+    // The tools' own output isn't checked.
+    int devNull = open("/dev/null", O_WRONLY);
+    dup2(devNull, STDOUT_FILENO);
+    execv(argv[0], argv.data());
+    _exit(127);
+  }
+
+  int status;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) != pid) {
+    std::cerr << "error : can't wait for " << command << std::endl;
+    return false;
+  }
+  std::cout << command << " : peak RSS " << usage.ru_maxrss << " KiB" << std::endl;
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    std::cerr << "error : " << command << " failed" << std::endl;
+    return false;
+  }
+  if (usage.ru_maxrss > kRssCeilingKb) {
+    std::cerr << "error : " << command << " went over the " << kRssCeilingKb << " KiB ceiling"
+              << std::endl;
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 4) {
+    std::cerr << "Usage : " << argv[0] << " <extract-gpubin> <update-fatbin> <work-dir>"
+              << std::endl;
+    exit(1);
+  }
+  std::string extractGpubin(argv[1]);
+  std::string updateFatbin(argv[2]);
+  std::string fatbinPath = std::string(argv[3]) + "/test-bundle-rss.fatbin";
+  std::string elfPath = fatbinPath + ".gfx908";
+  std::string updatedPath = fatbinPath + ".updated";
+  std::string rebuiltPath = fatbinPath + ".rebuilt";
+
+  bool ok = writeBundle(fatbinPath);
+  if (!ok)
+    std::cerr << "error : can't write " << fatbinPath << std::endl;
+
+  ok = ok && run({extractGpubin, "--all", fatbinPath});
+  MappedFile elf;
+  if (ok && (!elf.open(elfPath).empty() || !isCodeObject(elf.getRange()))) {
+    std::cerr << "error : " << elfPath << " isn't the extracted code object" << std::endl;
+    ok = false;
+  }
+
+  // The extracted code object fits its own slot, so the first update patches it in place.
+  ok = ok && run({updateFatbin, "-o", updatedPath, fatbinPath, "gfx908=" + elfPath});
+  if (ok && !isBundle(updatedPath)) {
+    std::cerr << "error : " << updatedPath << " doesn't hold the code object" << std::endl;
+    ok = false;
+  }
+  ok = ok && run({updateFatbin, "--rebuild", "-o", rebuiltPath, fatbinPath, "gfx908=" + elfPath});
+  if (ok && !isBundle(rebuiltPath)) {
+    std::cerr << "error : " << rebuiltPath << " doesn't hold the code object" << std::endl;
+    ok = false;
+  }
+
+  for (const std::string &path :
+       {fatbinPath, elfPath, fatbinPath + ".index.json", updatedPath, rebuiltPath})
+    unlink(path.c_str());
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,226 @@
+#include "counter-ring.h"
+
+#include <algorithm>
+#include <csignal>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <sys/wait.h>
+#include <vector>
+
+// usage:
+// test-counter-ring <counter-collector> <work-dir>
+//
+// Starts counter-collector with a small ring, forks kNumProducers processes that each push
+// kRecordsPerProducer records into it in bursts, then stops the collector and checks
+// its output against what the producers report: every record that was pushed is in the totals,
+// and the dropped count is the number of pushes that failed. Also checks that attaching to a ring
+// that isn't initialized fails instead of faulting.
+
+static constexpr unsigned kNumProducers = 8;
+static constexpr uint64_t kRecordsPerProducer = 20000;
+static constexpr unsigned kNumKernels = 2;
+static constexpr uint64_t kNumSlots = 256;
+// Producers pause after every burst, so that most records get through and some are dropped.
+static constexpr uint64_t kBurstSize = 16;
+
+struct ProducerResult {
+  unsigned producer = 0;
+  uint64_t pushed = 0;
+  uint64_t dropped = 0;
+};
+
+// Attaching to objects that aren't rings, or not yet, fails.
+static bool checkAttachFailures(const std::string &ringName) {
+  int fd = shm_open(ringName.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (fd < 0) {
+    std::cerr << "error : can't create " << ringName << std::endl;
+    return false;
+  }
+
+  // Created but not sized yet, as between shm_open and ftruncate in CounterRing::create.
+  bool ok = true;
+  CounterRing empty;
+  if (empty.attach(ringName)) {
+    std::cerr << "error : attached to an empty object" << std::endl;
+    ok = false;
+  }
+
+  // A valid header that claims more slots than the object holds.
+  CounterRingHeader header;
+  header.magic.store(getCounterRingMagic());
+  header.recordSize = sizeof(CounterRecord);
+  header.numSlots = 1 << 20;
+  if (ftruncate(fd, getCounterRingSize(4)) != 0 ||
+      pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+    std::cerr << "error : can't write " << ringName << std::endl;
+    ok = false;
+  }
+  CounterRing truncated;
+  if (ok && truncated.attach(ringName)) {
+    std::cerr << "error : attached to a ring smaller than its header says" << std::endl;
+    ok = false;
+  }
+
+  close(fd);
+  shm_unlink(ringName.c_str());
+  return ok;
+}
+
+static ProducerResult produce(const std::string &ringName, unsigned producer) {
+  ProducerResult result;
+  result.producer = producer;
+  CounterRing ring;
+  // The collector may not have created the ring yet.
+  for (int attempt = 0; !ring.attach(ringName); ++attempt) {
+    if (attempt == 10000) {
+      std::cerr << "error : can't attach to " << ringName << std::endl;
+      _exit(1);
+    }
+    timespec delay = {0, 1000000};
+    nanosleep(&delay, nullptr);
+  }
+
+  CounterRecord record = {};
+  record.setKernelName("kernel" + std::to_string(producer % kNumKernels));
+  record.pid = getpid();
+  record.firstVar = 0;
+  record.numValues = 1;
+  record.values[0] = 1;
+  for (uint64_t i = 0; i < kRecordsPerProducer; ++i) {
+    if (ring.push(record))
+      result.pushed++;
+    else
+      result.dropped++;
+    if (i % kBurstSize == kBurstSize - 1) {
+      timespec pause = {0, 200000};
+      nanosleep(&pause, nullptr);
+    }
+  }
+  return result;
+}
+
+// The totals of a collector output, summed over the kernels.
+struct CollectorTotals {
+  uint64_t processes = 0;
+  uint64_t dropped = 0;
+  uint64_t launches = 0;
+  uint64_t sum = 0;
+  unsigned kernels = 0;
+};
+
+static bool readTotals(const std::string &path, CollectorTotals &totals) {
+  std::ifstream output(path);
+  std::string line;
+  while (std::getline(output, line)) {
+    static const std::string kernelPrefix = "Aggregated instrumentation variable values for ";
+    if (line.rfind("processes : ", 0) == 0) {
+      totals.processes = std::stoull(line.substr(12));
+    } else if (line.rfind("dropped records : ", 0) == 0) {
+      totals.dropped = std::stoull(line.substr(18));
+    } else if (line.rfind(kernelPrefix, 0) == 0) {
+      size_t paren = line.find(" (", kernelPrefix.size());
+      if (paren == std::string::npos)
+        return false;
+      totals.launches += std::stoull(line.substr(paren + 2));
+      totals.kernels++;
+    } else if (line.rfind("var0 = ", 0) == 0) {
+      totals.sum += std::stoull(line.substr(7));
+    }
+  }
+  return static_cast<bool>(output.eof());
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 3) {
+    std::cerr << "Usage : " << argv[0] << " <counter-collector> <work-dir>" << std::endl;
+    exit(1);
+  }
+  std::string collectorPath(argv[1]);
+  std::string ringName = "/test-counter-ring-" + std::to_string(getpid());
+  std::string outputPath = std::string(argv[2]) + "/test-counter-ring.out";
+
+  if (!checkAttachFailures(ringName))
+    return 1;
+
+  pid_t collector = fork();
+  if (collector == 0) {
+    std::string slots = std::to_string(kNumSlots);
+    execl(collectorPath.c_str(), collectorPath.c_str(), ringName.c_str(), "--slots",
+          slots.c_str(), "--output", outputPath.c_str(), nullptr);
+    _exit(127);
+  }
+
+  // Every producer writes its ProducerResult to the pipe before it exits.
+  int results[2];
+  if (collector < 0 || pipe(results) != 0) {
+    std::cerr << "error : can't start the collector" << std::endl;
+    return 1;
+  }
+  std::vector<pid_t> producers;
+  for (unsigned p = 0; p < kNumProducers; ++p) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(results[0]);
+      ProducerResult result = produce(ringName, p);
+      _exit(write(results[1], &result, sizeof(result)) == sizeof(result) ? 0 : 1);
+    }
+    producers.push_back(pid);
+  }
+  close(results[1]);
+
+  // Only producers that got a record in count as processes, and their kernels as kernels.
+  bool ok = true;
+  ProducerResult expected;
+  uint64_t expectedProcesses = 0;
+  std::vector<bool> isKernelSeen(kNumKernels, false);
+  for (unsigned p = 0; p < kNumProducers; ++p) {
+    ProducerResult result;
+    if (read(results[0], &result, sizeof(result)) != sizeof(result)) {
+      std::cerr << "error : a producer failed" << std::endl;
+      ok = false;
+      break;
+    }
+    expected.pushed += result.pushed;
+    expected.dropped += result.dropped;
+    if (result.pushed) {
+      expectedProcesses++;
+      isKernelSeen[result.producer % kNumKernels] = true;
+    }
+  }
+  unsigned expectedKernels = std::count(isKernelSeen.begin(), isKernelSeen.end(), true);
+  for (pid_t pid : producers)
+    waitpid(pid, nullptr, 0);
+
+  // The collector takes what is left in the ring when it stops.
+  int status;
+  kill(collector, SIGTERM);
+  if (waitpid(collector, &status, 0) != collector || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0) {
+    std::cerr << "error : the collector failed" << std::endl;
+    ok = false;
+  }
+
+  CollectorTotals totals;
+  if (ok && !readTotals(outputPath, totals)) {
+    std::cerr << "error : can't read " << outputPath << std::endl;
+    ok = false;
+  }
+  unlink(outputPath.c_str());
+  if (!ok)
+    return 1;
+
+  std::cout << "pushed " << expected.pushed << ", dropped " << expected.dropped << std::endl;
+  std::cout << "collected " << totals.launches << " launches of " << totals.kernels
+            << " kernels from " << totals.processes << " processes, " << totals.dropped
+            << " dropped" << std::endl;
+  if (expected.pushed + expected.dropped != kNumProducers * kRecordsPerProducer ||
+      totals.launches != expected.pushed || totals.sum != expected.pushed ||
+      totals.dropped != expected.dropped || totals.processes != expectedProcesses ||
+      totals.kernels != expectedKernels) {
+    std::cerr << "error : the collector totals don't match the producers" << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -1,17 +1,27 @@
 #include "elfio/elfio.hpp"
+#include "offload-bundle.h"
 
+#include <atomic>
 #include <cassert>
 #include <cstdio>
 #include <iomanip>
 #include <iostream>
+#include <memory>
+#include <thread>
 #include <unordered_map>
+#include <vector>
 
 // This tool creates a clone of the original executable, adds the new fatbin
 // to the clone, and later patches the clone so that the Linux kernel loader can
 // see the program headers.
 //
 // usage:
-// update-exec <og-exec> <fatbin> <new-exec>
+// update-exec <og-exec> <fatbin>... <new-exec>
+//
+// The .hip_fatbin section may hold several bundles (one per translation unit, or from -fgpu-rdc),
+// each referenced by a wrapper in .hipFatBinSegment. The bundles in the given fatbins, in order,
+// replace the bundles of the section in order, and every wrapper is pointed at its new bundle.
+// Bundles without a replacement stay where they are.
 
 // These maps are for correcting the section links in the clone.
 std::unordered_map<ELFIO::section *, ELFIO::section *> ogToNewSectionMap;
@@ -20,8 +30,8 @@ std::unordered_map<ELFIO::section *, ELFIO::section *> newToOgSectionMap;
 static void showHelp(const char *toolName) {
   std::cout << "usage : \n";
   std::cout << "  ";
-  std::cout << toolName << " <og-exec> <fatbin> <new-exec> \n\n";
-  std::cout << toolName << " will emit <new-exec> containing the <fatbin>\n";
+  std::cout << toolName << " <og-exec> <fatbin>... <new-exec> \n\n";
+  std::cout << toolName << " will emit <new-exec> containing the <fatbin>s\n";
 }
 
 static void dumpSection(const ELFIO::section *section, bool printContents = true) {
@@ -65,20 +75,6 @@ ELFIO::section *getFatbinWrapperSection(const ELFIO::elfio &file) {
 //
 // === SECTION-GETTING HELPERS END ===
 
-static size_t getFileSize(const std::string &filePath) {
-  std::ifstream file(filePath);
-  assert(file.is_open());
-
-  file.seekg(0, std::ifstream::end);
-
-  std::streampos pos = file.tellg();
-  std::streamoff offset = pos - std::streampos(0);
-  uint64_t size = static_cast<size_t>(offset);
-
-  file.close();
-  return size;
-}
-
 ELFIO::segment *getPtLoad1(const ELFIO::elfio &file) {
   for (int i = 0; i < file.segments.size(); ++i) {
     auto segment = file.segments[i];
@@ -254,17 +250,97 @@ void cloneExec(const ELFIO::elfio &ogExec, ELFIO::elfio &newExec) {
   cloneSegments(ogExec, newExec);
 }
 
-void updateFatbinAddr(ELFIO::elfio &execFile, uint64_t newAddr) {
+// A fatbin wrapper is { uint32_t magic; uint32_t version; uint64_t bundleAddr; uint64_t unused; }.
+static constexpr size_t kFatbinWrapperSize = 24;
+static constexpr size_t kFatbinWrapperAddrOffset = 8;
+
+// A relocation that writes a wrapper's bundle address.
+struct WrapperReloc {
+  ELFIO::section *section;
+  ELFIO::Elf_Xword index;
+};
+
+// Maps the address each RELA entry of execFile patches to that entry.
+std::unordered_map<uint64_t, WrapperReloc> findRelocs(ELFIO::elfio &execFile) {
+  std::unordered_map<uint64_t, WrapperReloc> relocs;
+  for (auto &section : execFile.sections) {
+    if (section->get_type() != ELFIO::SHT_RELA)
+      continue;
+    ELFIO::relocation_section_accessor accessor(execFile, section.get());
+    for (ELFIO::Elf_Xword j = 0; j < accessor.get_entries_num(); ++j) {
+      ELFIO::Elf64_Addr offset;
+      ELFIO::Elf_Word symbol;
+      unsigned type;
+      ELFIO::Elf_Sxword addend;
+      accessor.get_entry(j, offset, symbol, type, addend);
+      relocs[offset] = {section.get(), j};
+    }
+  }
+  return relocs;
+}
+
+// Points every wrapper that refers to one of the first newOffsets.size() bundles of the original
+// .hip_fatbin at the same bundle in the new fatbin, loaded at newAddr. In a PIE the wrapper holds
+// 0 and the bundle address is the addend of an R_X86_64_RELATIVE relocation, which is patched
+// instead.
+void updateFatbinAddrs(ELFIO::elfio &execFile, uint64_t oldAddr,
+                       const std::vector<BundleExtent> &oldBundles, uint64_t newAddr,
+                       const std::vector<uint64_t> &newOffsets) {
   ELFIO::section *fatbinWrapperSection = getFatbinWrapperSection(execFile);
+  size_t numWrappers = fatbinWrapperSection->get_size() / kFatbinWrapperSize;
+  std::unordered_map<uint64_t, WrapperReloc> relocs = findRelocs(execFile);
+
+  for (size_t i = 0; i < numWrappers; ++i) {
+    uint64_t addrOffset = i * kFatbinWrapperSize + kFatbinWrapperAddrOffset;
+    uint64_t *addrPtr = (uint64_t *)(fatbinWrapperSection->get_data() + addrOffset);
+    uint64_t bundleAddr = *addrPtr;
+
+    auto relocIt = relocs.find(fatbinWrapperSection->get_address() + addrOffset);
+    std::unique_ptr<ELFIO::relocation_section_accessor> accessor;
+    ELFIO::Elf64_Addr relocOffset;
+    ELFIO::Elf_Word relocSymbol;
+    unsigned relocType;
+    ELFIO::Elf_Sxword relocAddend;
+    if (relocIt != relocs.end()) {
+      accessor = std::make_unique<ELFIO::relocation_section_accessor>(execFile,
+                                                                      relocIt->second.section);
+      accessor->get_entry(relocIt->second.index, relocOffset, relocSymbol, relocType,
+                          relocAddend);
+      if (relocType != ELFIO::R_X86_64_RELATIVE) {
+        std::cout << "fatbin wrapper " << i << " is patched by a relocation of type "
+                  << relocType << ", only R_X86_64_RELATIVE is supported\n";
+        exit(1);
+      }
+      bundleAddr = relocAddend;
+    }
 
-  // address is at offset 8.
-  uint64_t *addrPtr = (uint64_t *)(fatbinWrapperSection->get_data() + 8);
-  *addrPtr = newAddr;
+    size_t bundle = 0;
+    while (bundle < oldBundles.size() && oldAddr + oldBundles[bundle].offset != bundleAddr)
+      ++bundle;
+    if (bundle == oldBundles.size()) {
+      std::cout << "fatbin wrapper " << i << " refers to 0x" << std::hex << bundleAddr << std::dec
+                << ", which isn't the start of a bundle\n";
+      exit(1);
+    }
+
+    if (bundle < newOffsets.size()) {
+      std::cout << "fatbin wrapper " << i << " : bundle " << bundle << " moves to 0x" << std::hex
+                << newAddr + newOffsets[bundle] << std::dec << '\n';
+      if (accessor)
+        accessor->set_entry(relocIt->second.index, relocOffset, relocSymbol, relocType,
+                            newAddr + newOffsets[bundle]);
+      else
+        *addrPtr = newAddr + newOffsets[bundle];
+    }
+  }
 }
 
 // Create a .new_fatbin section, map it to a new PT_LOAD segment, update the
-// fatbin wrapper.
-void addNewFatbin(ELFIO::elfio &newExec, const char *newFatbinContent, size_t newFatbinSize) {
+// fatbin wrappers. Bundle i of the new fatbin is at newOffsets[i] and replaces bundle i of the
+// original one.
+void addNewFatbin(ELFIO::elfio &newExec, const char *newFatbinContent, size_t newFatbinSize,
+                  const std::vector<BundleExtent> &oldBundles,
+                  const std::vector<uint64_t> &newOffsets) {
 
   ELFIO::section *fatbinSection = getFatbinSection(newExec);
   assert(fatbinSection);
@@ -298,7 +374,7 @@ void addNewFatbin(ELFIO::elfio &newExec, const char *newFatbinContent, size_t ne
   newSegment->set_physical_address(nextAddr);
 
   newSegment->add_section(newFatbinSection, 1);
-  updateFatbinAddr(newExec, nextAddr);
+  updateFatbinAddrs(newExec, fatbinSection->get_address(), oldBundles, nextAddr, newOffsets);
 }
 
 // This is for patching the clone at last. For some reason, editing raw segments
@@ -377,19 +453,17 @@ void patchExec(const char *rwExecPath) {
 }
 
 int main(int argc, char **argv) {
-  if (argc != 4) {
-    std::cout << "exactly 3 arguments to " << argv[0] << " expected\n";
+  if (argc < 4) {
+    std::cout << "at least 3 arguments to " << argv[0] << " expected\n";
     showHelp(argv[0]);
     exit(1);
   }
 
   const char *execFilePath = argv[1];
-  const char *newFatbinPath = argv[2];
-  const char *rwExecPath = argv[3];
+  const char *rwExecPath = argv[argc - 1];
 
   ELFIO::elfio execFile;
   ELFIO::elfio newExecFile;
-  std::ifstream newFatbin;
 
   if (!execFile.load(execFilePath)) {
     std::cout << "can't find or process ELF file " << execFilePath << '\n';
@@ -408,17 +482,61 @@ int main(int argc, char **argv) {
     exit(1);
   }
 
-  cloneExec(execFile, newExecFile);
+  std::vector<BundleExtent> oldBundles;
+  std::string error = findOffloadBundles({fatbinSection->get_data(), fatbinSection->get_size()},
+                                         std::string(execFilePath) + " .hip_fatbin", oldBundles);
+  if (!error.empty()) {
+    std::cout << error << '\n';
+    exit(1);
+  }
 
-  size_t newFatbinSize = getFileSize(newFatbinPath);
-  char *newFatbinContent = new char[newFatbinSize];
+  // The bundles of all new fatbins, in order, each aligned like the bundles of .hip_fatbin.
+  std::vector<std::unique_ptr<MappedFile>> newFatbins;
+  std::vector<ByteSpan> newBundles;
+  for (int i = 2; i < argc - 1; ++i) {
+    auto &newFatbin = newFatbins.emplace_back(std::make_unique<MappedFile>());
+    std::vector<BundleExtent> bundles;
+    error = newFatbin->open(argv[i]);
+    if (error.empty())
+      error = findOffloadBundles(newFatbin->getBytes(), argv[i], bundles);
+    if (!error.empty()) {
+      std::cout << error << '\n';
+      exit(1);
+    }
+    for (const BundleExtent &bundle : bundles)
+      newBundles.push_back({newFatbin->getBytes().data + bundle.offset, bundle.size});
+  }
+  if (newBundles.size() > oldBundles.size()) {
+    std::cout << "the new fatbins have " << newBundles.size() << " bundles, " << execFilePath
+              << " only " << oldBundles.size() << '\n';
+    exit(1);
+  }
 
-  newFatbin.open(newFatbinPath, std::ios::binary);
-  newFatbin.read(newFatbinContent, newFatbinSize);
-  addNewFatbin(newExecFile, newFatbinContent, newFatbinSize);
+  std::vector<uint64_t> newOffsets;
+  uint64_t alignment = std::max<uint64_t>(fatbinSection->get_addr_align(), kOffloadBundleAlignment);
+  size_t newFatbinSize = 0;
+  for (const ByteSpan &bundle : newBundles) {
+    newOffsets.push_back(alignUp(newFatbinSize, alignment));
+    newFatbinSize = newOffsets.back() + bundle.size;
+  }
+
+  // The bundles are copied into the new section concurrently.
+  std::unique_ptr<char[]> newFatbinContent(new char[newFatbinSize]());
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    for (size_t i = next++; i < newBundles.size(); i = next++)
+      memcpy(newFatbinContent.get() + newOffsets[i], newBundles[i].data, newBundles[i].size);
+  };
+  std::vector<std::thread> threads;
+  unsigned numThreads = std::max(1u, std::thread::hardware_concurrency());
+  for (unsigned t = 1; t < std::min<size_t>(numThreads, newBundles.size()); ++t)
+    threads.emplace_back(worker);
+  worker();
+  for (std::thread &thread : threads)
+    thread.join();
 
-  delete[] newFatbinContent;
-  newFatbin.close();
+  cloneExec(execFile, newExecFile);
+  addNewFatbin(newExecFile, newFatbinContent.get(), newFatbinSize, oldBundles, newOffsets);
 
   std::cout << newExecFile.validate() << '\n';
   newExecFile.save(rwExecPath);